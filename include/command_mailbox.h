@@ -0,0 +1,91 @@
+#ifndef COMMAND_MAILBOX_H_
+#define COMMAND_MAILBOX_H_
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * Power changes an application task can ask the policy engine for
+ */
+enum class pd_command : uint8_t {
+  Renegotiate   = 0, // Fetch the source capabilities and let the DPM choose again
+  SetPPS        = 1, // Request a PPS output, arguments are millivolts and milliamps
+  RequestEPR    = 2, // Enter Extended Power Range mode
+  ExitEPR       = 3, // Leave EPR mode for an SPR contract
+  GetSourceCaps = 4, // Ask the source for its capabilities
+  GetStatus     = 5, // Ask the source for its Status
+};
+#define PD_COMMAND_COUNT 6
+
+enum class pd_command_status : uint8_t {
+  Idle         = 0, // Never posted
+  Pending      = 1, // Posted, waiting for the policy engine
+  Busy         = 2, // Taken by the policy engine and in progress
+  Done         = 3, // Finished successfully
+  Failed       = 4, // Rejected by the source, timed out or interrupted by a reset
+  NotSupported = 5, // Not possible with this source, contract or build
+};
+
+/*
+ * One slot per command, so each can be outstanding at most once.
+ *
+ * Any task (or interrupt) may post, only the policy engine takes and finishes.
+ * A slot is claimed with a compare-exchange, then its arguments are written
+ * before it is published as Pending, so no locks are needed on either side.
+ */
+class CommandMailbox {
+public:
+  explicit CommandMailbox() {
+    for (uint8_t i = 0; i < PD_COMMAND_COUNT; i++) {
+      slots[i].status = (uint8_t)pd_command_status::Idle;
+      slots[i].arg0   = 0;
+      slots[i].arg1   = 0;
+    }
+  }
+
+  // Returns false if the command is already pending or in progress
+  bool post(pd_command command, uint16_t arg0 = 0, uint16_t arg1 = 0) {
+    slot   &s        = slots[(uint8_t)command];
+    uint8_t expected = s.status.load();
+    do {
+      if (expected == posting || expected == (uint8_t)pd_command_status::Pending || expected == (uint8_t)pd_command_status::Busy) {
+        return false;
+      }
+    } while (!s.status.compare_exchange_weak(expected, posting));
+    s.arg0 = arg0;
+    s.arg1 = arg1;
+    s.status.store((uint8_t)pd_command_status::Pending);
+    return true;
+  }
+  pd_command_status status(pd_command command) const {
+    uint8_t value = slots[(uint8_t)command].status.load();
+    return value == posting ? pd_command_status::Pending : (pd_command_status)value;
+  }
+
+  // Policy engine side, takes the first pending command in enum order
+  bool take(pd_command *command, uint16_t *arg0, uint16_t *arg1) {
+    for (uint8_t i = 0; i < PD_COMMAND_COUNT; i++) {
+      uint8_t expected = (uint8_t)pd_command_status::Pending;
+      if (slots[i].status.compare_exchange_strong(expected, (uint8_t)pd_command_status::Busy)) {
+        *command = (pd_command)i;
+        *arg0    = slots[i].arg0;
+        *arg1    = slots[i].arg1;
+        return true;
+      }
+    }
+    return false;
+  }
+  void finish(pd_command command, pd_command_status result) { slots[(uint8_t)command].status.store((uint8_t)result); }
+
+private:
+  // Claimed by a poster that is still writing the arguments
+  static const uint8_t posting = 0xFF;
+  struct slot {
+    std::atomic<uint8_t> status;
+    uint16_t             arg0;
+    uint16_t             arg1;
+  };
+  slot slots[PD_COMMAND_COUNT];
+};
+
+#endif // COMMAND_MAILBOX_H_
@@ -21,19 +21,92 @@
 #include "pd.h"
 #include "pdb_msg.h"
 
-class FUSB302 {
+/*
+ * Bus policy for FUSB302T that calls out through function pointers set at runtime.
+ *
+ * A Bus policy provides read(), write() and delay(); these may be static
+ * members, in which case every register access can be inlined.
+ */
+class FUSB302RuntimeBus {
 public:
   typedef bool (*I2CFunc)(const uint8_t deviceAddr, const uint8_t registerAdd, const uint8_t size, uint8_t *buf);
   typedef void (*DelayFunc)(uint32_t milliseconds);
 
-  FUSB302(uint8_t address, I2CFunc read, I2CFunc write, DelayFunc delay) : DeviceAddress(address), I2CRead(read), I2CWrite(write), osDelay(delay){};
+  FUSB302RuntimeBus(uint8_t address, I2CFunc read, I2CFunc write, DelayFunc delay) : DeviceAddress(address), I2CRead(read), I2CWrite(write), osDelay(delay){};
+
+  bool read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) const { return I2CRead(DeviceAddress, registerAdd, size, buf); }
+  bool write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) const { return I2CWrite(DeviceAddress, registerAdd, size, buf); }
+  void delay(uint32_t milliseconds) const { osDelay(milliseconds); }
+
+private:
+  const uint8_t DeviceAddress; // I2C address for this device
+  // I2C bus access functions, should return true if command worked
+  // Function to read data from the FUSB302
+  const I2CFunc I2CRead;
+  // Function to write data to the FUSB302
+  const I2CFunc I2CWrite;
+  // Simple Delay function used only during startup reset
+  const DelayFunc osDelay;
+};
+
+/*
+ * Register writes gathered so that each run of consecutive addresses goes out
+ * as one auto-incrementing burst.
+ *
+ * Only SWITCHES0 (0x02) to CONTROL4 (0x10) can be batched. Runs are written in
+ * address order and a later set() of the same register replaces the earlier
+ * one, so anything that has to land first (powering up, a reset) goes in its
+ * own batch.
+ */
+class FUSB302RegisterBatch {
+public:
+  static const uint8_t firstRegister = 0x02;
+  static const uint8_t lastRegister  = 0x10;
+
+  FUSB302RegisterBatch() : pending(0){};
+
+  void set(const uint8_t reg, const uint8_t value) {
+    values[reg - firstRegister] = value;
+    pending |= 1U << (reg - firstRegister);
+  }
+  // Write out each run of pending registers, stops at the first failed write
+  template <class Bus> bool write(const Bus &bus) {
+    for (uint8_t i = 0; i <= lastRegister - firstRegister; i++) {
+      if (pending & (1U << i)) {
+        uint8_t run = 1;
+        while (i + run <= lastRegister - firstRegister && (pending & (1U << (i + run)))) {
+          run++;
+        }
+        if (!bus.write(firstRegister + i, run, values + i)) {
+          return false;
+        }
+        i += run;
+      }
+    }
+    pending = 0;
+    return true;
+  }
+
+private:
+  uint8_t  values[lastRegister - firstRegister + 1];
+  uint16_t pending;
+};
+
+/*
+ * FUSB302B driver over the given Bus policy.
+ *
+ * Method definitions live in fusb302b_impl.h; include that in one source file
+ * when using a Bus policy other than FUSB302RuntimeBus.
+ */
+template <class Bus> class FUSB302T {
+public:
+  explicit FUSB302T(const Bus &busPolicy = Bus()) : bus(busPolicy){};
 
-  void fusb_send_message(const pd_msg *msg) const;
-  bool fusb_rx_pending() const;
   /*
-   * Read a USB Power Delivery message from the FUSB302B
+   * Write a message to the TX FIFO for the PHY to send, stops at the first
+   * failed write and flushes what did get written
    */
-  uint8_t fusb_read_message(pd_msg *msg) const;
+  bool fusb_send_message(const pd_msg *msg) const;
 
   /*
    * Tell the FUSB302B to send a hard reset signal
@@ -63,6 +136,25 @@ public:
    */
   bool fusb_get_status(fusb_status *status) const;
 
+  /*
+   * Read the status and interrupt flags, then the RX FIFO only if they say a
+   * message is waiting. The message is read into *msg, and *rx says whether
+   * there was one and who it was for. A message that could not be read in
+   * full is flushed, along with anything behind it.
+   */
+  bool fusb_read_status_and_message(fusb_status *status, pd_msg *msg, enum fusb_rx_result *rx) const;
+
+  /*
+   * Decode the outcome of the last transmission from a status read
+   */
+  static enum fusb_tx_result fusb_get_tx_result(const fusb_status *status);
+
+  /*
+   * Unmask only the interrupts needed for a set of fusb_interrupt_source,
+   * everything else is masked so it no longer asserts INT_N
+   */
+  bool fusb_set_interrupts(uint8_t sources) const;
+
   /*
    * Read the FUSB302B BC_LVL as an enum fusb_typec_current
    */
@@ -78,6 +170,11 @@ public:
    */
   bool fusb_reset() const;
 
+  /*
+   * Drop everything in the RX FIFO
+   */
+  bool fusb_flush_rx() const;
+
   bool fusb_read_id() const;
 
   bool runCCLineSelection() const;
@@ -86,17 +183,23 @@ public:
   bool isVBUSConnected() const;
 
 private:
-  const uint8_t DeviceAddress; // I2C address for this device
-  // I2C bus access functions, should return true if command worked
-  // Function to read data from the FUSB302
-  const I2CFunc I2CRead;
-  // Function to write data to the FUSB302
-  const I2CFunc I2CWrite;
-  // Simple Delay function used only during startup reset
-  const DelayFunc osDelay;
+  const Bus bus;
 
   uint8_t fusb_read_byte(const uint8_t addr) const;
   bool    fusb_write_byte(const uint8_t addr, const uint8_t byte) const;
 };
 
+extern template class FUSB302T<FUSB302RuntimeBus>;
+
+/*
+ * The FUSB302B driver using I2C functions provided at runtime
+ */
+class FUSB302 : public FUSB302T<FUSB302RuntimeBus> {
+public:
+  typedef FUSB302RuntimeBus::I2CFunc   I2CFunc;
+  typedef FUSB302RuntimeBus::DelayFunc DelayFunc;
+
+  FUSB302(uint8_t address, I2CFunc read, I2CFunc write, DelayFunc delay) : FUSB302T<FUSB302RuntimeBus>(FUSB302RuntimeBus(address, read, write, delay)){};
+};
+
 #endif /* PDB_FUSB302B_H */
@@ -0,0 +1,78 @@
+#ifndef MSGQUEUE_H_
+#define MSGQUEUE_H_
+
+#include "pd.h"
+#include "pdb_msg.h"
+#include <string.h>
+/*
+ * A queue of PD messages packed into size bytes.
+ *
+ * Only the header and the data objects it declares are stored, so control
+ * messages take 2 bytes instead of a full pd_msg. The length is recovered from
+ * the header's object count, so no extra bytes are kept per message.
+ * Like ringbuffer, pushing into a full queue drops the oldest messages.
+ */
+template <size_t size> class msgqueue {
+  static_assert(size >= sizeof(pd_msg().bytes), "msgqueue must be able to hold the largest message");
+
+public:
+  explicit msgqueue() : begin(0), used(0), count(0) {}
+
+  void push(const pd_msg *msg) {
+    const size_t length = messageLength(msg->hdr);
+    // Make room by dropping from the front, the same as ringbuffer does
+    while (size - used < length) {
+      pop(nullptr);
+    }
+    size_t end = (begin + used) % size;
+    if (end + length <= size) {
+      memcpy(buffer + end, msg->bytes, length);
+    } else {
+      size_t first = size - end;
+      memcpy(buffer + end, msg->bytes, first);
+      memcpy(buffer, msg->bytes + first, length - first);
+    }
+    used += length;
+    count++;
+  }
+  // Give null to just drop the message
+  // Only the header and its data objects are written to dest
+  void pop(pd_msg *dest) {
+    if (count == 0) {
+      return;
+    }
+    const uint16_t hdr    = buffer[begin] | (buffer[(begin + 1) % size] << 8);
+    const size_t   length = messageLength(hdr);
+    if (dest) {
+      if (begin + length <= size) {
+        memcpy(dest->bytes, buffer + begin, length);
+      } else {
+        size_t first = size - begin;
+        memcpy(dest->bytes, buffer + begin, first);
+        memcpy(dest->bytes + first, buffer, length - first);
+      }
+    }
+    begin = (begin + length) % size;
+    used -= length;
+    count--;
+  }
+  // Returns number of messages queued
+  size_t getOccupied() const { return count; }
+
+  // Returns the number of bytes free
+  size_t getFree() const { return size - used; }
+  // Clear the entire queue
+  void flush() {
+    begin = used = count = 0;
+  }
+
+private:
+  static size_t messageLength(uint16_t hdr) { return 2 + ((hdr & PD_HDR_NUMOBJ) >> PD_HDR_NUMOBJ_SHIFT) * 4; }
+
+  uint8_t buffer[size];
+  size_t  begin;
+  size_t  used;
+  size_t  count;
+};
+
+#endif // MSGQUEUE_H_
@@ -123,6 +123,19 @@
 #define PD_NUMOBJ(n)       (((n) << PD_HDR_NUMOBJ_SHIFT) & PD_HDR_NUMOBJ)
 #define PD_NUMOBJ_GET(msg) (((msg)->hdr & PD_HDR_NUMOBJ) >> PD_HDR_NUMOBJ_SHIFT)
 
+/*
+ * Message kind
+ *
+ * Control, Data and Extended messages reuse the same type numbers. The kind
+ * is the type with whether it is Extended (otherwise whether it has data
+ * objects) on top, so one compare, or one table index, tells them apart.
+ */
+#define PD_MSGKIND_CONTROL(type)  (type)
+#define PD_MSGKIND_DATA(type)     (0x20 | (type))
+#define PD_MSGKIND_EXTENDED(type) (0x40 | (type))
+#define PD_MSGKIND_COUNT          0x60
+#define PD_MSGKIND_GET(msg)       ((((msg)->hdr & PD_HDR_EXT) ? 0x40 : ((msg)->hdr & PD_HDR_NUMOBJ) ? 0x20 : 0) | PD_MSGTYPE_GET(msg))
+
 /*
  * PD Extended Message Header
  */
@@ -280,6 +293,8 @@
 #define PD_RDO_PROG_CURRENT_SHIFT 0
 #define PD_RDO_PROG_CURRENT       (0x7F << PD_RDO_PROG_CURRENT_SHIFT)
 
+#define PD_RDO_AVS_VOLTAGE        (0xFFF << PD_RDO_PROG_VOLTAGE_SHIFT)
+
 #define PD_RDO_PROG_VOLTAGE_SET(i) (((i) << PD_RDO_PROG_VOLTAGE_SHIFT) & PD_RDO_PROG_VOLTAGE)
 #define PD_RDO_PROG_CURRENT_SET(i) (((i) << PD_RDO_PROG_CURRENT_SHIFT) & PD_RDO_PROG_CURRENT)
 
@@ -307,14 +322,29 @@
 #define PD_T_HARD_RESET_COMPLETE    (1 * 1000)
 #define PD_T_PS_TRANSITION          (5 * 1000)
 #define PD_T_SENDER_RESPONSE        (2700)
+/* Not from the specification, which has an EPR_KeepAlive wait tSenderResponse for its ACK. That is longer
+ * than the source keeps EPR mode without one, so a local choice: the keepalive, one resend and the wait
+ * for its ACK all fit in tSourceEPRKeepAlive (750ms at the least) */
+#define PD_T_EPR_KEEPALIVE_ACK      (150)
 #define PD_T_SINK_REQUEST           (1 * 1000)
 #define PD_T_TYPEC_SINK_WAIT_CAP    (10 * 1000)
 #define PD_T_PD_DEBOUNCE            (2 * 1000)
+#define PD_T_SAFE_0V                (650)
+#define PD_T_SRC_RECOVER_MAX        (1 * 1000)
+#define PD_T_SRC_TURN_ON            (275)
+/* Not from the specification, the FUSB302B reports a send (all retries included) well within this */
+#define PD_T_TX_RESULT              (20)
+/* The PPS re-request is due within tPPSRequest (10s), sent 2s early so a busy link cannot make it late */
+#define PD_T_PPS_REREQUEST          (8 * 1000)
+/* tSinkEPRKeepAlive, the longest the sink goes without sending anything while in EPR mode */
+#define PD_T_EPR_KEEPALIVE          (375)
 
 /*
  * Counter maximums
  */
 #define PD_N_HARD_RESET_COUNT 2
+/* Not from the specification, EPR_KeepAlive messages resent before a missing ACK means a hard reset */
+#define PD_N_EPR_KEEPALIVE_RETRY_COUNT 1
 
 /*
  * Value parameters
@@ -322,6 +352,7 @@
 #define PD_MAX_EXT_MSG_LEN        260
 #define PD_MAX_EXT_MSG_CHUNK_LEN  26
 #define PD_MAX_EXT_MSG_LEGACY_LEN 26
+#define PD_STATUS_DATA_LEN        7
 
 /*
  * Unit conversions
@@ -354,6 +385,7 @@
 #define PD_PRV2MV(prv) ((prv)*20)
 #define PD_PDV2MV(pdv) ((pdv)*50)
 #define PD_PAV2MV(pav) ((pav)*100)
+#define PD_APS2MV(aps) ((aps)*25)
 
 #define PD_MA2CA(ma)   (((ma) + 10 - 1) / 10)
 #define PD_MA2PDI(ma)  (((ma) + 10 - 1) / 10)
@@ -418,4 +450,27 @@
  */
 enum fusb_typec_current { fusb_tcc_none = 0, fusb_tcc_default = 1, fusb_tcc_1_5 = 2, fusb_sink_tx_ng = 2, fusb_tcc_3_0 = 3, fusb_sink_tx_ok = 3 };
 
+/*
+ * FUSB transmit result enum
+ */
+enum fusb_tx_result { fusb_tx_pending = 0, fusb_tx_sent = 1, fusb_tx_retry_failed = 2, fusb_tx_discarded = 3 };
+
+/*
+ * FUSB receive result enum, SOP' and SOP'' messages are read out but not for us
+ */
+enum fusb_rx_result { fusb_rx_none = 0, fusb_rx_sop = 1, fusb_rx_other = 2 };
+
+/*
+ * FUSB interrupt sources, combined into a set for fusb_set_interrupts
+ */
+enum fusb_interrupt_source {
+  fusb_irq_rx        = (1 << 0),
+  fusb_irq_tx        = (1 << 1),
+  fusb_irq_ocp_temp  = (1 << 2),
+  fusb_irq_bc_lvl    = (1 << 3),
+  fusb_irq_hard_sent = (1 << 4),
+  fusb_irq_vbus      = (1 << 5),
+  fusb_irq_hard_rst  = (1 << 6),
+};
+
 #endif /* PDB_PD_H */
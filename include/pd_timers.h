@@ -0,0 +1,75 @@
+#ifndef PD_TIMERS_H_
+#define PD_TIMERS_H_
+
+#include <stdint.h>
+
+/*
+ * A fixed set of one-shot timers sharing one clock.
+ *
+ * Each timer keeps when it was started and for how long, not an absolute
+ * deadline. Elapsed time is the unsigned difference from the start, so the
+ * comparisons stay right when the tick counter wraps (as long as no timer is
+ * left unchecked for a whole wrap). A timer expires once more than its
+ * duration has elapsed, the same as the `now - start > duration` checks it
+ * replaces. Timers are identified by index, so the owner keeps its own enum.
+ */
+template <typename Tick, uint8_t count> class TimerService {
+public:
+  static const Tick forever = (Tick)~(Tick)0;
+
+  explicit TimerService() : runningMask(0) {
+    for (uint8_t i = 0; i < count; i++) {
+      started[i]  = 0;
+      duration[i] = 0;
+    }
+  }
+
+  // Give forever for a timer that only measures elapsed time and never expires
+  void start(uint8_t timer, Tick now, Tick ticks) {
+    started[timer]  = now;
+    duration[timer] = ticks;
+    runningMask |= bit(timer);
+  }
+  void stop(uint8_t timer) { runningMask &= ~bit(timer); }
+  bool running(uint8_t timer) const { return runningMask & bit(timer); }
+
+  Tick elapsed(uint8_t timer, Tick now) const { return (Tick)(now - started[timer]); }
+  bool expired(uint8_t timer, Tick now) const { return running(timer) && elapsed(timer, now) > duration[timer]; }
+  // Ticks left before it expires, 0 once it has (or if it is stopped)
+  Tick remaining(uint8_t timer, Tick now) const {
+    if (!running(timer) || expired(timer, now)) {
+      return 0;
+    }
+    return duration[timer] - elapsed(timer, now);
+  }
+
+  // Ticks until the first of the given timers expires, 0 if one already has, forever if none are running
+  Tick untilNext(Tick now, uint32_t mask = ~(uint32_t)0) const {
+    Tick next = forever;
+    for (uint8_t i = 0; i < count; i++) {
+      if (!(mask & bit(i)) || !running(i) || duration[i] == forever) {
+        continue;
+      }
+      if (expired(i, now)) {
+        return 0;
+      }
+      // One tick past the remaining time, as that is when it counts as expired
+      Tick until = duration[i] - elapsed(i, now) + 1;
+      if (until < next) {
+        next = until;
+      }
+    }
+    return next;
+  }
+
+private:
+  static_assert(count <= 32, "TimerService keeps its running flags in a uint32_t");
+  static uint32_t bit(uint8_t timer) { return (uint32_t)1 << timer; }
+
+  Tick     started[count];
+  Tick     duration[count];
+  uint32_t runningMask;
+};
+template <typename Tick, uint8_t count> const Tick TimerService<Tick, count>::forever;
+
+#endif // PD_TIMERS_H_
@@ -17,9 +17,12 @@
 
 #ifndef PDB_POLICY_ENGINE_H
 #define PDB_POLICY_ENGINE_H
+#include "command_mailbox.h"
 #include "fusb302b.h"
 #include "pdb_msg.h"
-#include "ringbuffer.h"
+#include "msgqueue.h"
+#include "pd_timers.h"
+#include <atomic>
 #include <cstring>
 #include <stdint.h>
 
@@ -31,8 +34,91 @@
 #define TICK_MAX_DELAY 0xFFFFFFFF
 #endif
 
+/*
+ * Build time feature selection, these should be set the same for the library and its users
+ *
+ * PD_DISABLE_EPR      - Leave out Extended Power Range (EPR) mode entry and keepalive
+ * PD_DISABLE_PPS      - Leave out PPS contract tracking and the periodic PPS re-request
+ * PD_DISABLE_CHUNKING - Leave out reassembly of chunked extended messages
+ * PD_RX_QUEUE_LENGTH  - Number of full size received messages that can be waiting for the policy engine,
+ *                       shorter messages are packed so several times as many control messages fit
+ * PD_UNRESPONSIVE_RERUN_CC_SELECTION - Re-run CC line selection when a source that never spoke PD changes its Rp
+ * PD_SEND_HARD_RESET  - Really signal hard resets and follow the source through its VBUS cycle, only for
+ *                       sinks that are not powered from VBUS (otherwise the reset takes our own power away)
+ */
+#if defined(PD_DISABLE_CHUNKING) && !defined(PD_DISABLE_EPR)
+#error "EPR source capabilities arrive chunked, PD_DISABLE_CHUNKING requires PD_DISABLE_EPR"
+#endif
+#ifndef PD_RX_QUEUE_LENGTH
+#define PD_RX_QUEUE_LENGTH 8
+#endif
+
 #define EVENT_MASK(x) (1 << x)
-class PolicyEngine {
+
+/*
+ * Contract changes reported to the callback set with setContractCallback()
+ */
+enum class pd_contract_event : uint8_t {
+  Established        = 0, // First explicit contract, after PS_RDY
+  Changed            = 1, // A new voltage or current was agreed, after PS_RDY
+  Lost               = 2, // The contract is gone (reset or renegotiation from scratch), back to vSafe5V
+  EPREntered         = 3, // The agreed contract is an EPR one
+  EPRExited          = 4, // The agreed contract is an SPR one again
+  SourceUnresponsive = 5, // The source never answered, only Type-C current is available
+};
+
+// The kind of source PDO a contract was agreed against
+enum class pd_pdo_kind : uint8_t {
+  None     = 0, // No explicit contract
+  Fixed    = 1,
+  Battery  = 2,
+  Variable = 3,
+  PPS      = 4,
+  AVS      = 5,
+};
+
+/*
+ * The explicit contract currently in place, decoded once when PS_RDY arrives.
+ * For PPS and AVS the voltage and current are the programmed (requested) values.
+ */
+struct pd_contract {
+  uint8_t     position    = 0; // Object position of the PDO in the source capabilities, 0 when none
+  pd_pdo_kind kind        = pd_pdo_kind::None;
+  bool        epr         = false;
+  uint32_t    millivolts  = 0;
+  uint32_t    milliamps   = 0;
+  TICK_TYPE   established = 0; // When this voltage and current were first agreed
+  TICK_TYPE   updated     = 0; // When the source last confirmed it, PPS re-requests move this on
+};
+
+/*
+ * Platform policy for PolicyEngineT that calls out through function pointers set at runtime.
+ *
+ * A Platform policy provides getTimeStamp() and delay(); these may be static
+ * members, in which case the calls can be inlined into the state machine.
+ */
+class PolicyEngineRuntimePlatform {
+public:
+  typedef TICK_TYPE (*TimestampFunc)();
+  typedef void (*DelayFunc)(TICK_TYPE milliseconds);
+
+  PolicyEngineRuntimePlatform(TimestampFunc getTimestampF, DelayFunc delayFuncF) : getTimeStampF(getTimestampF), osDelayF(delayFuncF) {}
+
+  TICK_TYPE getTimeStamp() const { return getTimeStampF(); }
+  void      delay(TICK_TYPE milliseconds) const { osDelayF(milliseconds); }
+
+private:
+  const TimestampFunc getTimeStampF;
+  const DelayFunc     osDelayF;
+};
+
+/*
+ * Device policy manager policy for PolicyEngineT that calls out through function pointers set at runtime.
+ *
+ * A Dpm policy provides evaluateCapability(), evaluateEPRCapability() and
+ * getSinkCapability(), which may likewise be static members.
+ */
+class PolicyEngineRuntimeDpm {
 public:
   // Functions required to be created by the user for their end application
   /*
@@ -48,26 +134,47 @@ public:
    * Create a Sink_Capabilities message for our current capabilities.
    */
   typedef void (*SinkCapabilityFunc)(pd_msg *cap, const bool isPD3);
-  typedef TICK_TYPE (*TimestampFunc)();
-  typedef void (*DelayFunc)(TICK_TYPE milliseconds);
-  PolicyEngine(FUSB302                   fusbStruct,       //
-               TimestampFunc             getTimestampF,    //
-               DelayFunc                 delayFuncF,       //
-               SinkCapabilityFunc        sinkCapabilities, //
-               EvaluateCapabilityFunc    evalFunc,         //
-               EPREvaluateCapabilityFunc eprEvalFunc,      //
-               const uint8_t             device_max_epr_wattage)       //
-      : fusb(fusbStruct),                                  //
-        getTimeStamp(getTimestampF),                       //
-        pdbs_dpm_get_sink_capability(sinkCapabilities),    //
-        pdbs_dpm_evaluate_capability(evalFunc),            //
-        pdbs_dpm_epr_evaluate_capability(eprEvalFunc),     //
-        osDelay(delayFuncF)                                //
+
+  PolicyEngineRuntimeDpm(SinkCapabilityFunc sinkCapabilities, EvaluateCapabilityFunc evalFunc, EPREvaluateCapabilityFunc eprEvalFunc)
+      : pdbs_dpm_get_sink_capability(sinkCapabilities), pdbs_dpm_evaluate_capability(evalFunc), pdbs_dpm_epr_evaluate_capability(eprEvalFunc) {}
+
+  bool evaluateCapability(const pd_msg *capabilities, pd_msg *request) const { return pdbs_dpm_evaluate_capability(capabilities, request); }
+  bool evaluateEPRCapability(const epr_pd_msg *capabilities, pd_msg *request) const { return pdbs_dpm_epr_evaluate_capability(capabilities, request); }
+  void getSinkCapability(pd_msg *cap, const bool isPD3) const { pdbs_dpm_get_sink_capability(cap, isPD3); }
+
+private:
+  const SinkCapabilityFunc        pdbs_dpm_get_sink_capability;
+  const EvaluateCapabilityFunc    pdbs_dpm_evaluate_capability;
+  const EPREvaluateCapabilityFunc pdbs_dpm_epr_evaluate_capability;
+};
+
+/*
+ * The sink policy engine, parameterised on its Platform, Dpm and FUSB302 driver.
+ *
+ * Method definitions live in policy_engine_impl.h; include that in one source
+ * file when using policies other than the runtime ones used by PolicyEngine.
+ */
+template <class Platform, class Dpm, class Fusb = FUSB302> class PolicyEngineT {
+public:
+  PolicyEngineT(Fusb            fusbStruct,             //
+                const uint8_t   device_max_epr_wattage, //
+                const Platform &platformPolicy = Platform(),
+                const Dpm      &dpmPolicy      = Dpm()) //
+      : fusb(fusbStruct),                               //
+        platform(platformPolicy),                       //
+        dpm(dpmPolicy)                                  //
   {
-    hdr_template       = PD_DATAROLE_UFP | PD_POWERROLE_SINK;
-    _pps_index         = 0xFF;
-    device_epr_wattage = device_max_epr_wattage;
-    is_epr             = false;
+    hdr_template        = PD_DATAROLE_UFP | PD_POWERROLE_SINK;
+    _hard_reset_counter = 0;
+    _explicit_contract  = false;
+#ifndef PD_DISABLE_PPS
+    _pps_index = 0xFF;
+#endif
+#ifndef PD_DISABLE_EPR
+    device_epr_wattage         = device_max_epr_wattage;
+    is_epr                     = false;
+    negotiationOfEPRInProgress = false;
+#endif
   };
   // Runs the internal thread, returns true if should re-run again immediately if possible
   bool thread();
@@ -76,33 +183,45 @@ public:
   bool isPD3_0();
   bool hasExplicitContract() { return _explicit_contract; }
   bool setupCompleteOrTimedOut(uint8_t timeout) {
+#ifndef PD_DISABLE_EPR
     if (negotiationOfEPRInProgress) {
       return false;
     }
+#endif
     if (_explicit_contract) {
       return true;
     }
-    if (state == policy_engine_state::PESinkSourceUnresponsive) {
+    if (currentStateCode(true) == policy_engine_state::PESinkSourceUnresponsive) {
       return true;
     }
     if (state == policy_engine_state::PESinkReady) {
       return true;
     }
-    if (PolicyEngine::NegotiationTimeoutReached(timeout)) {
+    if (NegotiationTimeoutReached(timeout)) {
       return true;
     }
     return false;
   }
   // Has pd negotiation completed
   bool pdHasNegotiated() {
-    if (state == policy_engine_state::PESinkSourceUnresponsive)
+    if (currentStateCode(true) == policy_engine_state::PESinkSourceUnresponsive)
       return false;
-    return negotiationOfEPRInProgress || _explicit_contract;
+#ifndef PD_DISABLE_EPR
+    if (negotiationOfEPRInProgress)
+      return true;
+#endif
+    return _explicit_contract;
   }
 
+#ifndef PD_DISABLE_EPR
   bool pdIsEpr() { return is_epr; }
+#else
+  bool pdIsEpr() { return false; }
+#endif
   // Call this periodically, by the spec at least once every 10 seconds for PPS. <5 is recommended
   // If in EPR should be called every 4-400 milliseconds
+  // Not needed if thread() is always run again within ticksUntilTimeout(), which covers these timers too
+  // Safe from any task or ISR, it only wakes the PD task and the timers are serviced by the next thread()
   void TimersCallback();
 
   bool NegotiationTimeoutReached(uint8_t timeout);
@@ -117,35 +236,94 @@ public:
     return (int)state;
   }
 
+  // Fetch the source capabilities and let the DPM choose again. Unlike postCommand(pd_command::Renegotiate)
+  // it is never refused: called during an AMS, including a renegotiation, it runs once that is over
   inline void renegotiate() { notify(Notifications::NEW_POWER); }
 
+  /*
+   * Queue a request from any task; it is started the next time the engine is
+   * idle in the ready state. Returns false if the same command is still pending
+   * or in progress. Poll commandStatus() for the outcome.
+   */
+  bool postCommand(pd_command command, uint16_t arg0 = 0, uint16_t arg1 = 0) {
+    if (!commands.post(command, arg0, arg1)) {
+      return false;
+    }
+    notify(Notifications::COMMAND);
+    return true;
+  }
+  pd_command_status commandStatus(pd_command command) const { return commands.status(command); }
+  // The Status data block from the last GetStatus command
+  const uint8_t *sourceStatus() const { return sourceStatusData; }
+
+  /*
+   * Optional hook so the PD task can block (RTOS semaphore, eventfd, ...) instead of polling thread().
+   * It is called whenever a notification arrives that thread() has not seen yet, from whichever context
+   * raised it (IRQOccured, TimersCallback, renegotiate or thread itself), so it must be safe to call there.
+   * Run thread() until it returns false after each wake, or once ticksUntilTimeout() has passed.
+   */
+  typedef void (*WakeFunc)(void *context);
+  void setWakeCallback(WakeFunc wakeFunc, void *context) {
+    wakeContext = context;
+    wakeF       = wakeFunc;
+  }
+  // Ticks until thread() needs to run again to handle a timeout or periodic message, TICK_MAX_DELAY if only a notification can move it on
+  TICK_TYPE ticksUntilTimeout();
+
+  /*
+   * Optional hook run from thread() as soon as a contract change is processed, so the
+   * power stage can follow it without polling. The agreed voltage and current are
+   * decoded from our request (the programmed values for PPS and AVS), 0 when lost.
+   */
+  typedef void (*ContractFunc)(void *context, pd_contract_event event, uint32_t millivolts, uint32_t milliamps);
+  void setContractCallback(ContractFunc contractFunc, void *context) {
+    contractContext = context;
+    contractF       = contractFunc;
+  }
+  /*
+   * A consistent copy of the current contract, cheap enough to call every control loop cycle.
+   * Safe from any task; if the PD task is mid update this retries until it has finished.
+   */
+  pd_contract getContract() const;
+
 private:
-  const FUSB302                   fusb;
-  const TimestampFunc             getTimeStamp;
-  const SinkCapabilityFunc        pdbs_dpm_get_sink_capability;
-  const EvaluateCapabilityFunc    pdbs_dpm_evaluate_capability;
-  const EPREvaluateCapabilityFunc pdbs_dpm_epr_evaluate_capability;
-  const DelayFunc                 osDelay;
-  int                             current_voltage_mv;   // The current voltage PD is expecting
-  int                             _requested_voltage;   // The voltage the unit wanted to requests
+  const Fusb     fusb;
+  const Platform platform;
+  const Dpm      dpm;
+
+  TICK_TYPE getTimeStamp() const { return platform.getTimeStamp(); }
+  void      osDelay(TICK_TYPE milliseconds) const { platform.delay(milliseconds); }
+  void      pdbs_dpm_get_sink_capability(pd_msg *cap, const bool isPD3) const { dpm.getSinkCapability(cap, isPD3); }
+  bool      pdbs_dpm_evaluate_capability(const pd_msg *capabilities, pd_msg *request) const { return dpm.evaluateCapability(capabilities, request); }
+  bool      pdbs_dpm_epr_evaluate_capability(const epr_pd_msg *capabilities, pd_msg *request) const { return dpm.evaluateEPRCapability(capabilities, request); }
+
   bool                            _unconstrained_power; // If the source is unconstrained
   uint8_t                         _tx_messageidcounter; // Counter for messages sent to be packed into messages sent
+  uint8_t                         rxMessageID = 0xFF;   // MessageID of the last message taken from the source, 0xFF after a reset
   uint16_t                        hdr_template;         /* PD message header template */
 
   /* Whether or not we have an explicit contract */
   bool _explicit_contract;
+#ifndef PD_DISABLE_EPR
   bool negotiationOfEPRInProgress;
+#endif
   /* The number of hard resets we've sent */
   int8_t _hard_reset_counter;
+  /* Type-C current seen at the last unresponsive source probe, 0xFF before the first probe */
+  uint8_t unresponsiveTypeCCurrent = 0xFF;
+#ifndef PD_DISABLE_PPS
   /* The index of the first PPS APDO */
   uint8_t _pps_index;
+#endif
 
-  void readPendingMessage(); // Irq read message pending from the FiFo
+  void handleReceivedMessage(); // Irq hand the message just read from the FiFo on, dropping retransmissions
 
+public:
+  // The states, as reported by currentStateCode()
   typedef enum {
     PEWaitingEvent              = 0,  // Meta state: waiting for event or timeout
     PEWaitingMessageTx          = 1,  // Meta state: waiting for message tx to confirm
-    PEWaitingMessageGoodCRC     = 2,  // We have sent a message, waiting for a GoodCRC to come back
+    // 2 was waiting for a GoodCRC message, these are now handled as they are read in
     PESinkStartup               = 3,  // Start of state machine
     PESinkDiscovery             = 4,  // no-op as source yells its features
     PESinkSetupWaitCap          = 5,  // Setup events wanted by waitCap
@@ -173,35 +351,81 @@ private:
     PESinkRequestEPR            = 27, // We're requesting the EPR capabilities
     PESinkSendEPRKeepAlive      = 28, // Send the EPR Keep Alive packet
     PESinkWaitEPRKeepAliveAck   = 29, // wait for the Source to acknowledge the keep alive
+    PESinkWaitTxOk              = 30, // Wait for the source to allow us to start an AMS (PD 3.0 collision avoidance)
+    PESinkWaitVBusOn            = 31, // After a hard reset, waiting for the source to turn VBUS back on
+    PESinkGetStatus             = 32, // Send Get_Status for a GetStatus command
+    PESinkExitEPR               = 33, // Tell the source we are leaving EPR mode
   } policy_engine_state;
+
+private:
+  // What the ready state does with a received message, looked up by its PD_MSGKIND_GET().
+  // Only the ready state has to place every kind. The others act on one to four kinds and drop
+  // the rest, so they compare kinds directly rather than each carrying a PD_MSGKIND_COUNT byte table.
+  enum ReadyAction : uint8_t {
+    ReadyUnknown              = 0, // Answered with Not_Supported on PD 3.0 (unless it is an EPR capabilities chunk), ignored on PD 2.0
+    ReadyIgnore               = 1, // Ping, Vendor_Defined
+    ReadyNotSupported         = 2, // Understood but not something a sink does
+    ReadyEvalCap              = 3,
+    ReadyGiveSinkCap          = 4,
+    ReadySoftReset            = 5,
+    ReadyStatus               = 6, // The answer to our Get_Status
+    ReadyEPRMode              = 7,
+    ReadyNotSupportedReceived = 8, // PD 3.0 only
+  };
+  static const ReadyAction readyActions[PD_MSGKIND_COUNT];
   enum class Notifications {
     RESET          = EVENT_MASK(0),  // 1
     MSG_RX         = EVENT_MASK(1),  // 2
-    TX_DONE        = EVENT_MASK(2),  // 4
-    TX_ERR         = EVENT_MASK(3),  // 8
+    TX_DONE        = EVENT_MASK(2),  // 4 Message sent and acknowledged
+    TX_ERR         = EVENT_MASK(3),  // 8 Message not acknowledged after retries
     HARD_SENT      = EVENT_MASK(4),  // 10
     I_OVRTEMP      = EVENT_MASK(5),  // 20
     PPS_REQUEST    = EVENT_MASK(6),  // 40
     GET_SOURCE_CAP = EVENT_MASK(7),  // 80
     NEW_POWER      = EVENT_MASK(8),  // 100
-    I_TXSENT       = EVENT_MASK(9),  // 200
-    I_RETRYFAIL    = EVENT_MASK(10), // 400
-    TIMEOUT        = EVENT_MASK(11), // 800 Internal notification for timeout waiting for an event
+    COMMAND        = EVENT_MASK(9),  // 200 An application task posted to the command mailbox
+    HARD_RESET     = EVENT_MASK(10), // 400 The source signalled a Hard Reset, always raised along with RESET
+    // EVENT_MASK(11) was TIMEOUT, a wait running out is now read from TimerWait after what it waited for
     REQUEST_EPR    = EVENT_MASK(12), // 1000
     EPR_KEEPALIVE  = EVENT_MASK(13), // 2000
-    ALL            = (EVENT_MASK(14) - 1),
+    SINK_TX_OK     = EVENT_MASK(14), // 4000 Rp changed to SinkTxOk
+    VBUS_OFF       = EVENT_MASK(15), // 8000
+    VBUS_ON        = EVENT_MASK(16), // 10000
+    TX_DISCARDED   = EVENT_MASK(17), // 20000 Message not sent as the source was already sending
+    ALL            = (EVENT_MASK(18) - 1),
+    TIMERS         = EVENT_MASK(18), // 40000 TimersCallback() ran, only wakes thread() so is left out of ALL
   };
   // Send a notification
-  void                notify(Notifications notification);
-  policy_engine_state postNotificationEvalState;
-  policy_engine_state postSendState;
-  policy_engine_state postSendFailedState;
-  uint32_t            waitingEventsMask            = 0;
-  TICK_TYPE            waitingEventsTimeout         = 0;
-  uint32_t            currentEvents                = 0;
-  TICK_TYPE            timestampNegotiationsStarted = 0;
-  void                clearEvents(uint32_t notification);
-  policy_engine_state waitForEvent(policy_engine_state evalState, uint32_t notification, TICK_TYPE timeout = TICK_MAX_DELAY);
+  void                  notify(Notifications notification);
+  policy_engine_state   postNotificationEvalState;
+  policy_engine_state   postTimeoutState;
+  policy_engine_state   postSendState;
+  policy_engine_state   postSendFailedState;
+  uint32_t              waitingEventsMask = 0;
+  std::atomic<uint32_t> currentEvents{0}; // Set from interrupts and other tasks, only bits seen are cleared
+  void                  clearEvents(uint32_t notification);
+  WakeFunc              wakeF       = nullptr;
+  void                 *wakeContext = nullptr;
+  // On timeout go to timeoutState, or leave it as PEWaitingEvent for the default soft reset handling
+  policy_engine_state waitForEvent(policy_engine_state evalState, uint32_t notification, TICK_TYPE timeout = TICK_MAX_DELAY, policy_engine_state timeoutState = PEWaitingEvent);
+  // Every engine timeout runs from one wrap safe timer service
+  enum PETimer : uint8_t {
+    TimerWait        = 0, // The timeout of the current waitForEvent
+    TimerCommand     = 1, // tSenderResponse for the command in progress
+    TimerNegotiation = 2, // Only measures the time since negotiation started
+    TimerPPS         = 3, // Running while on a PPS contract, for the periodic re-request
+    TimerEPR         = 4, // Since we last sent anything in EPR mode, which is what keeps it alive
+    TimerCount       = 5,
+  };
+  TimerService<TICK_TYPE, TimerCount> timers;
+  // Read once at the start of each thread() step, states use this rather than reading the clock again
+  TICK_TYPE stepTime = 0;
+  // Raise the PPS and EPR notifications that are due, a PPS request standing in for a keepalive due with it
+  void serviceTimers(TICK_TYPE now);
+  // FUSB interrupt sources currently unmasked, 0xFF when not known, as after the FUSB302 is set up or reset
+  uint8_t enabledInterrupts = 0xFF;
+  // Only let the FUSB302 interrupt us for what these notifications need
+  void updateInterrupts(uint32_t notification);
 
   policy_engine_state pe_sink_startup();
   policy_engine_state pe_sink_discovery();
@@ -222,34 +446,110 @@ private:
   policy_engine_state pe_sink_send_soft_reset_tx_ok();
   policy_engine_state pe_sink_send_soft_reset();
   policy_engine_state pe_sink_send_not_supported();
+#ifndef PD_DISABLE_CHUNKING
   policy_engine_state pe_sink_handle_epr_chunk();
   policy_engine_state pe_sink_wait_epr_chunk();
+#endif
   policy_engine_state pe_sink_not_supported_received();
   policy_engine_state pe_sink_source_unresponsive();
   policy_engine_state pe_sink_wait_event();
+  policy_engine_state pe_sink_wait_vbus_on();
+  policy_engine_state pe_sink_wait_tx_ok();
   policy_engine_state pe_sink_wait_send_done();
-  policy_engine_state pe_sink_wait_good_crc();
+  policy_engine_state pe_sink_get_status();
+#ifndef PD_DISABLE_EPR
+  policy_engine_state pe_sink_exit_epr();
+#endif
+#ifndef PD_DISABLE_EPR
   policy_engine_state pe_sink_epr_eval_cap();
   policy_engine_state pe_sink_request_epr();
   policy_engine_state pe_sink_send_epr_keep_alive();
   policy_engine_state pe_sink_wait_epr_keep_alive_ack();
+#endif
   // Sending messages, starts send and returns next state
   policy_engine_state pe_start_message_tx(policy_engine_state postTxState, policy_engine_state txFailState, pd_msg *msg);
+  // Contract change reporting
+  ContractFunc contractF          = nullptr;
+  void        *contractContext    = nullptr;
+  uint32_t     requestedPDO       = 0; // The source PDO our last request was made against
+  void         reportContractEvent(pd_contract_event event) {
+    if (contractF) {
+      contractF(contractContext, event, contract.millivolts, contract.milliamps);
+    }
+  }
+  // The current contract, odd sequence numbers mark it as being rewritten
+  pd_contract           contract;
+  std::atomic<uint32_t> contractSequence{0};
+  void                  storeContract(const pd_contract &next);
+  // PS_RDY arrived for our last request
+  void contractAgreed();
+  // Forget the contract, reporting it if there was one
+  void dropContract();
+  // Agreed voltage and current for a request against the given PDO, returns the kind of PDO
+  static pd_pdo_kind decodeRequest(uint32_t pdo, uint32_t rdo, uint32_t *millivolts, uint32_t *milliamps);
+
+  // Commands from other tasks, one at a time is taken from the ready state
+  CommandMailbox commands;
+  bool           commandActive = false;
+  pd_command     activeCommand;
+  uint8_t        sourceStatusData[PD_STATUS_DATA_LEN] = {0};
+  // Returns the state to start the next pending command in, or PESinkReady if there is none
+  policy_engine_state startNextCommand();
+  void                finishCommand(pd_command_status result);
+#ifndef PD_DISABLE_PPS
+  // Build a PPS request for the first APDO that can supply it, false if none can
+  bool buildPPSRequest(uint16_t millivolts, uint16_t milliamps);
+  uint32_t sourcePDOs[7];
+  uint8_t  sourcePDOCount = 0;
+#endif
+  // Set when leaving the ready state to start our own AMS, the next send then waits for SinkTxOk
+  bool    sinkInitiatedAMS = false;
+  pd_msg *pendingTxMessage = nullptr;
+  // The state that started our AMS, until its first message is sent. If the source gets in first the
+  // ready state starts it again once the source's messages are handled. PESinkReady when there is none
+  policy_engine_state deferredAMS = PESinkReady;
 
   // Event group
   // Temp messages for storage
-  pd_msg                tempMessage;
-  ringbuffer<pd_msg, 8> incomingMessages;
-  pd_msg                irqMessage; // irq will unpack recieved message to here
-  pd_msg                _last_dpm_request;
-  policy_engine_state   state = policy_engine_state::PESinkStartup;
+  pd_msg                                                tempMessage;
+  msgqueue<PD_RX_QUEUE_LENGTH * sizeof(pd_msg().bytes)> incomingMessages;
+  pd_msg                                                irqMessage; // irq will unpack recieved message to here
+  pd_msg                                                _last_dpm_request;
+  policy_engine_state                                   state = policy_engine_state::PESinkStartup;
   // Read a pending message into the temp message
-  bool       PPSTimerEnabled;
-  TICK_TYPE   PPSTimeLastEvent, EPRTimeLastEvent;
+#ifndef PD_DISABLE_EPR
   epr_pd_msg recent_epr_capabilities;
   uint8_t    device_epr_wattage;
-  bool       sourceIsEPRCapable;
+  bool       sourceIsEPRCapable  = false;
+  uint8_t    eprKeepAliveRetries = 0; // Resends of the current EPR_KeepAlive, each after an ACK wait ran out
   bool       is_epr;
+#endif
+};
+
+extern template class PolicyEngineT<PolicyEngineRuntimePlatform, PolicyEngineRuntimeDpm>;
+
+/*
+ * The policy engine using callbacks provided at runtime
+ */
+class PolicyEngine : public PolicyEngineT<PolicyEngineRuntimePlatform, PolicyEngineRuntimeDpm> {
+public:
+  typedef PolicyEngineRuntimeDpm::EvaluateCapabilityFunc    EvaluateCapabilityFunc;
+  typedef PolicyEngineRuntimeDpm::EPREvaluateCapabilityFunc EPREvaluateCapabilityFunc;
+  typedef PolicyEngineRuntimeDpm::SinkCapabilityFunc        SinkCapabilityFunc;
+  typedef PolicyEngineRuntimePlatform::TimestampFunc        TimestampFunc;
+  typedef PolicyEngineRuntimePlatform::DelayFunc            DelayFunc;
+
+  PolicyEngine(FUSB302                   fusbStruct,       //
+               TimestampFunc             getTimestampF,    //
+               DelayFunc                 delayFuncF,       //
+               SinkCapabilityFunc        sinkCapabilities, //
+               EvaluateCapabilityFunc    evalFunc,         //
+               EPREvaluateCapabilityFunc eprEvalFunc,      //
+               const uint8_t             device_max_epr_wattage)
+      : PolicyEngineT<PolicyEngineRuntimePlatform, PolicyEngineRuntimeDpm>(fusbStruct,                                                   //
+                                                                           device_max_epr_wattage,                                       //
+                                                                           PolicyEngineRuntimePlatform(getTimestampF, delayFuncF),       //
+                                                                           PolicyEngineRuntimeDpm(sinkCapabilities, evalFunc, eprEvalFunc)) {}
 };
 
 #endif /* PDB_POLICY_ENGINE_H */
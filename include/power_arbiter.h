@@ -0,0 +1,116 @@
+/*
+ * PD Buddy Firmware Library - USB Power Delivery for everyone
+ * Copyright 2017-2018 Clayton G. Hobbs
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PDB_POWER_ARBITER_H
+#define PDB_POWER_ARBITER_H
+#include "pdb_msg.h"
+#include "policy_engine.h"
+#include <stdint.h>
+
+#ifndef PD_ARBITER_MAX_PORTS
+#define PD_ARBITER_MAX_PORTS 4
+#endif
+
+/*
+ * Splits a system power budget across several sink ports that feed one load.
+ *
+ * Each port keeps its own PolicyEngine, but the EvaluateCapabilityFunc of every
+ * port forwards to evaluateCapability() with its port index. The arbiter keeps
+ * the best option each source can give, then shares the system limit between
+ * the attached ports so the total delivered power is maximised. When a port's
+ * capabilities change only that port is re-evaluated; any other port whose
+ * share moved is asked to renegotiate through its policy engine's command
+ * mailbox, and picks up the new request when the source re-sends its capabilities.
+ *
+ * A port whose share grew only asks for what the other ports leave free until
+ * they have agreed their lower contracts, so the ports together never draw more
+ * than the system limit. Forward each port's contract callback to
+ * contractChanged() so the arbiter knows when that is; without it a port's
+ * lower request is taken as agreed as soon as it is built.
+ *
+ * Only SPR fixed and PPS objects are considered.
+ */
+class PowerArbiter {
+public:
+  // What the load can accept on a single port
+  typedef struct {
+    uint16_t min_voltage_mv;
+    uint16_t max_voltage_mv;
+    uint16_t max_current_ma;
+    uint32_t max_power_mw;
+  } port_limits;
+
+  explicit PowerArbiter(uint32_t system_max_power_mw) : numPorts(0), system_max_mw(system_max_power_mw) {}
+
+  // Register a port, returns its index or 0xFF if there is no space left.
+  // pe may be null if the port should never be asked to renegotiate
+  uint8_t addPort(PolicyEngine *pe, const port_limits &limits);
+
+  // Call from the port's EvaluateCapabilityFunc
+  bool evaluateCapability(uint8_t port, const pd_msg *capabilities, pd_msg *request);
+
+  // Call from the port's contract callback, with the agreed voltage and current (0 when lost)
+  void contractChanged(uint8_t port, uint32_t millivolts, uint32_t milliamps);
+
+  // The source on this port went away (detach or hard reset)
+  void portDetached(uint8_t port);
+
+  // Change the total budget, re-shares between the attached ports
+  void setSystemLimit(uint32_t system_max_power_mw);
+
+  uint32_t allocatedPower(uint8_t port) const;
+  uint32_t totalAllocatedPower() const;
+  // True from asking this port to renegotiate until its new request has been built
+  bool isRenegotiating(uint8_t port) const;
+
+private:
+  typedef struct {
+    PolicyEngine *pe;
+    port_limits   limits;
+    uint32_t      pdos[7];
+    uint8_t       numPdos;
+    bool          attached;
+    bool          renegotiating;
+    // Best option this source can give within the port limits
+    uint8_t  best_position; // Object position (1 based), 0 if nothing usable
+    bool     best_is_pps;
+    uint16_t best_mv;
+    uint32_t best_mw;
+    // Share of the system budget
+    uint32_t allocated_mw;
+    // What the last request asked for, at most the share and less while other ports are still above theirs
+    uint32_t granted_mw;
+    // What the agreed contract allows, from contractChanged()
+    uint32_t agreed_mw;
+  } port_state;
+
+  port_state ports[PD_ARBITER_MAX_PORTS];
+  uint8_t    numPorts;
+  uint32_t   system_max_mw;
+
+  void evaluatePort(port_state &port);
+  // Re-share the budget, asking every port other than skipPort to renegotiate if its share changed
+  void allocate(uint8_t skipPort);
+  // What is left of the budget once every other port's old or new contract, whichever is higher, is taken out
+  uint32_t headroom(uint8_t portIndex) const;
+  // Ask every port other than skipPort that is held below its share to renegotiate, if there is now room for more
+  void releaseHeadroom(uint8_t skipPort);
+  void askToRenegotiate(port_state &port);
+  void buildRequest(const port_state &port, pd_msg *request);
+};
+
+#endif /* PDB_POWER_ARBITER_H */
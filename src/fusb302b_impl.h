@@ -0,0 +1,311 @@
+/*
+ * PD Buddy Firmware Library - USB Power Delivery for everyone
+ * Copyright 2017-2018 Clayton G. Hobbs
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PDB_FUSB302B_IMPL_H
+#define PDB_FUSB302B_IMPL_H
+#include "fusb302_defines.h"
+#include "fusb302b.h"
+#include <pd.h>
+#include <string.h>
+#ifdef PD_DEBUG_OUTPUT
+#include "stdio.h"
+#endif
+template <class Bus> bool FUSB302T<Bus>::fusb_send_message(const pd_msg *msg) const {
+
+  /* Token sequences for the FUSB302B, the PHY appends the CRC itself at JAM_CRC */
+  static const uint8_t sop_seq[4] = {FUSB_FIFO_TX_SOP1, FUSB_FIFO_TX_SOP1, FUSB_FIFO_TX_SOP1, FUSB_FIFO_TX_SOP2};
+  static const uint8_t eop_seq[4] = {FUSB_FIFO_TX_JAM_CRC, FUSB_FIFO_TX_EOP, FUSB_FIFO_TX_TXOFF, FUSB_FIFO_TX_TXON};
+
+  /* Get the length of the message: a two-octet header plus NUMOBJ four-octet
+   * data objects */
+  uint8_t msg_len = 2 + 4 * PD_NUMOBJ_GET(msg);
+
+  /* Frame the message with the tokens and the number of bytes to be transmitted,
+   * so the whole packet goes to the TX FIFO in one write */
+  uint8_t frame[sizeof(sop_seq) + 1 + sizeof(msg->bytes) + sizeof(eop_seq)];
+  memcpy(frame, sop_seq, sizeof(sop_seq));
+  frame[sizeof(sop_seq)] = FUSB_FIFO_TX_PACKSYM | msg_len;
+  memcpy(&frame[sizeof(sop_seq) + 1], msg->bytes, msg_len);
+  memcpy(&frame[sizeof(sop_seq) + 1 + msg_len], eop_seq, sizeof(eop_seq));
+
+  if (!bus.write(FUSB_FIFOS, sizeof(sop_seq) + 1 + msg_len + sizeof(eop_seq), frame)) {
+#ifdef PD_DEBUG_OUTPUT
+    printf("I2CWrite failed\r\n");
+#endif
+    /* Don't leave part of a frame in the TX FIFO for the next send to go out behind */
+    fusb_write_byte(FUSB_CONTROL0, 0x44);
+    return false;
+  }
+  return true;
+}
+
+template <class Bus> void FUSB302T<Bus>::fusb_send_hardrst() const {
+
+  /* Send a hard reset */
+  fusb_write_byte(FUSB_CONTROL3, 0x07 | FUSB_CONTROL3_SEND_HARD_RESET);
+}
+
+template <class Bus> bool FUSB302T<Bus>::fusb_setup() const {
+  /* Fully reset the FUSB302B */
+  if (!fusb_write_byte(FUSB_RESET, FUSB_RESET_SW_RES)) {
+    return false;
+  }
+  bus.delay(10);
+  uint8_t tries = 0;
+  while (!fusb_read_id()) {
+    bus.delay(10);
+    tries++;
+    if (tries > 5) {
+      return false; // Welp :(
+    }
+  }
+
+  /* Turn on all power, everything else waits until this has landed */
+  FUSB302RegisterBatch batch;
+  batch.set(FUSB_POWER, 0x0F);
+  /* Set interrupt masks */
+  // Setting to 0 so interrupts are allowed
+  batch.set(FUSB_MASK1, 0x00);
+  if (!batch.write(bus)) {
+    return false;
+  }
+  batch.set(FUSB_MASKA, 0x00);
+  batch.set(FUSB_MASKB, 0x00);
+  batch.set(FUSB_CONTROL0, 0b11 << 2);
+  /* Flush the RX buffer */
+  batch.set(FUSB_CONTROL1, FUSB_CONTROL1_RX_FLUSH);
+  // set defaults
+  batch.set(FUSB_CONTROL2, 0x00);
+  /* Enable automatic retransmission */
+  batch.set(FUSB_CONTROL3, 0x07);
+  if (!batch.write(bus)) {
+    return false;
+  }
+
+  if (!runCCLineSelection()) {
+    return false;
+  }
+  if (!fusb_reset()) {
+    return false;
+  }
+
+  return true;
+}
+
+template <class Bus> bool FUSB302T<Bus>::runCCLineSelection() const {
+
+  /* Measure CC1 */
+  if (!fusb_write_byte(FUSB_SWITCHES0, 0x07)) {
+    return false;
+  }
+  bus.delay(10);
+  uint8_t cc1 = fusb_read_byte(FUSB_STATUS0) & FUSB_STATUS0_BC_LVL;
+
+  /* Measure CC2 */
+  if (!fusb_write_byte(FUSB_SWITCHES0, 0x0B)) {
+    return false;
+  }
+  bus.delay(10);
+  uint8_t cc2 = fusb_read_byte(FUSB_STATUS0) & FUSB_STATUS0_BC_LVL;
+
+  /* Select the correct CC line for BMC signaling; also enable AUTO_CRC */
+  FUSB302RegisterBatch batch;
+  if (cc1 > cc2) {
+    // TX_CC1|AUTO_CRC|SPECREV0
+    batch.set(FUSB_SWITCHES1, 0x25);
+    // PWDN1|PWDN2|MEAS_CC1
+    batch.set(FUSB_SWITCHES0, 0x07);
+  } else {
+    // TX_CC2|AUTO_CRC|SPECREV0
+    batch.set(FUSB_SWITCHES1, 0x26);
+    // PWDN1|PWDN2|MEAS_CC2
+    batch.set(FUSB_SWITCHES0, 0x0B);
+  }
+  return batch.write(bus);
+}
+
+template <class Bus> bool FUSB302T<Bus>::isVBUSConnected() const {
+  // So we want to set MEAS_VBUS to enable measuring the VBus signal
+  // Then check the status
+  uint8_t measureBackup  = fusb_read_byte(FUSB_MEASURE);
+  uint8_t switchesBackup = fusb_read_byte(FUSB_SWITCHES0);
+  // clear MEAS_CCx bits
+  fusb_write_byte(FUSB_SWITCHES0, switchesBackup & 0b11110011);
+  bus.delay(10);
+  fusb_write_byte(FUSB_MEASURE, 0b01000000);
+  bus.delay(100);
+  uint8_t status = fusb_read_byte(FUSB_STATUS0);
+  // Write back original value
+  fusb_write_byte(FUSB_MEASURE, measureBackup);
+  fusb_write_byte(FUSB_SWITCHES0, switchesBackup);
+  return (status & (0b00100000)) != 0;
+}
+
+template <class Bus> bool FUSB302T<Bus>::fusb_get_status(fusb_status *status) const {
+
+  /* Read the interrupt and status flags into status */
+  return bus.read(FUSB_STATUS0A, 7, status->bytes);
+}
+
+template <class Bus> bool FUSB302T<Bus>::fusb_read_status_and_message(fusb_status *status, pd_msg *msg, enum fusb_rx_result *rx) const {
+  if (!bus.read(FUSB_STATUS0A, sizeof(status->bytes), status->bytes)) {
+    return false;
+  }
+  /* Reading the FIFO pops it, so it is only touched once the status says a message is waiting */
+  if (status->status1 & FUSB_STATUS1_RX_EMPTY) {
+    *rx = fusb_rx_none;
+    return true;
+  }
+  /* The token, header and 4 more bytes are a whole control message with its CRC */
+  uint8_t fifo[1 + 2 + 4];
+  if (!bus.read(FUSB_FIFOS, sizeof(fifo), fifo)) {
+    /* The status was read fine, so its flags still count. A short read leaves the FIFO part way through a message */
+    fusb_flush_rx();
+    *rx = fusb_rx_none;
+    return true;
+  }
+  *rx            = ((fifo[0] & FUSB_FIFO_RX_TOKEN_BITS) == FUSB_FIFO_RX_SOP) ? fusb_rx_sop : fusb_rx_other;
+  msg->bytes[0]  = fifo[1];
+  msg->bytes[1]  = fifo[2];
+  uint8_t numobj = PD_NUMOBJ_GET(msg);
+  if (numobj > 0) {
+    /* The first data object came with the token and header, the rest and the CRC take one more read */
+    uint8_t rest[4 * 6 + 4];
+    memcpy(msg->bytes + 2, fifo + 3, 4);
+    if (!bus.read(FUSB_FIFOS, 4 * (numobj - 1) + 4, rest)) {
+      /* Where the next message starts is lost, so drop whatever is left */
+      fusb_flush_rx();
+      *rx = fusb_rx_none;
+      return true;
+    }
+    memcpy(msg->bytes + 6, rest, 4 * (numobj - 1));
+  }
+  return true;
+}
+
+template <class Bus> enum fusb_tx_result FUSB302T<Bus>::fusb_get_tx_result(const fusb_status *status) {
+
+  /* The PHY handles the GoodCRC and retries itself, so I_TXSENT means the message was acknowledged */
+  if (status->interrupta & FUSB_INTERRUPTA_I_TXSENT) {
+    return fusb_tx_sent;
+  }
+  if (status->interrupta & FUSB_INTERRUPTA_I_RETRYFAIL) {
+    return fusb_tx_retry_failed;
+  }
+  /* The CC line was busy so the message was discarded without being sent, the other end is talking */
+  if (status->interrupt & FUSB_INTERRUPT_I_COLLISION) {
+    return fusb_tx_discarded;
+  }
+  return fusb_tx_pending;
+}
+
+template <class Bus> bool FUSB302T<Bus>::fusb_set_interrupts(uint8_t sources) const {
+
+  /* Start with everything masked, then clear the mask bits for what is wanted */
+  uint8_t mask1     = 0xFF;
+  uint8_t maskab[2] = {0xFF, FUSB_MASKB_M_GCRCSENT};
+  if (sources & fusb_irq_rx) {
+    maskab[1] = 0;
+  }
+  if (sources & fusb_irq_tx) {
+    maskab[0] &= ~(FUSB_MASKA_M_TXSENT | FUSB_MASKA_M_RETRYFAIL);
+    mask1 &= ~FUSB_MASK1_M_COLLISION;
+  }
+  if (sources & fusb_irq_ocp_temp) {
+    maskab[0] &= ~FUSB_MASKA_M_OCP_TEMP;
+  }
+  if (sources & fusb_irq_bc_lvl) {
+    mask1 &= ~FUSB_MASK1_M_BC_LVL;
+  }
+  if (sources & fusb_irq_hard_sent) {
+    maskab[0] &= ~FUSB_MASKA_M_HARDSENT;
+  }
+  if (sources & fusb_irq_vbus) {
+    mask1 &= ~FUSB_MASK1_M_VBUSOK;
+  }
+  if (sources & fusb_irq_hard_rst) {
+    maskab[0] &= ~FUSB_MASKA_M_HARDRST;
+  }
+  if (!fusb_write_byte(FUSB_MASK1, mask1)) {
+    return false;
+  }
+  /* MASKA and MASKB are next to each other */
+  return bus.write(FUSB_MASKA, 2, maskab);
+}
+
+template <class Bus> enum fusb_typec_current FUSB302T<Bus>::fusb_get_typec_current() const {
+
+  /* Read the BC_LVL into a variable */
+  enum fusb_typec_current bc_lvl = (enum fusb_typec_current)(fusb_read_byte(FUSB_STATUS0) & FUSB_STATUS0_BC_LVL);
+
+  return bc_lvl;
+}
+
+template <class Bus> bool FUSB302T<Bus>::fusb_reset() const {
+
+  /* Flush the TX and RX buffers */
+  FUSB302RegisterBatch batch;
+  batch.set(FUSB_CONTROL0, 0x44);
+  batch.set(FUSB_CONTROL1, FUSB_CONTROL1_RX_FLUSH);
+  if (!batch.write(bus)) {
+    return false;
+  }
+  /* Then reset the PD logic */
+  if (!fusb_write_byte(FUSB_RESET, FUSB_RESET_PD_RESET)) {
+    return false;
+  }
+  return true;
+}
+
+template <class Bus> bool FUSB302T<Bus>::fusb_flush_rx() const { return fusb_write_byte(FUSB_CONTROL1, FUSB_CONTROL1_RX_FLUSH); }
+
+template <class Bus> bool FUSB302T<Bus>::fusb_read_id() const {
+  // Return true if read of the revision ID is sane
+  uint8_t version = 0;
+
+  bool res = bus.read(FUSB_DEVICE_ID, 1, &version);
+  if (!res)
+    return res;
+  if (version == 0 || version == 0xFF)
+    return false;
+  return true;
+}
+/*
+ * Read a single byte from the FUSB302B
+ *
+ * cfg: The FUSB302B to communicate with
+ * addr: The memory address from which to read
+ *
+ * Returns the value read from addr.
+ */
+template <class Bus> uint8_t FUSB302T<Bus>::fusb_read_byte(const uint8_t addr) const {
+  uint8_t data[1];
+  if (!bus.read(addr, 1, (uint8_t *)data)) {
+    return 0;
+  }
+  return data[0];
+}
+
+/*
+ * Write a single byte to the FUSB302B
+ *
+ * cfg: The FUSB302B to communicate with
+ * addr: The memory address to which we will write
+ * byte: The value to write
+ */
+template <class Bus> bool FUSB302T<Bus>::fusb_write_byte(const uint8_t addr, const uint8_t byte) const { return bus.write(addr, 1, (uint8_t *)&byte); }
+
+#endif /* PDB_FUSB302B_IMPL_H */
@@ -0,0 +1,650 @@
+/*
+ * PD Buddy Firmware Library - USB Power Delivery for everyone
+ * Copyright 2017-2018 Clayton G. Hobbs
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PDB_POLICY_ENGINE_IMPL_H
+#define PDB_POLICY_ENGINE_IMPL_H
+#include "policy_engine.h"
+#include "fusb302_defines.h"
+#include "fusb302b_impl.h"
+#include <pd.h>
+#include <stdbool.h>
+#ifdef PD_DEBUG_OUTPUT
+#include "stdio.h"
+#endif
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::notify(Notifications notification) {
+  uint32_t val      = (uint32_t)notification;
+  uint32_t previous = currentEvents.fetch_or(val);
+#ifdef PD_DEBUG_OUTPUT
+  printf("Notification received  %04X\r\n", (int)notification);
+#endif
+  // A notification still pending has already woken the task
+  if (wakeF && (previous & val) != val) {
+    wakeF(wakeContext);
+  }
+}
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::printStateName() {
+#ifdef PD_DEBUG_OUTPUT
+  const char *names[] = {"PEWaitingEvent",
+                         "PEWaitingMessageTx",
+                         "Unused",
+                         "PESinkStartup",
+                         "PESinkDiscovery",
+                         "PESinkSetupWaitCap",
+                         "PESinkWaitCap",
+                         "PESinkEvalCap",
+                         "PESinkSelectCapTx",
+                         "PESinkSelectCap",
+                         "PESinkWaitCapResp",
+                         "PESinkTransitionSink",
+                         "PESinkReady",
+                         "PESinkGetSourceCap",
+                         "PESinkGiveSinkCap",
+                         "PESinkHardReset",
+                         "PESinkTransitionDefault",
+                         "PESinkSoftReset",
+                         "PESinkSendSoftReset",
+                         "PESinkSendSoftResetTxOK",
+                         "PESinkSendSoftResetResp",
+                         "PESinkSendNotSupported",
+                         "PESinkHandleEPRChunk",
+                         "PESinkWaitForHandleEPRChunk",
+                         "PESinkNotSupportedReceived",
+                         "PESinkSourceUnresponsive",
+                         "PESinkEPREvalCap",
+                         "PESinkRequestEPR",
+                         "PESinkSendEPRKeepAlive",
+                         "PESinkWaitEPRKeepAliveAck",
+                         "PESinkWaitTxOk",
+                         "PESinkWaitVBusOn",
+                         "PESinkGetStatus",
+                         "PESinkExitEPR"};
+  printf("Current state - %s\r\n", names[(int)state]);
+#endif
+}
+template <class Platform, class Dpm, class Fusb> bool PolicyEngineT<Platform, Dpm, Fusb>::thread() {
+  auto stateEnter = state;
+  stepTime        = getTimeStamp();
+  clearEvents((uint32_t)Notifications::TIMERS);
+  serviceTimers(stepTime);
+  /* A Hard Reset from the source is not answered, whatever state we were in is left for the next step */
+  if (currentEvents & (uint32_t)Notifications::HARD_RESET) {
+    clearEvents((uint32_t)Notifications::RESET | (uint32_t)Notifications::HARD_RESET);
+    state = PESinkTransitionDefault;
+    return true;
+  }
+  switch (state) {
+
+  case PESinkStartup:
+    state = pe_sink_startup();
+    break;
+  case PESinkDiscovery:
+    state = pe_sink_discovery();
+    break;
+  case PESinkSetupWaitCap:
+    state = pe_sink_setup_wait_cap();
+    break;
+  case PESinkWaitCap:
+    state = pe_sink_wait_cap();
+    break;
+  case PESinkEvalCap:
+    state = pe_sink_eval_cap();
+    break;
+  case PESinkSelectCapTx:
+    state = pe_sink_select_cap_tx();
+    break;
+  case PESinkSelectCap:
+    state = pe_sink_select_cap();
+    break;
+  case PESinkWaitCapResp:
+    state = pe_sink_wait_cap_resp();
+    break;
+  case PESinkTransitionSink:
+    state = pe_sink_transition_sink();
+    break;
+  case PESinkReady:
+    state = pe_sink_ready();
+    break;
+  case PESinkGetSourceCap:
+    state = pe_sink_get_source_cap();
+    break;
+  case PESinkGiveSinkCap:
+    state = pe_sink_give_sink_cap();
+    break;
+  case PESinkHardReset:
+    state = pe_sink_hard_reset();
+    break;
+  case PESinkTransitionDefault:
+    state = pe_sink_transition_default();
+    break;
+  case PESinkHandleSoftReset:
+    state = pe_sink_soft_reset();
+    break;
+  case PESinkSendSoftReset:
+    state = pe_sink_send_soft_reset();
+    break;
+  case PESinkSendSoftResetTxOK:
+    state = pe_sink_send_soft_reset_tx_ok();
+    break;
+  case PESinkSendSoftResetResp:
+    state = pe_sink_send_soft_reset_resp();
+    break;
+  case PESinkSendNotSupported:
+    state = pe_sink_send_not_supported();
+    break;
+#ifndef PD_DISABLE_CHUNKING
+  case PESinkWaitForHandleEPRChunk:
+    state = pe_sink_wait_epr_chunk();
+    break;
+  case PESinkHandleEPRChunk:
+    state = pe_sink_handle_epr_chunk();
+    break;
+#endif
+  case PESinkSourceUnresponsive:
+    state = pe_sink_source_unresponsive();
+    break;
+  case PESinkNotSupportedReceived:
+    state = pe_sink_not_supported_received();
+    break;
+  case PEWaitingEvent:
+    state = pe_sink_wait_event();
+    break;
+  case PEWaitingMessageTx:
+    state = pe_sink_wait_send_done();
+    break;
+  case PESinkWaitTxOk:
+    state = pe_sink_wait_tx_ok();
+    break;
+  case PESinkGetStatus:
+    state = pe_sink_get_status();
+    break;
+#ifdef PD_SEND_HARD_RESET
+  case PESinkWaitVBusOn:
+    state = pe_sink_wait_vbus_on();
+    break;
+#endif
+#ifndef PD_DISABLE_EPR
+  case PESinkEPREvalCap:
+    state = pe_sink_epr_eval_cap();
+    break;
+  case PESinkRequestEPR:
+    state = pe_sink_request_epr();
+    break;
+  case PESinkSendEPRKeepAlive:
+    state = pe_sink_send_epr_keep_alive();
+    break;
+  case PESinkWaitEPRKeepAliveAck:
+    state = pe_sink_wait_epr_keep_alive_ack();
+    break;
+  case PESinkExitEPR:
+    state = pe_sink_exit_epr();
+    break;
+#endif
+  default:
+    state = PESinkStartup;
+    break;
+  }
+#ifdef PD_DEBUG_OUTPUT
+  if (state != PEWaitingEvent) {
+    printStateName();
+  }
+#endif
+  return (state != stateEnter) || (state != PEWaitingEvent);
+}
+
+template <class Platform, class Dpm, class Fusb> bool PolicyEngineT<Platform, Dpm, Fusb>::isPD3_0() { return (hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0; }
+
+template <class Platform, class Dpm, class Fusb> bool PolicyEngineT<Platform, Dpm, Fusb>::NegotiationTimeoutReached(uint8_t timeout) {
+  // Check if have been waiting longer than timeout without finishing
+  // If so force state into the failed state and return true
+
+  // Timeout is in 100ms increments
+  // If the system ticks is greater than the specified timeout then we call it all off
+  if (timeout) {
+    if (timers.elapsed(TimerNegotiation, getTimeStamp()) > (TICK_TYPE)(timeout * 100)) {
+      // state = policy_engine_state::PESinkSourceUnresponsive;
+      return true;
+    }
+  }
+  return false;
+}
+
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::TimersCallback() {
+  // The timers belong to thread(), changing them from here would race with it
+  notify(Notifications::TIMERS);
+}
+
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::serviceTimers(TICK_TYPE now) {
+  bool keepAlive = false;
+#ifndef PD_DISABLE_EPR
+  // We need to engage in _some_ PD communication to stay in EPR mode, any message we send counts
+  if (timers.expired(TimerEPR, now)) {
+    if (is_epr) {
+      keepAlive = true;
+      // Raised again if it is still not sent by then
+      timers.start(TimerEPR, now, PD_T_EPR_KEEPALIVE);
+    } else {
+      timers.stop(TimerEPR);
+    }
+  }
+#endif
+#ifndef PD_DISABLE_PPS
+  // Have to periodically re-send to keep the voltage level active. One due before the next
+  // keepalive is sent in its place, as the request keeps EPR mode alive as well
+  bool request = timers.expired(TimerPPS, now) || (keepAlive && timers.running(TimerPPS) && timers.remaining(TimerPPS, now) <= PD_T_EPR_KEEPALIVE);
+  if (request) {
+    // Send a new PPS message
+    notify(Notifications::PPS_REQUEST);
+    timers.start(TimerPPS, now, PD_T_PPS_REREQUEST);
+    keepAlive = false;
+  }
+#endif
+  if (keepAlive) {
+    notify(Notifications::EPR_KEEPALIVE);
+  }
+}
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::startNextCommand() -> policy_engine_state {
+  pd_command command;
+  uint16_t   arg0, arg1;
+  while (commands.take(&command, &arg0, &arg1)) {
+    activeCommand   = command;
+    commandActive   = true;
+    timers.start(TimerCommand, stepTime, PD_T_SENDER_RESPONSE);
+    switch (command) {
+    case pd_command::Renegotiate:
+    case pd_command::GetSourceCaps:
+      sinkInitiatedAMS = true;
+      return PESinkGetSourceCap;
+    case pd_command::SetPPS:
+#ifndef PD_DISABLE_PPS
+#ifndef PD_DISABLE_EPR
+      // EPR requests carry a copy of the PDO, only SPR PPS is handled here
+      if (is_epr) {
+        break;
+      }
+#endif
+      if (buildPPSRequest(arg0, arg1)) {
+        sinkInitiatedAMS = true;
+        return PESinkSelectCapTx;
+      }
+#endif
+      break;
+    case pd_command::RequestEPR:
+#ifndef PD_DISABLE_EPR
+      if (is_epr) {
+        finishCommand(pd_command_status::Done);
+        continue;
+      }
+      if (sourceIsEPRCapable && device_epr_wattage > 0) {
+        negotiationOfEPRInProgress = true;
+        sinkInitiatedAMS           = true;
+        return PESinkRequestEPR;
+      }
+#endif
+      break;
+    case pd_command::ExitEPR:
+#ifndef PD_DISABLE_EPR
+      if (!is_epr) {
+        finishCommand(pd_command_status::Done);
+        continue;
+      }
+      sinkInitiatedAMS = true;
+      return PESinkExitEPR;
+#endif
+      break;
+    case pd_command::GetStatus:
+      if (isPD3_0()) {
+        sinkInitiatedAMS = true;
+        return PESinkGetStatus;
+      }
+      break;
+    }
+    finishCommand(pd_command_status::NotSupported);
+  }
+  return PESinkReady;
+}
+
+template <class Platform, class Dpm, class Fusb> pd_pdo_kind PolicyEngineT<Platform, Dpm, Fusb>::decodeRequest(uint32_t pdo, uint32_t rdo, uint32_t *millivolts, uint32_t *milliamps) {
+  switch (pdo & PD_PDO_TYPE) {
+  case PD_PDO_TYPE_FIXED:
+  case PD_PDO_TYPE_VARIABLE:
+    // Variable supplies report their minimum, which shares the fixed voltage field
+    *millivolts = PD_PDV2MV(PD_PDO_SRC_FIXED_VOLTAGE_GET(pdo));
+    *milliamps  = PD_PDI2MA((rdo & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT);
+    if (pdo == 0) {
+      return pd_pdo_kind::None;
+    }
+    return (pdo & PD_PDO_TYPE) == PD_PDO_TYPE_FIXED ? pd_pdo_kind::Fixed : pd_pdo_kind::Variable;
+  case PD_PDO_TYPE_BATTERY:
+    // Operating power in 250mW units, at the minimum voltage
+    *millivolts = PD_PDV2MV(PD_PDO_SRC_FIXED_VOLTAGE_GET(pdo));
+    *milliamps  = *millivolts ? (((rdo & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT) * 250 * 1000) / *millivolts : 0;
+    return pd_pdo_kind::Battery;
+  default:
+    *milliamps = PD_PAI2MA((rdo & PD_RDO_PROG_CURRENT) >> PD_RDO_PROG_CURRENT_SHIFT);
+    if ((pdo & PD_APDO_TYPE) == PD_APDO_TYPE_AVS) {
+      *millivolts = PD_APS2MV((rdo & PD_RDO_AVS_VOLTAGE) >> PD_RDO_PROG_VOLTAGE_SHIFT);
+      return pd_pdo_kind::AVS;
+    }
+    *millivolts = PD_PRV2MV((rdo & PD_RDO_PROG_VOLTAGE) >> PD_RDO_PROG_VOLTAGE_SHIFT);
+    return pd_pdo_kind::PPS;
+  }
+}
+
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::storeContract(const pd_contract &next) {
+  contractSequence.fetch_add(1);
+  std::atomic_thread_fence(std::memory_order_release);
+  contract = next;
+  contractSequence.fetch_add(1);
+}
+
+template <class Platform, class Dpm, class Fusb> pd_contract PolicyEngineT<Platform, Dpm, Fusb>::getContract() const {
+  pd_contract copy;
+  uint32_t    sequence;
+  do {
+    sequence = contractSequence.load();
+    copy     = contract;
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((sequence & 1) || sequence != contractSequence.load());
+  return copy;
+}
+
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::contractAgreed() {
+  pd_contract next;
+  next.kind              = decodeRequest(requestedPDO, _last_dpm_request.obj[0], &next.millivolts, &next.milliamps);
+  next.position          = (_last_dpm_request.obj[0] & PD_RDO_OBJPOS) >> PD_RDO_OBJPOS_SHIFT;
+  next.epr               = pdIsEpr();
+  next.updated           = stepTime;
+  const bool wasExplicit = _explicit_contract;
+  const bool wasEPR      = contract.epr;
+  _explicit_contract     = true;
+  // Periodic PPS re-requests agree to the same thing again, these are not changes
+  if (wasExplicit && next.millivolts == contract.millivolts && next.milliamps == contract.milliamps && next.epr == contract.epr) {
+    next.established = contract.established;
+    storeContract(next);
+    return;
+  }
+  next.established = next.updated;
+  storeContract(next);
+  reportContractEvent(wasExplicit ? pd_contract_event::Changed : pd_contract_event::Established);
+  if (next.epr != wasEPR) {
+    reportContractEvent(next.epr ? pd_contract_event::EPREntered : pd_contract_event::EPRExited);
+  }
+}
+
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::dropContract() {
+  if (!_explicit_contract) {
+    return;
+  }
+  _explicit_contract = false;
+  storeContract(pd_contract());
+  reportContractEvent(pd_contract_event::Lost);
+}
+
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::finishCommand(pd_command_status result) {
+  if (commandActive) {
+    commandActive = false;
+    timers.stop(TimerCommand);
+    commands.finish(activeCommand, result);
+  }
+}
+
+#ifndef PD_DISABLE_PPS
+template <class Platform, class Dpm, class Fusb> bool PolicyEngineT<Platform, Dpm, Fusb>::buildPPSRequest(uint16_t millivolts, uint16_t milliamps) {
+  for (uint8_t i = 0; i < sourcePDOCount; i++) {
+    const uint32_t pdo = sourcePDOs[i];
+    if ((pdo & PD_PDO_TYPE) != PD_PDO_TYPE_AUGMENTED || (pdo & PD_APDO_TYPE) != PD_APDO_TYPE_PPS) {
+      continue;
+    }
+    if (millivolts < PD_PAV2MV(PD_APDO_PPS_MIN_VOLTAGE_GET(pdo)) || millivolts > PD_PAV2MV(PD_APDO_PPS_MAX_VOLTAGE_GET(pdo)) || milliamps > PD_PAI2MA(PD_APDO_PPS_CURRENT_GET(pdo))) {
+      continue;
+    }
+    _last_dpm_request.hdr    = hdr_template | PD_MSGTYPE_REQUEST | PD_NUMOBJ(1);
+    _last_dpm_request.obj[0] = PD_RDO_PROG_VOLTAGE_SET(PD_MV2PRV(millivolts)) | PD_RDO_PROG_CURRENT_SET(PD_MA2PAI(milliamps)) | PD_RDO_NO_USB_SUSPEND | PD_RDO_OBJPOS_SET(i + 1);
+    requestedPDO             = pdo;
+    // Keep the new output alive with the periodic re-request
+    timers.start(TimerPPS, stepTime, PD_T_PPS_REREQUEST);
+    return true;
+  }
+  return false;
+}
+#endif
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_start_message_tx(policy_engine_state postTxState, policy_engine_state txFailState, pd_msg *msg) -> policy_engine_state {
+#ifdef PD_DEBUG_OUTPUT
+  printf("Starting message Tx - %02X\r\n", PD_MSGTYPE_GET(msg));
+#endif
+  const bool softReset = PD_MSGKIND_GET(msg) == PD_MSGKIND_CONTROL(PD_MSGTYPE_SOFT_RESET);
+  if (softReset) {
+    /* Clear MessageIDCounter, the Soft_Reset itself goes out as message 0 */
+    _tx_messageidcounter = 0;
+  }
+  postSendFailedState = txFailState;
+  postSendState       = postTxState;
+
+  /* PD 3.0 collision avoidance */
+  if (sinkInitiatedAMS) {
+    sinkInitiatedAMS = false;
+    deferredAMS      = state;
+    /* If we're starting an AMS, wait for permission to transmit */
+    /* A failed read gives fusb_tcc_none, which is no reason to hold back */
+    if (isPD3_0() && fusb.fusb_get_typec_current() == fusb_sink_tx_ng) {
+      pendingTxMessage = msg;
+      clearEvents((uint32_t)Notifications::SINK_TX_OK);
+      /* The source's AMS is over well within tSenderResponse, so if the change to SinkTxOk is missed send anyway */
+      return waitForEvent(PESinkWaitTxOk, (uint32_t)Notifications::SINK_TX_OK | (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, PD_T_SENDER_RESPONSE, PESinkWaitTxOk);
+    }
+  }
+  clearEvents((uint32_t)Notifications::TX_DONE | (uint32_t)Notifications::TX_ERR | (uint32_t)Notifications::TX_DISCARDED);
+  // Unmask the TX result before sending so it cannot be missed
+  updateInterrupts((uint32_t)Notifications::TX_DONE | (uint32_t)Notifications::TX_ERR | (uint32_t)Notifications::TX_DISCARDED);
+  msg->hdr &= ~PD_HDR_MESSAGEID;
+  msg->hdr |= (_tx_messageidcounter % 8) << PD_HDR_MESSAGEID_SHIFT;
+  /* Send the message to the PHY, if that fails no result will ever come */
+  if (!fusb.fusb_send_message(msg)) {
+    deferredAMS = PESinkReady;
+    return txFailState;
+  }
+#ifdef PD_DEBUG_OUTPUT
+  printf("Message queued to send\r\n");
+#endif
+
+  /* Setup waiting for notification. With no result in time the interrupt was lost and the message may
+   * or may not have gone out, so both ends are brought back in step with a Soft_Reset (unless that is
+   * what was lost, then it counts as failed) */
+  const policy_engine_state lostState = softReset ? txFailState : PESinkSendSoftReset;
+  const uint32_t            txResult  = (uint32_t)Notifications::TX_DONE | (uint32_t)Notifications::TX_ERR | (uint32_t)Notifications::TX_DISCARDED;
+  const policy_engine_state next      = waitForEvent(PEWaitingMessageTx, (uint32_t)Notifications::RESET | txResult, PD_T_TX_RESULT, lostState);
+  /* No result can come before the message is in the PHY, so time it from there rather than from the start of this step */
+  if (next == PEWaitingEvent) {
+    timers.start(TimerWait, getTimeStamp(), PD_T_TX_RESULT);
+  }
+  return next;
+}
+
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::clearEvents(uint32_t notification) { currentEvents.fetch_and(~notification); }
+
+template <class Platform, class Dpm, class Fusb> TICK_TYPE PolicyEngineT<Platform, Dpm, Fusb>::ticksUntilTimeout() {
+  if (state != PEWaitingEvent) {
+    return 0;
+  }
+  // The command timer is only looked at from the ready state, which waits on it through TimerWait
+  return timers.untilNext(getTimeStamp(), (1 << TimerWait) | (1 << TimerPPS) | (1 << TimerEPR));
+}
+
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::updateInterrupts(uint32_t notification) {
+  // Messages can arrive at any time (including Soft_Reset), as can Hard Reset signalling, so both are always wanted.
+  // The result of a send only comes after we start one, so it is left unmasked rather than rewritten around each send
+  uint8_t sources = fusb_irq_rx | fusb_irq_hard_rst | fusb_irq_tx;
+  if (notification & (uint32_t)Notifications::I_OVRTEMP) {
+    sources |= fusb_irq_ocp_temp;
+  }
+  if (notification & (uint32_t)Notifications::SINK_TX_OK) {
+    sources |= fusb_irq_bc_lvl;
+  }
+  if (notification & (uint32_t)Notifications::HARD_SENT) {
+    sources |= fusb_irq_hard_sent;
+  }
+  if (notification & ((uint32_t)Notifications::VBUS_OFF | (uint32_t)Notifications::VBUS_ON)) {
+    sources |= fusb_irq_vbus;
+  }
+  // Skip the I2C writes if nothing changed
+  if (sources != enabledInterrupts && fusb.fusb_set_interrupts(sources)) {
+    enabledInterrupts = sources;
+  }
+}
+
+template <class Platform, class Dpm, class Fusb>
+auto PolicyEngineT<Platform, Dpm, Fusb>::waitForEvent(policy_engine_state evalState, uint32_t notification, TICK_TYPE timeout, policy_engine_state timeoutState) -> policy_engine_state {
+  // Record the new state, and the desired notifications mask, then schedule the waiter state
+  waitingEventsMask = notification;
+  // Waits on ALL only want what the ready state handles, not the interrupts specific wait states ask for
+  if (notification == (uint32_t)Notifications::ALL) {
+    updateInterrupts(notification & ~((uint32_t)Notifications::TX_DONE | (uint32_t)Notifications::TX_ERR | (uint32_t)Notifications::TX_DISCARDED | (uint32_t)Notifications::SINK_TX_OK
+                                      | (uint32_t)Notifications::HARD_SENT | (uint32_t)Notifications::VBUS_OFF | (uint32_t)Notifications::VBUS_ON));
+  } else {
+    updateInterrupts(notification);
+  }
+#ifdef PD_DEBUG_OUTPUT
+  printf("Waiting for events %04X\r\n", (int)notification);
+#endif
+
+  // The deadline holds from here even if the eval state is run straight away and waits again
+  postNotificationEvalState = evalState;
+  postTimeoutState          = timeoutState;
+  if (timeout == TICK_MAX_DELAY) {
+    timers.stop(TimerWait);
+  } else {
+    timers.start(TimerWait, stepTime, timeout);
+  }
+  // If notification is already present, we can continue straight to eval state. A reset is left to pe_sink_wait_event
+  if (currentEvents & waitingEventsMask & ~(uint32_t)Notifications::RESET) {
+    return evalState;
+  }
+  // If waiting for message rx, but one is in the buffer, jump to eval
+  if ((waitingEventsMask & (uint32_t)Notifications::MSG_RX) == (uint32_t)Notifications::MSG_RX) {
+    if (incomingMessages.getOccupied() > 0) {
+      currentEvents |= (uint32_t)Notifications::MSG_RX;
+      return evalState;
+    }
+  }
+  return policy_engine_state::PEWaitingEvent;
+}
+template <class Platform, class Dpm, class Fusb> void PolicyEngineT<Platform, Dpm, Fusb>::handleReceivedMessage() {
+  const uint8_t kind = PD_MSGKIND_GET(&irqMessage);
+  const uint8_t id   = PD_MESSAGEID_GET(&irqMessage);
+  if (kind == PD_MSGKIND_CONTROL(PD_MSGTYPE_GOODCRC)) {
+    /* The PHY already reported the send through I_TXSENT, so GoodCRCs are dropped */
+  } else if (kind == PD_MSGKIND_CONTROL(PD_MSGTYPE_SOFT_RESET)) {
+    /* If it's a Soft_Reset, PE transitions to its reset state. It is always taken, and the
+     * source counts its MessageIDs from it */
+    rxMessageID = id;
+    notify(Notifications::RESET);
+  } else if (id == rxMessageID) {
+    /* The source missed our GoodCRC and sent the same message again, it is already handled */
+  } else {
+    rxMessageID = id;
+
+    /* Pass the message to the policy engine. */
+    incomingMessages.push(&irqMessage);
+
+    notify(Notifications::MSG_RX);
+  }
+}
+
+template <class Platform, class Dpm, class Fusb> bool PolicyEngineT<Platform, Dpm, Fusb>::IRQOccured() {
+  typename Fusb::fusb_status status;
+  enum fusb_rx_result        rx;
+  bool                       returnValue  = false;
+  uint8_t                    messagesLeft = 80 / 7; // The 80 byte RX FIFO holds at most 11 messages, any more and RX_EMPTY is stuck
+  /* Each read returns the status and interrupt flags along with the message at
+   * the head of the RX FIFO, if any. The flags clear on read, so every read is
+   * handled in full, and reading stops once the FIFO is seen empty. */
+  do {
+    if (!fusb.fusb_read_status_and_message(&status, &irqMessage, &rx)) {
+      break;
+    }
+
+    /* The source signalled a Hard Reset. It counts its MessageIDs from 0 again and
+     * nothing it sent before still stands. Checked first so a message read along
+     * with it, which can only have come after it, is kept. */
+    if (status.interrupta & FUSB_INTERRUPTA_I_HARDRST) {
+      rxMessageID = 0xFF;
+      incomingMessages.flush();
+      notify(Notifications::HARD_RESET);
+      notify(Notifications::RESET);
+      returnValue = true;
+    }
+
+    /* A message was received with a good CRC, SOP' and SOP'' are dropped */
+    if (rx == fusb_rx_sop) {
+      handleReceivedMessage();
+    }
+    if (rx != fusb_rx_none || (status.interruptb & FUSB_INTERRUPTB_I_GCRCSENT)) {
+      returnValue = true;
+    }
+    if (rx != fusb_rx_none && messagesLeft-- == 0) {
+      fusb.fusb_flush_rx();
+      rx = fusb_rx_none;
+    }
+
+    /* Complete any send in progress from the same status read */
+    switch (fusb.fusb_get_tx_result(&status)) {
+    case fusb_tx_sent:
+      _tx_messageidcounter = (_tx_messageidcounter + 1) % 8;
+      notify(Notifications::TX_DONE);
+      returnValue = true;
+      break;
+    case fusb_tx_retry_failed:
+      notify(Notifications::TX_ERR);
+      returnValue = true;
+      break;
+    case fusb_tx_discarded:
+      notify(Notifications::TX_DISCARDED);
+      returnValue = true;
+      break;
+    default:
+      break;
+    }
+
+    /* The source moved Rp back to SinkTxOk, so we may start an AMS */
+    if ((status.interrupt & FUSB_INTERRUPT_I_BC_LVL) && (status.status0 & FUSB_STATUS0_BC_LVL) == fusb_sink_tx_ok) {
+      notify(Notifications::SINK_TX_OK);
+      returnValue = true;
+    }
+
+    if (status.interrupta & FUSB_INTERRUPTA_I_HARDSENT) {
+      notify(Notifications::HARD_SENT);
+      returnValue = true;
+    }
+    /* VBUS crossed the VBUSOK threshold */
+    if (status.interrupt & FUSB_INTERRUPT_I_VBUSOK) {
+      notify((status.status0 & FUSB_STATUS0_VBUSOK) ? Notifications::VBUS_ON : Notifications::VBUS_OFF);
+      returnValue = true;
+    }
+
+    /* If the I_OCP_TEMP and OVRTEMP flags are set, tell the Policy
+     * Engine thread */
+    if ((status.interrupta & FUSB_INTERRUPTA_I_OCP_TEMP) && (status.status1 & FUSB_STATUS1_OVRTEMP)) {
+      notify(Notifications::I_OVRTEMP);
+      returnValue = true;
+    }
+  } while (rx != fusb_rx_none);
+  return returnValue;
+}
+
+#include "policy_engine_states_impl.h"
+
+#endif /* PDB_POLICY_ENGINE_IMPL_H */
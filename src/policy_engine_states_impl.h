@@ -0,0 +1,838 @@
+/*
+ * PD Buddy Firmware Library - USB Power Delivery for everyone
+ * Copyright 2017-2018 Clayton G. Hobbs
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PDB_POLICY_ENGINE_STATES_IMPL_H
+#define PDB_POLICY_ENGINE_STATES_IMPL_H
+#include "fusb302b.h"
+#include "policy_engine.h"
+#include <pd.h>
+#include <stdbool.h>
+#ifdef PD_DEBUG_OUTPUT
+#include "stdio.h"
+#endif
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_startup() -> policy_engine_state {
+
+  /* No need to reset the protocol layer here.  There are two ways into this
+   * state: startup and exiting hard reset.  On startup, the protocol layer
+   * is reset by the startup procedure.  When exiting hard reset, the
+   * protocol layer is reset by the hard reset state machine.  Since it's
+   * already done somewhere else, there's no need to do it again here.
+   * Either way the source starts its MessageIDs over, so whatever it sends
+   * first is new to us. */
+  rxMessageID = 0xFF;
+  /* Either way the FUSB302 masks were rewritten behind our back, so the next wait sets them again */
+  enabledInterrupts = 0xFF;
+
+  return PESinkDiscovery;
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_discovery() -> policy_engine_state {
+
+  /* Wait for VBUS.  Since it's our only power source, we already know that
+   * we have it, so just move on.
+   * If this was not true, we would want to wait and then re-run CC line selection
+   * fusb.runCCLineSelection();
+   */
+
+  return PESinkSetupWaitCap;
+}
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_setup_wait_cap() -> policy_engine_state { //
+  dropContract();
+#ifndef PD_DISABLE_PPS
+  timers.stop(TimerPPS);
+#endif
+  /* Whatever we were about to ask for was for the contract that is gone */
+  deferredAMS = PESinkReady;
+  /* Drop what the last negotiation left behind. Resets, commands and VBUS changes are
+   * left pending so whoever raised them is still answered */
+  clearEvents((uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::I_OVRTEMP | (uint32_t)Notifications::TX_DONE | (uint32_t)Notifications::TX_ERR | (uint32_t)Notifications::TX_DISCARDED |
+              (uint32_t)Notifications::SINK_TX_OK | (uint32_t)Notifications::PPS_REQUEST | (uint32_t)Notifications::REQUEST_EPR | (uint32_t)Notifications::EPR_KEEPALIVE);
+
+  timers.start(TimerNegotiation, stepTime, TimerService<TICK_TYPE, TimerCount>::forever);
+  return waitForEvent(policy_engine_state::PESinkWaitCap, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::I_OVRTEMP | (uint32_t)Notifications::RESET,
+                      // Wait for cap timeout
+                      PD_T_TYPEC_SINK_WAIT_CAP);
+}
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_wait_cap() -> policy_engine_state {
+  /* Fetch a message from the protocol layer */
+  uint32_t evt = currentEvents;
+  clearEvents((uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::I_OVRTEMP);
+#ifdef PD_DEBUG_OUTPUT
+  printf("Wait Cap Event %04X\r\n", (int)evt);
+#endif
+
+  /* If we're too hot, we shouldn't negotiate power yet */
+  if (evt & (uint32_t)Notifications::I_OVRTEMP) {
+    return PESinkSetupWaitCap;
+  }
+
+  /* If we got a message */
+  /* Get the message */
+  while (incomingMessages.getOccupied()) {
+    incomingMessages.pop(&tempMessage);
+    /* If we got a Source_Capabilities message, read it. */
+    if (PD_MSGKIND_GET(&tempMessage) == PD_MSGKIND_DATA(PD_MSGTYPE_SOURCE_CAPABILITIES)) {
+#ifdef PD_DEBUG_OUTPUT
+      printf("Source Capabilities message RX\r\n");
+#endif
+
+      /* First, determine what PD revision we're using */
+      if ((hdr_template & PD_HDR_SPECREV) == PD_SPECREV_1_0) {
+        /* If the other end is using at least version 3.0, we'll
+         * use version 3.0. */
+        if ((tempMessage.hdr & PD_HDR_SPECREV) >= PD_SPECREV_3_0) {
+          hdr_template |= PD_SPECREV_3_0;
+          /* Otherwise, use 2.0.  Don't worry about the 1.0 case
+           * because we don't have hardware for PD 1.0 signaling. */
+        } else {
+          hdr_template |= PD_SPECREV_2_0;
+        }
+      }
+      return PESinkEvalCap;
+    }
+  }
+
+  /* If we failed to get a message, wait longer */
+  return PESinkSetupWaitCap;
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_eval_cap() -> policy_engine_state {
+  /* Fresh capabilities answer a Get_Source_Cap we put off, and are requested from in place of a request we put off */
+  if (deferredAMS == PESinkGetSourceCap || deferredAMS == PESinkSelectCapTx) {
+    deferredAMS = PESinkReady;
+  }
+#ifndef PD_DISABLE_PPS
+  /* If we have a Source_Capabilities message, remember the index of the
+   * first PPS APDO so we can check if the request is for a PPS APDO in
+   * PE_SNK_Select_Cap. */
+  /* Start by assuming we won't find a PPS APDO (set the index greater
+   * than the maximum possible) */
+  _pps_index = 0xFF;
+  /* New capabilities also means we can't be making a request from the
+   * same PPS APDO */
+  /* Search for the first PPS APDO */
+  for (int i = 0; i < PD_NUMOBJ_GET(&tempMessage); i++) {
+    if ((tempMessage.obj[i] & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED && (tempMessage.obj[i] & PD_APDO_TYPE) == PD_APDO_TYPE_PPS) {
+      _pps_index = i + 1;
+      break;
+    }
+  }
+  /* Keep the offer so SetPPS commands can pick an APDO */
+  sourcePDOCount = PD_NUMOBJ_GET(&tempMessage);
+  memcpy(sourcePDOs, tempMessage.obj, sourcePDOCount * 4);
+#endif
+  _unconstrained_power = tempMessage.obj[0] & PD_PDO_SRC_FIXED_UNCONSTRAINED;
+#ifndef PD_DISABLE_EPR
+  sourceIsEPRCapable = tempMessage.obj[0] & PD_PDO_SRC_FIXED_EPR_CAPABLE;
+#endif
+
+  /* Ask the DPM what to request */
+  if (pdbs_dpm_evaluate_capability(&tempMessage, &_last_dpm_request)) {
+    _last_dpm_request.hdr |= hdr_template;
+    uint8_t position = PD_RDO_OBJPOS_GET(&_last_dpm_request);
+    requestedPDO     = (position >= 1 && position <= PD_NUMOBJ_GET(&tempMessage)) ? tempMessage.obj[position - 1] : 0;
+#ifndef PD_DISABLE_PPS
+    /* If we're using PD 3.0 */
+    if ((hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0) {
+      /* If the request was for a PPS, start time callbacks if not started
+       */
+      auto pdoPos = PD_RDO_OBJPOS_GET(&_last_dpm_request);
+      if (pdoPos <= 7 && pdoPos >= _pps_index) {
+        timers.start(TimerPPS, stepTime, PD_T_PPS_REREQUEST);
+      } else {
+        timers.stop(TimerPPS);
+      }
+    }
+#endif
+    return PESinkSelectCapTx;
+  }
+
+  return PESinkWaitCap;
+}
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_select_cap_tx() -> policy_engine_state {
+
+  /* Transmit the request */
+  // clearEvents(0xFFFFFF); // clear all pending incase of an rx while prepping
+
+#ifdef PD_DEBUG_OUTPUT
+  printf("Sending desired capability\r\n");
+#endif
+  return pe_start_message_tx(policy_engine_state::PESinkSelectCap, PESinkHardReset, &_last_dpm_request);
+}
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_select_cap() -> policy_engine_state {
+  // Have transmitted the selected cap, transition to waiting for the response
+  // wait for a response
+  return waitForEvent(PESinkWaitCapResp, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, PD_T_SENDER_RESPONSE);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_wait_cap_resp() -> policy_engine_state {
+  /* Wait for a response */
+  clearEvents((uint32_t)Notifications::MSG_RX);
+
+  /* Get the response message */
+  while (incomingMessages.getOccupied()) {
+    incomingMessages.pop(&tempMessage);
+    const uint8_t kind = PD_MSGKIND_GET(&tempMessage);
+    /* If the source accepted our request, wait for the new power message*/
+    if (kind == PD_MSGKIND_CONTROL(PD_MSGTYPE_ACCEPT)) {
+#ifndef PD_DISABLE_EPR
+      is_epr = (PD_NUMOBJ_GET(&_last_dpm_request) == 2);
+      if (is_epr) {
+        timers.start(TimerEPR, stepTime, PD_T_EPR_KEEPALIVE);
+      }
+#endif
+      return waitForEvent(PESinkTransitionSink, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, PD_T_PS_TRANSITION);
+      /* If the message was a Soft_Reset, do the soft reset procedure */
+    } else if (kind == PD_MSGKIND_CONTROL(PD_MSGTYPE_SOFT_RESET)) {
+      return PESinkHandleSoftReset;
+      /* If the message was Wait or Reject */
+    } else if (kind == PD_MSGKIND_CONTROL(PD_MSGTYPE_REJECT) || kind == PD_MSGKIND_CONTROL(PD_MSGTYPE_WAIT)) {
+#ifdef PD_DEBUG_OUTPUT
+      printf("Requested Capabilities Rejected\r\n");
+#endif
+      finishCommand(pd_command_status::Failed);
+      /* If we don't have an explicit contract, wait for capabilities */
+      if (!_explicit_contract) {
+        return PESinkSetupWaitCap;
+        /* If we do have an explicit contract, go to the ready state */
+      } else {
+        return waitForEvent(PESinkReady, (uint32_t)Notifications::ALL, TICK_MAX_DELAY);
+      }
+    }
+  }
+  /* Nothing that answers the request, keep waiting out what is left of tSenderResponse */
+  return waitForEvent(PESinkWaitCapResp, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, timers.remaining(TimerWait, stepTime));
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_transition_sink() -> policy_engine_state {
+  /* Wait for the PS_RDY message */
+  clearEvents((uint32_t)Notifications::MSG_RX);
+  /* If we received a message, read it */
+  while (incomingMessages.getOccupied()) {
+
+    incomingMessages.pop(&tempMessage);
+
+    /* If we got a PS_RDY, handle it */
+    if (PD_MSGKIND_GET(&tempMessage) == PD_MSGKIND_CONTROL(PD_MSGTYPE_PS_RDY)) {
+      /* We just finished negotiating an explicit contract */
+      /* Negotiation finished */
+#ifndef PD_DISABLE_EPR
+      negotiationOfEPRInProgress = false;
+      if (sourceIsEPRCapable && (device_epr_wattage > 0) && !is_epr) {
+        // We have entered into an SPR contract, but we support EPR and the supply does too
+        //  Request entering EPR mode
+        negotiationOfEPRInProgress = true;
+        notify(Notifications::REQUEST_EPR);
+      }
+#endif
+      contractAgreed();
+      finishCommand(pd_command_status::Done);
+
+      return PESinkReady;
+    } else if (PD_MSGKIND_GET(&tempMessage) == PD_MSGKIND_DATA(PD_MSGTYPE_SOURCE_CAPABILITIES)) {
+      return PESinkEvalCap;
+    }
+  }
+  /* Nothing that ends the transition, keep waiting out what is left of tPSTransition */
+  return waitForEvent(PESinkTransitionSink, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, timers.remaining(TimerWait, stepTime));
+}
+
+template <class Platform, class Dpm, class Fusb>
+const typename PolicyEngineT<Platform, Dpm, Fusb>::ReadyAction PolicyEngineT<Platform, Dpm, Fusb>::readyActions[PD_MSGKIND_COUNT] = {
+    /* Control messages: -, GoodCRC, GotoMin, Accept, Reject, Ping, PS_RDY, Get_Source_Cap */
+    ReadyUnknown, ReadyUnknown, ReadyNotSupported, ReadyUnknown, ReadyUnknown, ReadyIgnore, ReadyUnknown, ReadyNotSupported,
+    /* Get_Sink_Cap, DR_Swap, PR_Swap, VCONN_Swap, Wait, Soft_Reset, -, - */
+    ReadyGiveSinkCap, ReadyNotSupported, ReadyNotSupported, ReadyNotSupported, ReadyUnknown, ReadySoftReset, ReadyUnknown, ReadyUnknown,
+    /* Not_Supported, Get_Source_Cap_Extended ... Get_Revision */
+    ReadyNotSupportedReceived, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+    ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+    /* Data messages: -, Source_Capabilities, Request, BIST, Sink_Capabilities, Battery_Status, Alert, Get_Country_Info */
+    ReadyUnknown, ReadyEvalCap, ReadyNotSupported, ReadyUnknown, ReadyNotSupported, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+    /* Enter_USB, EPR_Request, EPR_Mode, Source_Info, Revision, -, -, Vendor_Defined */
+    ReadyUnknown, ReadyUnknown, ReadyEPRMode, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyIgnore,
+    ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+    ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+    /* Extended messages: -, Source_Capabilities_Extended, Status, ... */
+    ReadyUnknown, ReadyUnknown, ReadyStatus, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+    ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+    ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+    ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown, ReadyUnknown,
+};
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_ready() -> policy_engine_state {
+  uint32_t evt = currentEvents;
+  /* The source's AMS is over, start ours again before anything raised since, which is left pending */
+  if (deferredAMS != PESinkReady && incomingMessages.getOccupied() == 0) {
+    sinkInitiatedAMS = true;
+    return deferredAMS;
+  }
+  /* Resets are taken by the wait, which comes straight back here once they are handled. Each of
+   * our own requests is only cleared when it is started, so one raised along with another, or
+   * during an AMS, is started once the ready state is back */
+  uint32_t requests = (uint32_t)Notifications::GET_SOURCE_CAP | (uint32_t)Notifications::NEW_POWER;
+#ifndef PD_DISABLE_PPS
+  requests |= (uint32_t)Notifications::PPS_REQUEST;
+#endif
+#ifndef PD_DISABLE_EPR
+  requests |= (uint32_t)Notifications::REQUEST_EPR | (uint32_t)Notifications::EPR_KEEPALIVE;
+#endif
+  clearEvents(evt & ~((uint32_t)Notifications::RESET | (uint32_t)Notifications::HARD_RESET | requests));
+#ifndef PD_DISABLE_PPS
+  /* If SinkPPSPeriodicTimer ran out, send a new request */
+  if (evt & (uint32_t)Notifications::PPS_REQUEST) {
+    clearEvents((uint32_t)Notifications::PPS_REQUEST);
+    sinkInitiatedAMS = true;
+    return PESinkSelectCapTx;
+  }
+#endif
+
+  /* If we overheated, send a hard reset */
+  if (evt & (uint32_t)Notifications::I_OVRTEMP) {
+    return PESinkHardReset;
+  }
+  /* If the DPM wants us to, send a Get_Source_Cap message */
+  if (evt & (uint32_t)Notifications::GET_SOURCE_CAP) {
+    clearEvents((uint32_t)Notifications::GET_SOURCE_CAP);
+    sinkInitiatedAMS = true;
+    return PESinkGetSourceCap;
+  }
+  /* Request the source sends us its current capabilities again */
+  if (evt & (uint32_t)Notifications::NEW_POWER) {
+    clearEvents((uint32_t)Notifications::NEW_POWER);
+    sinkInitiatedAMS = true;
+    return PESinkGetSourceCap;
+  }
+
+#ifndef PD_DISABLE_EPR
+  if (evt & (uint32_t)Notifications::REQUEST_EPR) {
+    clearEvents((uint32_t)Notifications::REQUEST_EPR);
+    sinkInitiatedAMS = true;
+    return PESinkRequestEPR;
+  }
+
+  if (evt & (uint32_t)Notifications::EPR_KEEPALIVE) {
+    clearEvents((uint32_t)Notifications::EPR_KEEPALIVE);
+    sinkInitiatedAMS    = true;
+    eprKeepAliveRetries = 0;
+    return PESinkSendEPRKeepAlive;
+  }
+#endif
+
+  /* If we received a message */
+  if (evt & (uint32_t)Notifications::MSG_RX) {
+    while (incomingMessages.getOccupied()) {
+
+      incomingMessages.pop(&tempMessage);
+
+      switch (readyActions[PD_MSGKIND_GET(&tempMessage)]) {
+      case ReadyIgnore:
+        break;
+      case ReadyStatus: {
+        uint16_t length = PD_DATA_SIZE_GET(&tempMessage);
+        memcpy(sourceStatusData, tempMessage.data, length < PD_STATUS_DATA_LEN ? length : PD_STATUS_DATA_LEN);
+        if (commandActive && activeCommand == pd_command::GetStatus) {
+          finishCommand(pd_command_status::Done);
+        }
+        break;
+      }
+      case ReadyNotSupported:
+        return PESinkSendNotSupported;
+      case ReadyEvalCap:
+        return PESinkEvalCap;
+      case ReadyGiveSinkCap:
+        return PESinkGiveSinkCap;
+      case ReadySoftReset:
+        return PESinkHandleSoftReset;
+#ifndef PD_DISABLE_EPR
+      case ReadyEPRMode:
+        if (tempMessage.bytes[0] == 3) {
+          is_epr = true;
+          timers.start(TimerEPR, stepTime, PD_T_EPR_KEEPALIVE);
+          // We start off from here, but let the message read loop run until all are read
+        } else if (tempMessage.bytes[0] == 4) {
+          is_epr = false;
+          finishCommand(pd_command_status::Failed);
+          return PESinkReady;
+          // We attempted to enter EPR and failed, no need to renegotiate
+        } else if (tempMessage.bytes[0] == 5) {
+          is_epr = false;
+          return PESinkWaitCap; // We exited EPR so now need to renegotiate an SPR contract
+        }
+        break;
+#endif
+      case ReadyNotSupportedReceived:
+        /* Tell the DPM a message we sent got a response of Not_Supported. */
+        if (isPD3_0()) {
+          return PESinkNotSupportedReceived;
+        }
+        break;
+      default:
+        /* PD 3.0 answers anything it does not know with Not_Supported */
+        if (isPD3_0()) {
+          /* If the message is a multi-chunk extended message */
+          if ((tempMessage.hdr & PD_HDR_EXT) && (PD_DATA_SIZE_GET(&tempMessage) >= PD_MAX_EXT_MSG_LEGACY_LEN)) {
+#ifndef PD_DISABLE_CHUNKING
+            if ((PD_MSGTYPE_GET(&tempMessage) == PD_MSGTYPE_EPR_SOURCE_CAPABILITIES)) {
+              return PESinkHandleEPRChunk;
+            }
+#endif
+            // We can support _some_ chunked messages but not all
+          }
+          return PESinkSendNotSupported;
+        }
+        break;
+      }
+    }
+  }
+
+  /* The source's messages were all handled here, so our AMS can go now */
+  if (deferredAMS != PESinkReady) {
+    sinkInitiatedAMS = true;
+    return deferredAMS;
+  }
+  /* Nothing else going on, so this is a safe point to act on requests from other tasks */
+  if (commandActive) {
+    if (!timers.expired(TimerCommand, stepTime)) {
+      /* Still waiting for the source to answer, give up at the deadline */
+      return waitForEvent(PESinkReady, (uint32_t)Notifications::ALL, timers.remaining(TimerCommand, stepTime), PESinkReady);
+    }
+    finishCommand(pd_command_status::Failed);
+  }
+  policy_engine_state next = startNextCommand();
+  if (next != PESinkReady) {
+    return next;
+  }
+  return waitForEvent(PESinkReady, (uint32_t)Notifications::ALL, TICK_MAX_DELAY);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_get_status() -> policy_engine_state {
+  tempMessage.hdr = hdr_template | PD_MSGTYPE_GET_STATUS | PD_NUMOBJ(0);
+  /* The Status comes back to the ready state */
+  return pe_start_message_tx(PESinkReady, PESinkHardReset, &tempMessage);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_get_source_cap() -> policy_engine_state {
+  /* Get a message object */
+  pd_msg *get_source_cap = &tempMessage;
+  /* Make a Get_Source_Cap message */
+  get_source_cap->hdr = hdr_template | PD_MSGTYPE_GET_SOURCE_CAP | PD_NUMOBJ(0);
+  /* Transmit the Get_Source_Cap */
+  // On fail -> hard reset, on send -> Sink Ready
+  return pe_start_message_tx(PESinkReady, PESinkHardReset, get_source_cap);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_give_sink_cap() -> policy_engine_state {
+  /* Get a message object */
+  pd_msg *snk_cap = &tempMessage;
+  /* Get our capabilities from the DPM */
+  pdbs_dpm_get_sink_capability(snk_cap, ((hdr_template & PD_HDR_SPECREV) >= PD_SPECREV_3_0));
+  /* Transmit our capabilities */
+  return pe_start_message_tx(PESinkReady, PESinkHardReset, snk_cap);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_hard_reset() -> policy_engine_state {
+  /* If we've already sent the maximum number of hard resets, assume the
+   * source is unresponsive. */
+
+#ifdef PD_DEBUG_OUTPUT
+  printf("Sending hard reset\r\n");
+#endif
+  if (_hard_reset_counter > PD_N_HARD_RESET_COUNT) {
+    return PESinkSourceUnresponsive;
+  }
+  /* Increment HardResetCounter */
+  _hard_reset_counter++;
+#ifdef PD_SEND_HARD_RESET
+  /* Signal the hard reset, carrying on once it is out or if the PHY never confirms it */
+  clearEvents((uint32_t)Notifications::HARD_SENT);
+  fusb.fusb_send_hardrst();
+  return waitForEvent(PESinkTransitionDefault, (uint32_t)Notifications::HARD_SENT, PD_T_HARD_RESET_COMPLETE, PESinkTransitionDefault);
+#else
+  // So, we could send a hardreset here; however that will cause a power cycle
+  // on the PSU end.. Which will then reset this MCU So therefore we went get
+  // anywhere :)
+  return PESinkTransitionDefault;
+#endif
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_transition_default() -> policy_engine_state {
+
+  /* There is no local hardware to reset. */
+  /* Since we never change our data role from UFP, there is no reason to set
+   * it here. */
+  finishCommand(pd_command_status::Failed);
+  /* Either side's Hard Reset starts the source's MessageIDs over */
+  rxMessageID = 0xFF;
+#ifdef PD_SEND_HARD_RESET
+  /* The source is about to cycle VBUS, so forget the contract and reset the protocol layer */
+  dropContract();
+  _tx_messageidcounter = 0;
+  fusb.fusb_reset();
+  enabledInterrupts = 0xFF;
+  incomingMessages.flush();
+  /* The reset that got us here is handled, clear it so the wait below cannot re-enter this state */
+  clearEvents((uint32_t)Notifications::RESET | (uint32_t)Notifications::HARD_RESET | (uint32_t)Notifications::VBUS_OFF | (uint32_t)Notifications::VBUS_ON);
+  /* Wait for the source to drop VBUS */
+  return waitForEvent(PESinkWaitVBusOn, (uint32_t)Notifications::VBUS_OFF, PD_T_SAFE_0V, PESinkWaitVBusOn);
+#else
+  return PESinkStartup;
+#endif
+}
+
+#ifdef PD_SEND_HARD_RESET
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_wait_vbus_on() -> policy_engine_state {
+  uint32_t evt = currentEvents;
+  clearEvents((uint32_t)Notifications::VBUS_OFF | (uint32_t)Notifications::VBUS_ON);
+  /* VBUS was never seen to drop, so don't wait for it to come back */
+  if (!(evt & (uint32_t)Notifications::VBUS_OFF)) {
+    return PESinkStartup;
+  }
+  /* Wait for the source to recover and turn VBUS on again */
+  return waitForEvent(PESinkStartup, (uint32_t)Notifications::VBUS_ON, PD_T_SRC_RECOVER_MAX + PD_T_SRC_TURN_ON, PESinkStartup);
+}
+#endif
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_soft_reset() -> policy_engine_state {
+  // Soft reset message is received
+  /* Reset the protocol layer, the Accept goes out as message 0 and anything
+   * queued from before the reset is stale */
+  _tx_messageidcounter = 0;
+  incomingMessages.flush();
+  dropContract();
+
+  /* Make an Accept message */
+  pd_msg *accept = &tempMessage;
+  accept->hdr    = hdr_template | PD_MSGTYPE_ACCEPT | PD_NUMOBJ(0);
+  /* Transmit the Accept */
+  return pe_start_message_tx(PESinkSetupWaitCap, PESinkHardReset, accept);
+}
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_send_soft_reset() -> policy_engine_state {
+  /* The protocol layer resets its MessageIDCounter just before a Soft_Reset
+   * message is transmitted, anything already received is from before the
+   * reset and would be taken for the answer to it. The source counts its
+   * MessageIDs from 0 again once it has the Soft_Reset. */
+  incomingMessages.flush();
+  clearEvents((uint32_t)Notifications::MSG_RX);
+  rxMessageID = 0xFF;
+
+#ifdef PD_DEBUG_OUTPUT
+  printf("Sending soft reset\r\n");
+#endif
+  /* Get a message object */
+  pd_msg *softrst = &tempMessage;
+  /* Make a Soft_Reset message */
+  softrst->hdr = hdr_template | PD_MSGTYPE_SOFT_RESET | PD_NUMOBJ(0);
+  /* Transmit the soft reset */
+  return pe_start_message_tx(PESinkSendSoftResetTxOK, PESinkHardReset, softrst);
+}
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_send_soft_reset_tx_ok() -> policy_engine_state {
+  // Transmit is good, wait for response event
+  return waitForEvent(PESinkSendSoftResetResp, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, PD_T_SENDER_RESPONSE);
+}
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_send_soft_reset_resp() -> policy_engine_state {
+
+  /* Wait for a response */
+  clearEvents((uint32_t)Notifications::MSG_RX);
+
+  /* Get the response message */
+  if (incomingMessages.getOccupied()) {
+
+    incomingMessages.pop(&tempMessage);
+
+    /* If the source accepted our soft reset, wait for capabilities. */
+    if (PD_MSGKIND_GET(&tempMessage) == PD_MSGKIND_CONTROL(PD_MSGTYPE_ACCEPT)) {
+
+      return PESinkSetupWaitCap;
+      /* If the message was a Soft_Reset, do the soft reset procedure */
+    } else if (PD_MSGKIND_GET(&tempMessage) == PD_MSGKIND_CONTROL(PD_MSGTYPE_SOFT_RESET)) {
+      return PESinkHandleSoftReset;
+      /* Otherwise, send a hard reset */
+    } else {
+      return PESinkHardReset;
+    }
+  }
+  /* Nothing received yet, keep waiting out what is left of tSenderResponse */
+  return waitForEvent(PESinkSendSoftResetResp, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, timers.remaining(TimerWait, stepTime));
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_send_not_supported() -> policy_engine_state {
+  /* Get a message object */
+
+#ifdef PD_DEBUG_OUTPUT
+  printf("Sending not supported\r\n");
+#endif
+  if ((hdr_template & PD_HDR_SPECREV) == PD_SPECREV_2_0) {
+    /* Make a Reject message */
+    tempMessage.hdr = hdr_template | PD_MSGTYPE_REJECT | PD_NUMOBJ(0);
+  } else if ((hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0) {
+    /* Make a Not_Supported message */
+    tempMessage.hdr = hdr_template | PD_MSGTYPE_NOT_SUPPORTED | PD_NUMOBJ(0);
+  }
+
+  /* Transmit the message */
+  return pe_start_message_tx(PESinkReady, PESinkSendSoftReset, &tempMessage);
+}
+
+#ifndef PD_DISABLE_CHUNKING
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_wait_epr_chunk() -> policy_engine_state {
+  uint32_t evt = currentEvents;
+  clearEvents((uint32_t)Notifications::MSG_RX);
+  /* If we received a message */
+  if (evt & (uint32_t)Notifications::MSG_RX) {
+    while (incomingMessages.getOccupied()) {
+      incomingMessages.pop(&tempMessage);
+
+      if ((hdr_template & PD_HDR_SPECREV) == PD_SPECREV_3_0) {
+        /* If the message is a multi-chunk extended message */
+        if ((tempMessage.hdr & PD_HDR_EXT) && (PD_DATA_SIZE_GET(&tempMessage) >= PD_MAX_EXT_MSG_LEGACY_LEN)) {
+          if (PD_MSGKIND_GET(&tempMessage) == PD_MSGKIND_EXTENDED(PD_MSGTYPE_EPR_SOURCE_CAPABILITIES)) {
+            return PESinkHandleEPRChunk;
+          } else {
+            // We can support _some_ chunked messages but not all
+            return PESinkSendNotSupported;
+          }
+          /* Tell the DPM a message we sent got a response of Not_Supported. */
+        }
+      }
+    }
+  }
+
+  return waitForEvent(PESinkWaitForHandleEPRChunk, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, TICK_MAX_DELAY);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_handle_epr_chunk() -> policy_engine_state {
+  if (tempMessage.exthdr & PD_EXTHDR_REQUEST_CHUNK) {
+    return waitForEvent(PESinkWaitForHandleEPRChunk, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, TICK_MAX_DELAY);
+  }
+  uint8_t chunk_index = PD_CHUNK_NUMBER_GET(&tempMessage);
+
+  if (chunk_index == 0) {
+    // Copy first message directly over the object to set header,ext-header + start of PDO's
+    memcpy(&this->recent_epr_capabilities, &tempMessage.bytes, sizeof(tempMessage.bytes));
+  } else {
+    memcpy(&(this->recent_epr_capabilities.data[chunk_index * PD_MAX_EXT_MSG_CHUNK_LEN]), &(tempMessage.data), 2 + (4 * (PD_NUMOBJ_GET(&tempMessage) - 1)));
+  }
+  const auto recievedLength = (PD_MAX_EXT_MSG_CHUNK_LEN * chunk_index) /*Bytes Implicit by chunk index*/ + 2 /*half PDO*/ + (4 * (PD_NUMOBJ_GET(&tempMessage) - 1) /* Data in this message*/);
+
+  if ((recievedLength) >= PD_DATA_SIZE_GET(&this->recent_epr_capabilities)) {
+    return PESinkEPREvalCap;
+  }
+  memset(tempMessage.data, 0, sizeof(tempMessage.data));
+  tempMessage.hdr    = this->hdr_template | (tempMessage.hdr & PD_HDR_MSGTYPE) | PD_NUMOBJ(1) | PD_HDR_EXT;
+  tempMessage.exthdr = ((chunk_index + 1) << PD_EXTHDR_CHUNK_NUMBER_SHIFT) | PD_EXTHDR_REQUEST_CHUNK | PD_EXTHDR_CHUNKED;
+  return pe_start_message_tx(PESinkWaitForHandleEPRChunk, PESinkHardReset, &tempMessage);
+}
+
+#endif
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_not_supported_received() -> policy_engine_state {
+  /* Inform the Device Policy Manager that we received a Not_Supported
+   * message. */
+  finishCommand(pd_command_status::NotSupported);
+
+  return waitForEvent(PESinkReady, (uint32_t)Notifications::ALL, TICK_MAX_DELAY);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_source_unresponsive() -> policy_engine_state {
+  // Sit and chill, as PD is not working
+  dropContract();
+  finishCommand(pd_command_status::Failed);
+  if (unresponsiveTypeCCurrent == 0xFF) {
+    reportContractEvent(pd_contract_event::SourceUnresponsive);
+  }
+  uint32_t evt = currentEvents;
+  clearEvents((uint32_t)Notifications::MSG_RX);
+
+  /* The source has started talking PD after all */
+  if (evt & (uint32_t)Notifications::MSG_RX) {
+    unresponsiveTypeCCurrent = 0xFF;
+    _hard_reset_counter      = 0;
+    return PESinkSetupWaitCap;
+  }
+
+  /* Re-probe: if the advertised Type-C current moved, something was (re)attached, so start over */
+  uint8_t typeCCurrent = fusb.fusb_get_typec_current();
+  if (unresponsiveTypeCCurrent != 0xFF && typeCCurrent != unresponsiveTypeCCurrent) {
+    unresponsiveTypeCCurrent = 0xFF;
+    _hard_reset_counter      = 0;
+#ifdef PD_UNRESPONSIVE_RERUN_CC_SELECTION
+    fusb.runCCLineSelection();
+#endif
+    return PESinkStartup;
+  }
+  unresponsiveTypeCCurrent = typeCCurrent;
+  /* We gave up on the source, so whatever it sends next is new to us */
+  rxMessageID = 0xFF;
+
+  /* Check again in a while, without blocking the caller */
+  return waitForEvent(PESinkSourceUnresponsive, (uint32_t)Notifications::MSG_RX | (uint32_t)Notifications::RESET, PD_T_PD_DEBOUNCE, PESinkSourceUnresponsive);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_wait_event() -> policy_engine_state {
+  if (currentEvents & (uint32_t)Notifications::RESET) {
+    clearEvents((uint32_t)Notifications::RESET);
+    return PESinkHandleSoftReset;
+  }
+  /* What we waited for is taken even if thread() only got round to it after the deadline */
+  if (currentEvents & waitingEventsMask) {
+    return postNotificationEvalState;
+  }
+  // Check timeout
+  if (timers.expired(TimerWait, stepTime)) {
+    /* Nothing it waited for is pending, anything else is left for the states that handle it */
+    if (postTimeoutState != PEWaitingEvent) {
+      return postTimeoutState;
+    }
+    if (postNotificationEvalState >= PESinkHandleSoftReset && postNotificationEvalState <= PESinkSendSoftResetResp) {
+      // Timeout in soft reset, so reset state machine
+      return PESinkStartup;
+    }
+    return PESinkSendSoftReset;
+  }
+  return policy_engine_state::PEWaitingEvent;
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_wait_tx_ok() -> policy_engine_state {
+  uint32_t evt = currentEvents;
+  clearEvents((uint32_t)Notifications::SINK_TX_OK);
+
+  /* The source started its own AMS first, so handle that, ours is started again after it */
+  if (evt & (uint32_t)Notifications::MSG_RX) {
+    return PESinkReady;
+  }
+  return pe_start_message_tx(postSendState, postSendFailedState, pendingTxMessage);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_wait_send_done() -> policy_engine_state {
+  /* Only the TX result is consumed here, anything received meanwhile stays queued */
+  uint32_t evt = currentEvents;
+  clearEvents((uint32_t)Notifications::TX_DONE | (uint32_t)Notifications::TX_ERR | (uint32_t)Notifications::TX_DISCARDED);
+
+  /* Unless it was discarded, our AMS is underway or has failed */
+  if (!((uint32_t)evt & (uint32_t)Notifications::TX_DISCARDED)) {
+    deferredAMS = PESinkReady;
+  }
+  /* The source acknowledged our message */
+  if ((uint32_t)evt & (uint32_t)Notifications::TX_DONE) {
+#ifndef PD_DISABLE_EPR
+    /* Which is as good as a keepalive, so the next one is only due a full period from now */
+    if (is_epr) {
+      timers.start(TimerEPR, stepTime, PD_T_EPR_KEEPALIVE);
+    }
+#endif
+    return postSendState;
+  }
+  /* The source was already sending, so ours never went out. That is no failure of the link, handle
+   * what the source sent from the ready state, or go on waiting for capabilities without a contract.
+   * If it was the start of our own AMS, that is sent again once the source's message is in */
+  if ((uint32_t)evt & (uint32_t)Notifications::TX_DISCARDED) {
+    if (!_explicit_contract) {
+      return PESinkWaitCap;
+    }
+    return waitForEvent(PESinkReady, (uint32_t)Notifications::ALL, PD_T_SENDER_RESPONSE, PESinkReady);
+  }
+  /* Retries ran out */
+  return postSendFailedState;
+}
+
+#ifndef PD_DISABLE_EPR
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_epr_eval_cap() -> policy_engine_state {
+  timers.start(TimerEPR, stepTime, PD_T_EPR_KEEPALIVE);
+  if (pdbs_dpm_epr_evaluate_capability(&recent_epr_capabilities, &_last_dpm_request)) {
+    auto pps_index = PD_RDO_OBJPOS_GET(&_last_dpm_request);
+    requestedPDO   = recent_epr_capabilities.obj[pps_index - 1];
+#ifndef PD_DISABLE_PPS
+    if ((recent_epr_capabilities.obj[pps_index - 1] & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED && (recent_epr_capabilities.obj[pps_index - 1] & PD_APDO_TYPE) == PD_APDO_TYPE_PPS) {
+      timers.start(TimerPPS, stepTime, PD_T_PPS_REREQUEST);
+    } else {
+      timers.stop(TimerPPS);
+    }
+#endif
+    _last_dpm_request.hdr |= hdr_template;
+    return PESinkSelectCapTx;
+  } else {
+    return PESinkWaitCap;
+  }
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_request_epr() -> policy_engine_state {
+  timers.start(TimerEPR, stepTime, PD_T_EPR_KEEPALIVE);
+  pd_msg *epr_mode = &tempMessage;
+  epr_mode->hdr    = this->hdr_template | PD_MSGTYPE_EPR_MODE | PD_NUMOBJ(1);
+  epr_mode->obj[0] = (0x01 << PD_EPR_MODE_ACTION_SHIFT) | (device_epr_wattage << PD_EPR_MODE_DATA_SHIFT);
+  return pe_start_message_tx(PESinkReady, PESinkHardReset, epr_mode);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_exit_epr() -> policy_engine_state {
+  /* The source follows up with SPR capabilities, which we negotiate as usual */
+  is_epr           = false;
+  pd_msg *epr_mode = &tempMessage;
+  epr_mode->hdr    = this->hdr_template | PD_MSGTYPE_EPR_MODE | PD_NUMOBJ(1);
+  epr_mode->obj[0] = (0x05 << PD_EPR_MODE_ACTION_SHIFT);
+  return pe_start_message_tx(PESinkWaitCap, PESinkHardReset, epr_mode);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_send_epr_keep_alive() -> policy_engine_state {
+  /* Anything already queued is left for the ready state to handle */
+  negotiationOfEPRInProgress = true;
+  sinkInitiatedAMS           = true;
+  tempMessage.hdr            = PD_HDR_EXT | this->hdr_template | PD_NUMOBJ(1) | PD_MSGTYPE_EXTENDED_CONTROL;
+  tempMessage.exthdr         = (PD_EXTHDR_DATA_SIZE & 2) << PD_EXTHDR_DATA_SIZE_SHIFT | PD_EXTHDR_CHUNKED;
+  tempMessage.data[0]        = PD_EXTENDED_CONTROL_TYPE_EPR_KEEPALIVE;
+  tempMessage.data[1]        = PD_EXTENDED_CONTROL_DATA_UNUSED;
+  return pe_start_message_tx(PESinkWaitEPRKeepAliveAck, PESinkReady, &tempMessage);
+}
+
+template <class Platform, class Dpm, class Fusb> auto PolicyEngineT<Platform, Dpm, Fusb>::pe_sink_wait_epr_keep_alive_ack() -> policy_engine_state {
+  clearEvents((uint32_t)Notifications::MSG_RX);
+  /* Look for the ACK, passing over (and keeping, in order) anything else */
+  bool   acked  = false;
+  size_t queued = incomingMessages.getOccupied();
+  while (queued--) {
+    incomingMessages.pop(&tempMessage);
+    if (!acked && PD_MSGKIND_GET(&tempMessage) == PD_MSGKIND_EXTENDED(PD_MSGTYPE_EXTENDED_CONTROL) && tempMessage.data[0] == PD_EXTENDED_CONTROL_TYPE_EPR_KEEPALIVE_ACK) {
+      acked = true;
+    } else {
+      incomingMessages.push(&tempMessage);
+    }
+  }
+  if (acked) {
+    negotiationOfEPRInProgress = false;
+    timers.start(TimerEPR, stepTime, PD_T_EPR_KEEPALIVE);
+    return PESinkReady;
+  }
+  if (incomingMessages.getOccupied()) {
+    /* The source started something of its own, handle that and send the keepalive again once it is due */
+    negotiationOfEPRInProgress = false;
+    return PESinkReady;
+  }
+  /* Only running out of time to ACK counts against the keepalive, not being woken for anything else.
+   * The time runs from the send, which restarted TimerEPR, so no wake in between moves it back.
+   * Try again, then give up with a hard reset as the source will soon leave EPR mode by one anyway */
+  const TICK_TYPE sinceSent = timers.elapsed(TimerEPR, stepTime);
+  if (sinceSent > PD_T_EPR_KEEPALIVE_ACK) {
+    if (eprKeepAliveRetries < PD_N_EPR_KEEPALIVE_RETRY_COUNT) {
+      eprKeepAliveRetries++;
+      return PESinkSendEPRKeepAlive;
+    }
+    return PESinkHardReset;
+  }
+  /* Sleep until a message arrives or the ACK is overdue, a reset is still taken while waiting */
+  return waitForEvent(PESinkWaitEPRKeepAliveAck, (uint32_t)Notifications::MSG_RX, PD_T_EPR_KEEPALIVE_ACK - sinceSent, PESinkWaitEPRKeepAliveAck);
+}
+#endif
+
+#endif /* PDB_POLICY_ENGINE_STATES_IMPL_H */
@@ -0,0 +1,260 @@
+/*
+ * PD Buddy Firmware Library - USB Power Delivery for everyone
+ * Copyright 2017-2018 Clayton G. Hobbs
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "power_arbiter.h"
+#include <cstring>
+#include <pd.h>
+
+uint8_t PowerArbiter::addPort(PolicyEngine *pe, const port_limits &limits) {
+  if (numPorts >= PD_ARBITER_MAX_PORTS) {
+    return 0xFF;
+  }
+  port_state &port = ports[numPorts];
+  memset(&port, 0, sizeof(port));
+  port.pe     = pe;
+  port.limits = limits;
+  return numPorts++;
+}
+
+bool PowerArbiter::evaluateCapability(uint8_t portIndex, const pd_msg *capabilities, pd_msg *request) {
+  if (portIndex >= numPorts) {
+    return false;
+  }
+  port_state &port = ports[portIndex];
+  if (capabilities) {
+    uint8_t numobj = PD_NUMOBJ_GET(capabilities);
+    if (numobj > 7) {
+      numobj = 7;
+    }
+    // Only re-solve if this source is advertising something new
+    if (!port.attached || numobj != port.numPdos || memcmp(port.pdos, capabilities->obj, numobj * 4) != 0) {
+      port.attached = true;
+      port.numPdos  = numobj;
+      memcpy(port.pdos, capabilities->obj, numobj * 4);
+      evaluatePort(port);
+      allocate(portIndex);
+    }
+  }
+  port.renegotiating = false;
+  const uint32_t room = headroom(portIndex);
+  port.granted_mw     = port.allocated_mw < room ? port.allocated_mw : room;
+  buildRequest(port, request);
+  // Without a contract callback the lower request is all we will hear of, see contractChanged()
+  releaseHeadroom(portIndex);
+  return true;
+}
+
+void PowerArbiter::contractChanged(uint8_t portIndex, uint32_t millivolts, uint32_t milliamps) {
+  if (portIndex >= numPorts) {
+    return;
+  }
+  port_state &port = ports[portIndex];
+  port.agreed_mw   = (millivolts * milliamps) / 1000;
+  // Asked while it was already past building its request, so ask again now that one has finished
+  if (port.renegotiating) {
+    askToRenegotiate(port);
+  }
+  releaseHeadroom(portIndex);
+}
+
+void PowerArbiter::portDetached(uint8_t portIndex) {
+  if (portIndex >= numPorts) {
+    return;
+  }
+  port_state &port   = ports[portIndex];
+  port.attached      = false;
+  port.renegotiating = false;
+  port.numPdos       = 0;
+  port.best_position = 0;
+  port.best_mw       = 0;
+  port.granted_mw    = 0;
+  port.agreed_mw     = 0;
+  allocate(portIndex);
+  releaseHeadroom(portIndex);
+}
+
+void PowerArbiter::setSystemLimit(uint32_t system_max_power_mw) {
+  system_max_mw = system_max_power_mw;
+  allocate(0xFF);
+  releaseHeadroom(0xFF);
+}
+
+uint32_t PowerArbiter::allocatedPower(uint8_t portIndex) const {
+  if (portIndex >= numPorts) {
+    return 0;
+  }
+  return ports[portIndex].allocated_mw;
+}
+
+uint32_t PowerArbiter::totalAllocatedPower() const {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < numPorts; i++) {
+    total += ports[i].allocated_mw;
+  }
+  return total;
+}
+
+bool PowerArbiter::isRenegotiating(uint8_t portIndex) const {
+  if (portIndex >= numPorts) {
+    return false;
+  }
+  return ports[portIndex].renegotiating;
+}
+
+void PowerArbiter::evaluatePort(port_state &port) {
+  port.best_position = 0;
+  port.best_is_pps   = false;
+  port.best_mv       = 0;
+  port.best_mw       = 0;
+  for (uint8_t i = 0; i < port.numPdos; i++) {
+    const uint32_t pdo = port.pdos[i];
+    uint32_t       voltage_mv;
+    uint32_t       current_ma;
+    bool           isPPS;
+    if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_FIXED) {
+      voltage_mv = PD_PDV2MV(PD_PDO_SRC_FIXED_VOLTAGE_GET(pdo));
+      current_ma = PD_PDI2MA(PD_PDO_SRC_FIXED_CURRENT_GET(pdo));
+      if (voltage_mv < port.limits.min_voltage_mv || voltage_mv > port.limits.max_voltage_mv) {
+        continue;
+      }
+      isPPS = false;
+    } else if ((pdo & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED && (pdo & PD_APDO_TYPE) == PD_APDO_TYPE_PPS) {
+      // Run the PPS supply as high as both ends allow to keep the current down
+      uint32_t min_mv = PD_PAV2MV(PD_APDO_PPS_MIN_VOLTAGE_GET(pdo));
+      voltage_mv      = PD_PAV2MV(PD_APDO_PPS_MAX_VOLTAGE_GET(pdo));
+      if (voltage_mv > port.limits.max_voltage_mv) {
+        voltage_mv = port.limits.max_voltage_mv;
+      }
+      if (voltage_mv < min_mv || voltage_mv < port.limits.min_voltage_mv) {
+        continue;
+      }
+      current_ma = PD_PAI2MA(PD_APDO_PPS_CURRENT_GET(pdo));
+      isPPS      = true;
+    } else {
+      continue;
+    }
+    if (current_ma > port.limits.max_current_ma) {
+      current_ma = port.limits.max_current_ma;
+    }
+    uint32_t power_mw = (voltage_mv * current_ma) / 1000;
+    if (power_mw > port.limits.max_power_mw) {
+      power_mw = port.limits.max_power_mw;
+    }
+    // On a tie prefer the higher voltage, and fixed supplies as they come first
+    if (port.best_position == 0 || power_mw > port.best_mw || (power_mw == port.best_mw && voltage_mv > port.best_mv)) {
+      port.best_position = i + 1;
+      port.best_is_pps   = isPPS;
+      port.best_mv       = voltage_mv;
+      port.best_mw       = power_mw;
+    }
+  }
+}
+
+void PowerArbiter::allocate(uint8_t skipPort) {
+  // Water-fill the budget: ports that want less than an even share get all
+  // they want, the rest split whatever remains evenly. This delivers
+  // min(sum of wants, system limit) in total.
+  uint32_t share[PD_ARBITER_MAX_PORTS];
+  bool     settled[PD_ARBITER_MAX_PORTS];
+  uint32_t remaining = system_max_mw;
+  uint8_t  unsettled = 0;
+  for (uint8_t i = 0; i < numPorts; i++) {
+    share[i]   = 0;
+    settled[i] = !ports[i].attached || ports[i].best_mw == 0;
+    if (!settled[i]) {
+      unsettled++;
+    }
+  }
+  while (unsettled) {
+    uint32_t evenShare = remaining / unsettled;
+    bool     progress  = false;
+    for (uint8_t i = 0; i < numPorts; i++) {
+      if (!settled[i] && ports[i].best_mw <= evenShare) {
+        share[i]   = ports[i].best_mw;
+        settled[i] = true;
+        remaining -= share[i];
+        unsettled--;
+        progress = true;
+      }
+    }
+    if (!progress) {
+      for (uint8_t i = 0; i < numPorts; i++) {
+        if (!settled[i]) {
+          share[i] = evenShare;
+        }
+      }
+      break;
+    }
+  }
+
+  for (uint8_t i = 0; i < numPorts; i++) {
+    port_state &port = ports[i];
+    if (share[i] == port.allocated_mw) {
+      continue;
+    }
+    port.allocated_mw = share[i];
+    if (i != skipPort && port.attached) {
+      askToRenegotiate(port);
+    }
+  }
+}
+
+uint32_t PowerArbiter::headroom(uint8_t portIndex) const {
+  uint32_t reserved = 0;
+  for (uint8_t i = 0; i < numPorts; i++) {
+    if (i != portIndex) {
+      // A lower request only counts once agreed, a higher one may be agreed at any time
+      reserved += ports[i].agreed_mw > ports[i].granted_mw ? ports[i].agreed_mw : ports[i].granted_mw;
+    }
+  }
+  return reserved < system_max_mw ? system_max_mw - reserved : 0;
+}
+
+void PowerArbiter::releaseHeadroom(uint8_t skipPort) {
+  for (uint8_t i = 0; i < numPorts; i++) {
+    port_state &port = ports[i];
+    if (i != skipPort && port.attached && !port.renegotiating && port.granted_mw < port.allocated_mw && headroom(i) > port.granted_mw) {
+      askToRenegotiate(port);
+    }
+  }
+}
+
+void PowerArbiter::askToRenegotiate(port_state &port) {
+  if (!port.pe) {
+    return;
+  }
+  // Refused while a renegotiation is already running, the flag stays set and contractChanged() asks again
+  port.renegotiating = true;
+  port.pe->postCommand(pd_command::Renegotiate);
+}
+
+void PowerArbiter::buildRequest(const port_state &port, pd_msg *request) {
+  request->hdr = PD_MSGTYPE_REQUEST | PD_NUMOBJ(1);
+  if (port.best_position == 0) {
+    /* Nothing usable, so sit on vSafe5V drawing nothing */
+    request->obj[0] = PD_RDO_FV_MAX_CURRENT_SET(0) | PD_RDO_FV_CURRENT_SET(0) | PD_RDO_NO_USB_SUSPEND | PD_RDO_CAP_MISMATCH | PD_RDO_OBJPOS_SET(1);
+    return;
+  }
+  uint32_t current_ma = (port.granted_mw * 1000) / port.best_mv;
+  // Round currents down so the port never exceeds its share
+  if (port.best_is_pps) {
+    request->obj[0] = PD_RDO_PROG_VOLTAGE_SET(PD_MV2PRV(port.best_mv)) | PD_RDO_PROG_CURRENT_SET(current_ma / 50);
+  } else {
+    uint32_t current_pdi = current_ma / 10;
+    request->obj[0]      = PD_RDO_FV_MAX_CURRENT_SET(current_pdi) | PD_RDO_FV_CURRENT_SET(current_pdi);
+  }
+  request->obj[0] |= PD_RDO_NO_USB_SUSPEND | PD_RDO_OBJPOS_SET(port.best_position);
+}
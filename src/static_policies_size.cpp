@@ -0,0 +1,42 @@
+/*
+ * PD Buddy Firmware Library - USB Power Delivery for everyone
+ * Copyright 2017-2018 Clayton G. Hobbs
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Only built for the size_report target, never linked.
+ *
+ * The driver and policy engine instantiated with static policies, so their code size
+ * can be compared with the runtime forms in the library. The policy functions are left
+ * undefined here, as an application would provide them in its own source files.
+ */
+#include "policy_engine_impl.h"
+
+struct SizeReportBus {
+  static bool read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf);
+  static bool write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf);
+  static void delay(uint32_t milliseconds);
+};
+struct SizeReportPlatform {
+  static TICK_TYPE getTimeStamp();
+  static void      delay(TICK_TYPE milliseconds);
+};
+struct SizeReportDpm {
+  static bool evaluateCapability(const pd_msg *capabilities, pd_msg *request);
+  static bool evaluateEPRCapability(const epr_pd_msg *capabilities, pd_msg *request);
+  static void getSinkCapability(pd_msg *cap, const bool isPD3);
+};
+
+template class FUSB302T<SizeReportBus>;
+template class PolicyEngineT<SizeReportPlatform, SizeReportDpm, FUSB302T<SizeReportBus>>;
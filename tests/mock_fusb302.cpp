@@ -2,7 +2,6 @@
 #include "CppUTest/TestHarness.h"
 #include "fusb302_defines.h"
 #include <cstring>
-#include <iostream>
 void MockFUSB302::reset() {
   // 0 init by default
   memset(mockRegs, 0, sizeof(mockRegs));
@@ -32,22 +31,61 @@ void MockFUSB302::reset() {
   setRegister(FUSB_INTERRUPT, 0x00);
   // Clear FiFo
   resetFiFo();
+  reads          = 0;
+  writes         = 0;
+  busNanoseconds = 0;
+}
+void MockFUSB302::setBusClock(const uint32_t hz, const uint32_t stretchMaxNs) {
+  busClock   = hz;
+  stretchMax = stretchMaxNs;
+  stretchLCG = 1;
+}
+void MockFUSB302::addBusTime(const bool read, const uint8_t size) {
+  // Address and register bytes, plus the repeated START and address for a read
+  uint32_t bits  = 1 + 9 + 9 + 9 * size + 1;
+  uint32_t bytes = 2 + size;
+  if (read) {
+    bits += 1 + 9;
+    bytes++;
+  }
+  busNanoseconds += (uint64_t)bits * 1000000000ULL / busClock;
+  if (stretchMax) {
+    for (uint32_t i = 0; i < bytes; i++) {
+      stretchLCG = stretchLCG * 1103515245 + 12345;
+      busNanoseconds += (stretchLCG >> 16) % (stretchMax + 1);
+    }
+  }
 }
 void MockFUSB302::resetFiFo() {
-  while (!fifoContent.empty()) {
-    fifoContent.pop();
+  while (!rxFifo.empty()) {
+    rxFifo.pop();
+  }
+  while (!txFifo.empty()) {
+    txFifo.pop();
   }
+  updateFiFoStatus();
 }
 
 bool MockFUSB302::i2cRead(const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) {
   // Validate valid i2c address
   bool addressValid = (deviceAddress == FUSB302B_ADDR) || (deviceAddress == FUSB302B01_ADDR) || (deviceAddress == FUSB302B10_ADDR) || (deviceAddress == FUSB302B11_ADDR);
   CHECK_TRUE(addressValid);
-  if (address == FUSB_FIFOS) {
-    readFiFo(size, buf);
-  } else {
-    for (int i = 0; i < size; i++) {
+  reads++;
+  addBusTime(true, size);
+  for (int i = 0; i < size; i++) {
+    if (address + i >= FUSB_FIFOS) {
+      // The FIFO address does not advance, an empty FIFO reads as zeros
+      buf[i] = 0;
+      if (!rxFifo.empty()) {
+        buf[i] = rxFifo.front();
+        rxFifo.pop();
+        updateFiFoStatus();
+      }
+    } else {
       buf[i] = getRegister(address + i);
+      if (address + i == FUSB_INTERRUPTA || address + i == FUSB_INTERRUPTB || address + i == FUSB_INTERRUPT) {
+        setRegister(address + i, 0);
+      }
     }
   }
   return true;
@@ -56,8 +94,12 @@ bool MockFUSB302::i2cWrite(const uint8_t deviceAddress, const uint8_t address, c
   // Validate valid i2c address
   bool addressValid = (deviceAddress == FUSB302B_ADDR) || (deviceAddress == FUSB302B01_ADDR) || (deviceAddress == FUSB302B10_ADDR) || (deviceAddress == FUSB302B11_ADDR);
   CHECK_TRUE(addressValid);
+  writes++;
+  addBusTime(false, size);
   if (address == FUSB_FIFOS) {
-    addToFIFO(size, buf);
+    for (int i = 0; i < size; i++) {
+      txFifo.push(buf[i]);
+    }
   } else {
     for (int i = 0; i < size; i++) {
       setRegister(address + i, buf[i]);
@@ -107,29 +149,31 @@ uint8_t MockFUSB302::getRegister(const uint8_t reg) {
   return mockRegs[reg];
 }
 void MockFUSB302::addToFIFO(const uint8_t length, const uint8_t *data) {
-  std::cout << "Adding " << (int)length << " bytes to FiFo" << std::endl;
   for (int i = 0; i < length; i++) {
     addToFIFO(data[i]);
   }
 }
 void MockFUSB302::addToFIFO(const uint8_t data) {
-  fifoContent.push(data);
+  rxFifo.push(data);
   updateFiFoStatus();
 }
 
+bool MockFUSB302::interruptAsserted() {
+  return (getRegister(FUSB_INTERRUPT) & ~getRegister(FUSB_MASK1)) || (getRegister(FUSB_INTERRUPTA) & ~getRegister(FUSB_MASKA)) || (getRegister(FUSB_INTERRUPTB) & ~getRegister(FUSB_MASKB) & FUSB_INTERRUPTB_I_GCRCSENT);
+}
+
 void MockFUSB302::updateFiFoStatus() {
-  if (fifoContent.size()) {
+  if (rxFifo.size()) {
     setRegister(FUSB_STATUS1, getRegister(FUSB_STATUS1) & (~FUSB_STATUS1_RX_EMPTY));
   } else {
     setRegister(FUSB_STATUS1, getRegister(FUSB_STATUS1) | FUSB_STATUS1_RX_EMPTY);
   }
 }
 bool MockFUSB302::readFiFo(const uint8_t length, uint8_t *buffer) {
-  CHECK_TRUE(fifoContent.size() >= length);
+  CHECK_TRUE(txFifo.size() >= length);
   for (int i = 0; i < length; i++) {
-    buffer[i] = fifoContent.front();
-    fifoContent.pop();
+    buffer[i] = txFifo.front();
+    txFifo.pop();
   }
-  updateFiFoStatus();
   return true;
 }
\ No newline at end of file
@@ -1,5 +1,5 @@
 #pragma once
-#include <iostream>
+#include "fusb302_defines.h"
 #include <queue>
 #include <stdint.h>
 
@@ -7,6 +7,9 @@
  * Implements a mockup of an FUSB302 that is used by testing
  * This works by having fake I2C handlers that talk to an internal state of registers
  * The testing code can then modify these to suit the situation
+ *
+ * Like the part, the interrupt registers clear when read, and a read that runs
+ * past the status registers carries on into the RX FIFO
  */
 class MockFUSB302 {
 public:
@@ -17,18 +20,40 @@ public:
   // methods used via testing to put in values
   void    setRegister(const uint8_t reg, const uint8_t value);
   uint8_t getRegister(const uint8_t reg);
-  void    addToFIFO(const uint8_t length, const uint8_t *data);
-  void    addToFIFO(const uint8_t data);
+  // Bytes received from the cable, for the driver to read out of FUSB_FIFOS
+  void addToFIFO(const uint8_t length, const uint8_t *data);
+  void addToFIFO(const uint8_t data);
   // Reset to defaults
   void reset();
   void resetFiFo();
+  // Bytes the driver wrote to FUSB_FIFOS to send
   bool readFiFo(const uint8_t length, uint8_t *buffer);
-  bool fifoEmpty() { return fifoContent.size() == 0; };
+  bool fifoEmpty() { return txFifo.size() == 0; };
+  // True if an unmasked interrupt flag would be pulling INT_N low
+  bool interruptAsserted();
+  // I2C transactions since the last reset()
+  uint32_t reads  = 0;
+  uint32_t writes = 0;
+
+  /*
+   * Modelled bus occupancy of those transactions since the last reset(), in nanoseconds.
+   * Each one costs a START, the address and register bytes, a repeated START and the
+   * address again for reads, 9 clocks for each data byte and a STOP. A stretch of up to
+   * stretchMaxNs is added after every byte, from a fixed seed so runs repeat exactly.
+   */
+  uint64_t busNanoseconds = 0;
+  void     setBusClock(const uint32_t hz, const uint32_t stretchMaxNs = 0);
+  // For harnesses that take over a transfer themselves but still want it timed
+  void addBusTime(const bool read, const uint8_t size);
 
 private:
   bool validateRegister(const uint8_t reg);
   void updateFiFoStatus();
   // Cached state of the internal regs
-  uint8_t             mockRegs[0x43];
-  std::queue<uint8_t> fifoContent;
+  uint8_t             mockRegs[FUSB_FIFOS + 1];
+  std::queue<uint8_t> rxFifo;
+  std::queue<uint8_t> txFifo;
+  uint32_t            busClock   = 400000;
+  uint32_t            stretchMax = 0;
+  uint32_t            stretchLCG = 1;
 };
\ No newline at end of file
@@ -0,0 +1,678 @@
+#pragma once
+#include "CppUTest/TestHarness.h"
+#include "fusb302_defines.h"
+#include "mock_fusb302.h"
+#include "policy_engine_impl.h"
+#include "user_functions.hpp"
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Discrete event simulation of the sink against an emulated USB-PD source, in virtual time.
+ *
+ * The engine is run until it goes idle, then the clock jumps straight to the next thing that
+ * can happen: a message from the source, the PHY finishing a send, the periodic TimersCallback
+ * or the engine's own timeout. Hours of operation take a fraction of a second, and every run
+ * is the same, so the timing the source sees can be checked exactly.
+ */
+class PDSimulator;
+
+struct SimBus {
+  PDSimulator *sim;
+  bool         read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) const;
+  bool         write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) const;
+  void         delay(uint32_t milliseconds) const;
+};
+struct SimPlatform {
+  PDSimulator *sim;
+  TICK_TYPE    getTimeStamp() const;
+  void         delay(TICK_TYPE milliseconds) const;
+};
+struct SimDpm {
+  static bool evaluateCapability(const pd_msg *capabilities, pd_msg *request) { return pdbs_dpm_evaluate_capability(capabilities, request); }
+  static bool evaluateEPRCapability(const epr_pd_msg *capabilities, pd_msg *request) {
+    if (!ppsInEPR()) {
+      return EPREvaluateCapabilityFunc(capabilities, request);
+    }
+    // The simulated source's PPS APDO (position 2) at 11V, so EPR mode and PPS both need keeping alive
+    request->hdr    = PD_MSGTYPE_EPR_REQUEST | PD_NUMOBJ(2);
+    request->obj[0] = PD_RDO_PROG_VOLTAGE_SET(PD_MV2PRV(11000)) | PD_RDO_PROG_CURRENT_SET(PD_MA2PAI(3000)) | PD_RDO_NO_USB_SUSPEND | PD_RDO_EPR_CAPABLE | PD_RDO_OBJPOS_SET(2);
+    request->obj[1] = capabilities->obj[1];
+    return true;
+  }
+  static void getSinkCapability(pd_msg *cap, const bool isPD3) { pdbs_dpm_get_sink_capability(cap, isPD3); }
+  // Pick PPS rather than the fixed 5V from the EPR capabilities, see PDSimulator::requestPPSInEPR()
+  static bool &ppsInEPR() {
+    static bool enabled = false;
+    return enabled;
+  }
+};
+typedef PolicyEngineT<SimPlatform, SimDpm, FUSB302T<SimBus>> SimPolicyEngine;
+
+class PDSimulator {
+public:
+  // Source side timing, in milliseconds
+  struct Timing {
+    TICK_TYPE goodCRC      = 1;   // PHY reports our message as sent
+    TICK_TYPE response     = 2;   // Source answers a message
+    TICK_TYPE transition   = 35;  // Accept to PS_RDY
+    TICK_TYPE firstCaps    = 150; // VBUS on to the first Source_Capabilities
+    TICK_TYPE timersPeriod = 100; // How often the application runs TimersCallback()
+    TICK_TYPE eprKeepAlive = 750; // tSourceEPRKeepAlive, hearing nothing from the sink in EPR mode this long the source hard resets
+    TICK_TYPE engineDelay  = 0;   // How long after being woken the application gets round to running thread(), interrupts are still taken at once
+  };
+  // What the source saw, and what it cost the sink to get there
+  struct Stats {
+    uint32_t  engineRuns      = 0; // thread() calls
+    uint32_t  engineWakes     = 0; // Times the engine's wake callback asked for thread() to be run
+    uint32_t  busTransactions = 0; // I2C reads and writes
+    uint32_t  wakeups         = 0; // Times the FUSB302 pulled INT_N, each one an interrupt for the application
+    uint64_t  busNanoseconds  = 0; // Modelled time those took, see setBusClock()
+    uint32_t  busyLimitHits   = 0; // Times the engine was still busy after busyLimit runs at one instant
+    uint32_t  sinkMessages    = 0;
+    uint32_t  requests        = 0; // Request and EPR_Request
+    uint32_t  eprKeepAlives   = 0;
+    uint32_t  hardResets      = 0; // Signalled by the sink
+    uint32_t  softResets      = 0; // Soft_Reset messages from the sink
+    uint32_t  sourceResets    = 0; // Hard resets the source had to do itself
+    uint32_t  restarts        = 0; // Times the engine went back through its startup state
+    TICK_TYPE maxRequestGap   = 0; // Longest time between requests while on a PPS contract
+    TICK_TYPE maxEPRGap       = 0; // Longest time without a message from the sink while in EPR mode
+    TICK_TYPE maxCapsLatency  = 0; // Longest time from Source_Capabilities to the Request for them
+    double    wallSeconds     = 0; // Real time spent in runFor()
+  };
+  // A state the engine moved to, and when
+  struct Step {
+    TICK_TYPE at;
+    int       state;
+  };
+  // Faults that can be injected, each one hits the next thing it applies to
+  enum class Fault : uint8_t {
+    BusNack,        // The next I2C transfer fails outright
+    ShortRead,      // The next multi-byte read fails half way through
+    StuckFIFO,      // RX_EMPTY reads clear until the RX FIFO is flushed
+    LostInterrupt,  // The next interrupt is never serviced, its flags stay set
+    DelayedGoodCRC, // The next send is reported 15ms late
+    DroppedMessage, // The next message from the source never arrives, so the source soft resets
+    LostGoodCRC,    // The source misses our GoodCRC for its next message and sends it again
+  };
+  // What one fault cost, from when it hit until the sink is back on a contract after a PS_RDY
+  struct Recovery {
+    Fault     fault;
+    TICK_TYPE firedAt;
+    TICK_TYPE recoveredAt; // 0 until recovered
+    uint32_t  hardResets;  // By the sink
+    uint32_t  softResets;  // By the sink
+    uint32_t  sourceResets;
+    uint32_t  restarts;
+  };
+  static const uint32_t busyLimit = 1000;
+
+  explicit PDSimulator(bool sourceEPR = false, uint8_t sinkEPRWattage = 0) : pe(FUSB302T<SimBus>(SimBus{this}), sinkEPRWattage, SimPlatform{this}), sourceEPR(sourceEPR) {
+    phy.reset();
+    // The source leaves Rp at SinkTxOk whenever it is not in an AMS of its own
+    phy.setRegister(FUSB_STATUS0, fusb_sink_tx_ok | FUSB_STATUS0_VBUSOK);
+    SimDpm::ppsInEPR() = false;
+    pe.setWakeCallback([](void *context) { static_cast<PDSimulator *>(context)->stats.engineWakes++; }, this);
+  }
+
+  SimPolicyEngine pe;
+  Timing          timing;
+
+  // Attach to the source, which sends its capabilities shortly after
+  void attach() {
+    schedule(timing.firstCaps, Event::SourceCaps);
+    nextTimers = clock + timing.timersPeriod;
+  }
+  void runFor(TICK_TYPE milliseconds) {
+    const auto      start = std::chrono::steady_clock::now();
+    const TICK_TYPE end   = clock + milliseconds;
+    // The test may have posted something to the engine since the last run
+    engineDue = clock;
+    for (;;) {
+      if (engineDue <= clock) {
+        runEngine();
+        engineDue = TICK_MAX_DELAY;
+      }
+      TICK_TYPE next = end < engineDue ? end : engineDue;
+      if (attached() && nextTimers < next) {
+        next = nextTimers;
+      }
+      for (const Event &e : events) {
+        if (e.at < next) {
+          next = e.at;
+        }
+      }
+      TICK_TYPE wait = pe.ticksUntilTimeout();
+      if (wait != TICK_MAX_DELAY && clock + wait < next) {
+        next = clock + wait;
+      }
+      if (next >= end && clock >= end) {
+        break;
+      }
+      // Nothing is due at this instant, so time has to move on
+      clock = next > clock ? next : clock + 1;
+      if (dispatch() && engineDue == TICK_MAX_DELAY) {
+        engineDue = clock + timing.engineDelay;
+      }
+    }
+    stats.wallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // Source behaviour that can be changed during a run
+  void sourceSoftReset() { schedule(0, Event::SourceSoftReset); }
+  void sourceHardReset() { schedule(0, Event::SourceHardReset); }
+  void dropNextPSRDY() { dropPSRDY++; }
+  void dropNextKeepAliveAck() { dropKeepAliveAck++; }
+  // Once in EPR mode the sink asks for the PPS supply, for as long as this simulator lives
+  void requestPPSInEPR() { SimDpm::ppsInEPR() = true; }
+  void inject(Fault fault) { armed.push_back(fault); }
+  // I2C clock used for Stats::busNanoseconds, 400kHz unless set
+  void setBusClock(uint32_t hz, uint32_t stretchMaxNs = 0) { phy.setBusClock(hz, stretchMaxNs); }
+  // Every interrupt source stays unmasked whatever the engine writes, to measure what gating them saves
+  void leaveInterruptsUnmasked() {
+    ungated = true;
+    unmaskAll();
+  }
+
+  TICK_TYPE                    now() const { return clock; }
+  const Stats                 &getStats() const { return stats; }
+  const std::vector<Step>     &trace() const { return steps; }
+  // Every fault that has hit so far
+  const std::vector<Recovery> &recoveries() const { return faults; }
+  bool                         sourceInEPR() const { return inEPR; }
+  // The first time the engine entered a state at or after the given time, 0 if it did not
+  TICK_TYPE timeOfState(int state, TICK_TYPE from = 0) const {
+    for (const Step &s : steps) {
+      if (s.state == state && s.at >= from) {
+        return s.at;
+      }
+    }
+    return 0;
+  }
+
+  // Bus and platform hooks
+  bool busRead(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) {
+    stats.busTransactions++;
+    if (fire(Fault::BusNack)) {
+      phy.addBusTime(true, 0);
+      stats.busNanoseconds = phy.busNanoseconds;
+      return false;
+    }
+    if (size > 1 && fire(Fault::ShortRead)) {
+      phy.i2cRead(FUSB302B_ADDR, registerAdd, size / 2, buf);
+      stats.busNanoseconds = phy.busNanoseconds;
+      return false;
+    }
+    bool result          = phy.i2cRead(FUSB302B_ADDR, registerAdd, size, buf);
+    stats.busNanoseconds = phy.busNanoseconds;
+    if (registerAdd <= FUSB_STATUS1 && registerAdd + size > FUSB_STATUS1 && (stuckFIFO || fire(Fault::StuckFIFO))) {
+      stuckFIFO = true;
+      buf[FUSB_STATUS1 - registerAdd] &= ~FUSB_STATUS1_RX_EMPTY;
+    }
+    return result;
+  }
+  bool busWrite(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) {
+    stats.busTransactions++;
+    if (fire(Fault::BusNack)) {
+      phy.addBusTime(false, 0);
+      stats.busNanoseconds = phy.busNanoseconds;
+      return false;
+    }
+    if (registerAdd <= FUSB_CONTROL1 && registerAdd + size > FUSB_CONTROL1 && (buf[FUSB_CONTROL1 - registerAdd] & FUSB_CONTROL1_RX_FLUSH)) {
+      stuckFIFO = false;
+    }
+    if (registerAdd == FUSB_FIFOS) {
+      phy.addBusTime(false, size);
+      stats.busNanoseconds = phy.busNanoseconds;
+      // Gather the TX tokens, the frame goes out on TXON
+      for (uint8_t i = 0; i < size; i++) {
+        txFrame.push_back(buf[i]);
+      }
+      if (size && buf[size - 1] == FUSB_FIFO_TX_TXON) {
+        sinkTransmitted();
+        txFrame.clear();
+      }
+      return true;
+    }
+    if (registerAdd == FUSB_CONTROL3 && size == 1 && (buf[0] & FUSB_CONTROL3_SEND_HARD_RESET)) {
+      stats.hardResets++;
+      schedule(timing.goodCRC, Event::HardResetSent);
+      buf[0] &= ~FUSB_CONTROL3_SEND_HARD_RESET;
+    }
+    bool result          = phy.i2cWrite(FUSB302B_ADDR, registerAdd, size, buf);
+    stats.busNanoseconds = phy.busNanoseconds;
+    if (ungated) {
+      unmaskAll();
+    }
+    return result;
+  }
+  TICK_TYPE timeStamp() const { return clock; }
+
+private:
+  struct Event {
+    enum Kind : uint8_t { Deliver, TxSent, SourceCaps, SourceSoftReset, SoftResetTimeout, SourceHardReset, EPRTimeout, HardResetSent, VBusOff, VBusOn } kind;
+    TICK_TYPE at;
+    uint32_t  order;
+    bool      caps; // Source_Capabilities, the sink has to answer these quickly
+    uint8_t   length;
+    uint8_t   frame[3 + 28 + 4];
+  };
+
+  MockFUSB302           phy;
+  TICK_TYPE             clock = 0;
+  Stats                 stats;
+  std::vector<Event>    events;
+  std::vector<Step>     steps;
+  std::vector<uint8_t>  txFrame;
+  std::vector<Fault>    armed;
+  std::vector<Recovery> faults;
+  bool                  stuckFIFO       = false;
+  bool                  psRdySinceFault = false;
+  uint32_t              eventOrder      = 0;
+  TICK_TYPE             nextTimers      = TICK_MAX_DELAY;
+  TICK_TYPE             engineDue       = TICK_MAX_DELAY; // When thread() is next run, TICK_MAX_DELAY until something wakes it
+  int                   lastState       = -1;
+  // Source state
+  const bool sourceEPR;
+  bool       inEPR            = false;
+  bool       ppsContract      = false;
+  uint8_t    messageID        = 0;
+  uint8_t    dropPSRDY        = 0;
+  uint8_t    dropKeepAliveAck = 0;
+  TICK_TYPE  lastRequest      = 0;
+  TICK_TYPE  lastCapsSent     = 0;
+  TICK_TYPE  lastSinkInEPR    = 0;
+  bool       capsOutstanding  = false;
+  bool       awaitingAccept   = false; // For the source's own Soft_Reset
+  bool       ungated          = false;
+
+  bool attached() const { return nextTimers != TICK_MAX_DELAY; }
+
+  void runEngine() {
+    uint32_t runs = 0;
+    for (;;) {
+      bool more = pe.thread();
+      stats.engineRuns++;
+      int state = pe.currentStateCode(true);
+      if (state != lastState) {
+        steps.push_back(Step{clock, state});
+        lastState = state;
+        if (state == 3) {
+          stats.restarts++;
+        }
+      }
+      if (!more) {
+        if (psRdySinceFault && pe.hasExplicitContract()) {
+          psRdySinceFault = false;
+          recovered();
+        }
+        return;
+      }
+      if (++runs >= busyLimit) {
+        stats.busyLimitHits++;
+        return;
+      }
+    }
+  }
+
+  Event &schedule(TICK_TYPE delay, Event::Kind kind) {
+    Event e;
+    e.kind   = kind;
+    e.at     = clock + delay;
+    e.order  = eventOrder++;
+    e.length = 0;
+    e.caps   = false;
+    events.push_back(e);
+    return events.back();
+  }
+
+  // Run every event due now, oldest first. True if the engine has to run, which it also does for its own timeout
+  bool dispatch() {
+    bool wake = pe.ticksUntilTimeout() == 0;
+    if (attached() && nextTimers <= clock) {
+      pe.TimersCallback();
+      nextTimers = clock + timing.timersPeriod;
+      wake       = true;
+    }
+    for (;;) {
+      size_t due = events.size();
+      for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].at <= clock && (due == events.size() || events[i].order < events[due].order)) {
+          due = i;
+        }
+      }
+      if (due == events.size()) {
+        return wake;
+      }
+      Event e = events[due];
+      events.erase(events.begin() + due);
+      handle(e);
+      wake = true;
+    }
+  }
+
+  // Uses up an armed fault of this kind, if there is one
+  bool fire(Fault fault) {
+    auto it = std::find(armed.begin(), armed.end(), fault);
+    if (it == armed.end()) {
+      return false;
+    }
+    armed.erase(it);
+    psRdySinceFault = false;
+    faults.push_back(Recovery{fault, clock, 0, stats.hardResets, stats.softResets, stats.sourceResets, stats.restarts});
+    return true;
+  }
+  // Ends every fault still being recovered from
+  void recovered() {
+    for (Recovery &r : faults) {
+      if (r.recoveredAt == 0) {
+        r.recoveredAt  = clock;
+        r.hardResets   = stats.hardResets - r.hardResets;
+        r.softResets   = stats.softResets - r.softResets;
+        r.sourceResets = stats.sourceResets - r.sourceResets;
+        r.restarts     = stats.restarts - r.restarts;
+      }
+    }
+  }
+
+  void unmaskAll() {
+    phy.setRegister(FUSB_MASK1, 0);
+    phy.setRegister(FUSB_MASKA, 0);
+    phy.setRegister(FUSB_MASKB, 0);
+  }
+  // The PHY flags activity on CC for every frame either way, which only wakes the application if it is unmasked
+  void ccActivity() {
+    const bool asserted = phy.interruptAsserted();
+    phy.setRegister(FUSB_INTERRUPT, phy.getRegister(FUSB_INTERRUPT) | FUSB_INTERRUPT_I_ACTIVITY);
+    if (!asserted && phy.interruptAsserted()) {
+      stats.wakeups++;
+      pe.IRQOccured();
+    }
+  }
+
+  // The flags clear as they are read, INT_N stays low until every unmasked one has been
+  void raise(uint8_t reg, uint8_t flags) {
+    const bool asserted = phy.interruptAsserted();
+    phy.setRegister(reg, phy.getRegister(reg) | flags);
+    if (!asserted && phy.interruptAsserted()) {
+      stats.wakeups++;
+    }
+    if (fire(Fault::LostInterrupt)) {
+      return;
+    }
+    pe.IRQOccured();
+    for (uint8_t i = 0; i < 4 && phy.interruptAsserted(); i++) {
+      pe.IRQOccured();
+    }
+  }
+
+  void handle(const Event &e) {
+    switch (e.kind) {
+    case Event::Deliver:
+      if (fire(Fault::DroppedMessage)) {
+        // Its retries went unanswered too
+        sourceSoftReset();
+        break;
+      }
+      if (e.caps) {
+        lastCapsSent    = clock;
+        capsOutstanding = true;
+      }
+      ccActivity();
+      phy.addToFIFO(e.length, e.frame);
+      raise(FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+      if (fire(Fault::LostGoodCRC)) {
+        // The retry is the same frame, MessageID and all
+        Event &again = schedule(1, Event::Deliver);
+        again.caps   = e.caps;
+        again.length = e.length;
+        memcpy(again.frame, e.frame, sizeof(again.frame));
+      }
+      if (!(e.frame[2] & (PD_HDR_EXT >> 8)) && e.length == 7 && (e.frame[1] & PD_HDR_MSGTYPE) == PD_MSGTYPE_PS_RDY) {
+        psRdySinceFault = true;
+      }
+      break;
+    case Event::TxSent:
+      // Our frame and the GoodCRC for it
+      ccActivity();
+      raise(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_TXSENT);
+      break;
+    case Event::SourceCaps:
+      sendCapabilities(0);
+      break;
+    case Event::SourceSoftReset:
+      messageID      = 0;
+      awaitingAccept = true;
+      sendControl(0, PD_MSGTYPE_SOFT_RESET);
+      // tSenderResponse on the source side
+      schedule(timing.goodCRC + 27, Event::SoftResetTimeout);
+      break;
+    case Event::SoftResetTimeout:
+      if (awaitingAccept) {
+        stats.sourceResets++;
+        signalHardReset();
+      }
+      break;
+    case Event::SourceHardReset:
+      stats.sourceResets++;
+      signalHardReset();
+      break;
+    case Event::EPRTimeout:
+      if (inEPR && clock - lastSinkInEPR >= timing.eprKeepAlive) {
+        stats.sourceResets++;
+        signalHardReset();
+      }
+      break;
+    case Event::HardResetSent:
+      raise(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_HARDSENT);
+      hardReset();
+      break;
+    case Event::VBusOff:
+      phy.setRegister(FUSB_STATUS0, phy.getRegister(FUSB_STATUS0) & ~FUSB_STATUS0_VBUSOK);
+      raise(FUSB_INTERRUPT, FUSB_INTERRUPT_I_VBUSOK);
+      schedule(PD_T_SRC_RECOVER_MAX / 2, Event::VBusOn);
+      break;
+    case Event::VBusOn:
+      phy.setRegister(FUSB_STATUS0, phy.getRegister(FUSB_STATUS0) | FUSB_STATUS0_VBUSOK);
+      raise(FUSB_INTERRUPT, FUSB_INTERRUPT_I_VBUSOK);
+      schedule(timing.firstCaps, Event::SourceCaps);
+      break;
+    }
+  }
+
+  // The source drops VBUS and starts over
+  void hardReset() {
+    inEPR          = false;
+    ppsContract    = false;
+    awaitingAccept = false;
+    messageID      = 0;
+    events.erase(std::remove_if(events.begin(), events.end(), [](const Event &other) { return other.kind == Event::Deliver; }), events.end());
+    schedule(PD_T_SAFE_0V / 2, Event::VBusOff);
+  }
+
+  // The source signals a Hard Reset itself, which the sink's PHY reports with I_HARDRST
+  void signalHardReset() {
+    hardReset();
+    raise(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_HARDRST);
+  }
+
+  // Queue a message from the source, payload is the data objects or extended header and data
+  void sendMessage(TICK_TYPE delay, uint16_t hdr, const uint8_t *payload, uint8_t payloadLength) {
+    uint8_t numobj = (payloadLength + 3) / 4;
+    hdr |= PD_SPECREV_3_0 | PD_DATAROLE_DFP | PD_POWERROLE_SOURCE | PD_NUMOBJ(numobj) | ((messageID & 7) << PD_HDR_MESSAGEID_SHIFT);
+    messageID++;
+    Event &e   = schedule(delay, Event::Deliver);
+    e.frame[0] = FUSB_FIFO_RX_SOP;
+    e.frame[1] = hdr & 0xFF;
+    e.frame[2] = hdr >> 8;
+    memset(&e.frame[3], 0, sizeof(e.frame) - 3);
+    memcpy(&e.frame[3], payload, payloadLength);
+    // Objects and then the CRC, which the PHY has already checked
+    e.length = 3 + (4 * numobj) + 4;
+    e.caps   = !(hdr & PD_HDR_EXT) && numobj > 0 && (hdr & PD_HDR_MSGTYPE) == PD_MSGTYPE_SOURCE_CAPABILITIES;
+  }
+  void sendControl(TICK_TYPE delay, uint8_t type) { sendMessage(delay, type, nullptr, 0); }
+  void sendObjects(TICK_TYPE delay, uint8_t type, const uint32_t *objects, uint8_t count) { sendMessage(delay, type, (const uint8_t *)objects, 4 * count); }
+  void sendExtended(TICK_TYPE delay, uint8_t type, uint16_t exthdr, const uint8_t *data, uint8_t length) {
+    uint8_t payload[2 + PD_MAX_EXT_MSG_CHUNK_LEN];
+    payload[0] = exthdr & 0xFF;
+    payload[1] = exthdr >> 8;
+    memcpy(&payload[2], data, length);
+    sendMessage(delay, PD_HDR_EXT | type, payload, 2 + length);
+  }
+
+  // 5V @ 3A and PPS 3.3-11V @ 5A, then 28V @ 5A in EPR mode
+  static const uint8_t sprPDOCount = 2;
+  uint32_t             pdo(uint8_t index) const {
+    switch (index) {
+    case 0:
+      return 0x0801912C | (sourceEPR ? PD_PDO_SRC_FIXED_EPR_CAPABLE : 0);
+    case 1:
+      return 0xC8DC2164;
+    case 7:
+      return PD_PDO_TYPE_FIXED | (PD_MV2PDV(28000) << PD_PDO_SRC_FIXED_VOLTAGE_SHIFT) | (PD_MA2PDI(5000) << PD_PDO_SRC_FIXED_CURRENT_SHIFT);
+    default:
+      return 0;
+    }
+  }
+  void sendCapabilities(TICK_TYPE delay) {
+    uint32_t objects[sprPDOCount];
+    for (uint8_t i = 0; i < sprPDOCount; i++) {
+      objects[i] = pdo(i);
+    }
+    sendObjects(delay, PD_MSGTYPE_SOURCE_CAPABILITIES, objects, sprPDOCount);
+  }
+  // EPR capabilities are the 7 SPR positions then the EPR PDOs, sent in 26 byte chunks
+  void sendEPRCapabilitiesChunk(TICK_TYPE delay, uint8_t chunk) {
+    uint8_t data[4 * 8];
+    for (uint8_t i = 0; i < 8; i++) {
+      uint32_t object = pdo(i);
+      memcpy(&data[4 * i], &object, 4);
+    }
+    uint8_t offset = chunk * PD_MAX_EXT_MSG_CHUNK_LEN;
+    uint8_t length = sizeof(data) - offset < PD_MAX_EXT_MSG_CHUNK_LEN ? sizeof(data) - offset : PD_MAX_EXT_MSG_CHUNK_LEN;
+    sendExtended(delay, PD_MSGTYPE_EPR_SOURCE_CAPABILITIES, PD_EXTHDR_CHUNKED | PD_CHUNK_NUMBER(chunk) | PD_DATA_SIZE(sizeof(data)), &data[offset], length);
+  }
+
+  // A complete frame from the sink went out, the source acknowledges it and answers
+  void sinkTransmitted() {
+    schedule(fire(Fault::DelayedGoodCRC) ? timing.goodCRC + 15 : timing.goodCRC, Event::TxSent);
+    if (txFrame.size() < 7) {
+      return;
+    }
+    pd_msg msg;
+    memset(&msg, 0, sizeof(msg));
+    uint8_t length = txFrame[4] & ~FUSB_FIFO_TX_PACKSYM;
+    for (uint8_t i = 0; i < length && (5u + i) < txFrame.size() && i < sizeof(msg.bytes); i++) {
+      msg.bytes[i] = txFrame[5 + i];
+    }
+    stats.sinkMessages++;
+    if (inEPR && clock > lastSinkInEPR) {
+      TICK_TYPE gap = clock - lastSinkInEPR;
+      stats.maxEPRGap = gap > stats.maxEPRGap ? gap : stats.maxEPRGap;
+      lastSinkInEPR   = clock;
+      schedule(timing.eprKeepAlive, Event::EPRTimeout);
+    }
+    const TICK_TYPE reply = timing.goodCRC + timing.response;
+    const uint8_t   type  = PD_MSGTYPE_GET(&msg);
+    if (msg.hdr & PD_HDR_EXT) {
+      if (type == PD_MSGTYPE_EPR_SOURCE_CAPABILITIES && (msg.exthdr & PD_EXTHDR_REQUEST_CHUNK)) {
+        sendEPRCapabilitiesChunk(reply, PD_CHUNK_NUMBER_GET(&msg));
+      } else if (type == PD_MSGTYPE_EXTENDED_CONTROL && msg.data[0] == PD_EXTENDED_CONTROL_TYPE_EPR_KEEPALIVE) {
+        stats.eprKeepAlives++;
+        const uint8_t ack[2] = {PD_EXTENDED_CONTROL_TYPE_EPR_KEEPALIVE_ACK, 0};
+        if (dropKeepAliveAck) {
+          dropKeepAliveAck--;
+        } else {
+          sendExtended(reply, PD_MSGTYPE_EXTENDED_CONTROL, PD_EXTHDR_CHUNKED | PD_DATA_SIZE(2), ack, 2);
+        }
+      } else {
+        sendControl(reply, PD_MSGTYPE_NOT_SUPPORTED);
+      }
+    } else if (PD_NUMOBJ_GET(&msg) == 0) {
+      switch (type) {
+      case PD_MSGTYPE_GET_SOURCE_CAP:
+        sendCapabilities(reply);
+        break;
+      case PD_MSGTYPE_SOFT_RESET:
+        stats.softResets++;
+        messageID = 0;
+        sendControl(reply, PD_MSGTYPE_ACCEPT);
+        sendCapabilities(reply + timing.response);
+        break;
+      case PD_MSGTYPE_ACCEPT:
+        // The sink took our Soft_Reset, so start over with the capabilities
+        if (awaitingAccept) {
+          awaitingAccept = false;
+          sendCapabilities(reply);
+        }
+        break;
+      case PD_MSGTYPE_REJECT:
+      case PD_MSGTYPE_NOT_SUPPORTED:
+        break;
+      default:
+        sendControl(reply, PD_MSGTYPE_NOT_SUPPORTED);
+        break;
+      }
+    } else {
+      switch (type) {
+      case PD_MSGTYPE_REQUEST:
+      case PD_MSGTYPE_EPR_REQUEST: {
+        stats.requests++;
+        if (ppsContract) {
+          TICK_TYPE gap       = clock - lastRequest;
+          stats.maxRequestGap = gap > stats.maxRequestGap ? gap : stats.maxRequestGap;
+        }
+        if (capsOutstanding) {
+          TICK_TYPE latency    = clock - lastCapsSent;
+          stats.maxCapsLatency = latency > stats.maxCapsLatency ? latency : stats.maxCapsLatency;
+          capsOutstanding      = false;
+        }
+        lastRequest      = clock;
+        uint8_t position = (msg.obj[0] >> 28) & 0xF;
+        ppsContract      = (pdo(position - 1) & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED;
+        sendControl(reply, PD_MSGTYPE_ACCEPT);
+        if (dropPSRDY) {
+          dropPSRDY--;
+        } else {
+          sendControl(reply + timing.transition, PD_MSGTYPE_PS_RDY);
+        }
+        break;
+      }
+      case PD_MSGTYPE_EPR_MODE: {
+        uint8_t action = (msg.obj[0] & PD_EPR_MODE_ACTION) >> PD_EPR_MODE_ACTION_SHIFT;
+        if (action == 1 && sourceEPR) {
+          // Enter Acknowledged, Enter Succeeded, then the EPR capabilities
+          uint32_t mode = 2 << PD_EPR_MODE_ACTION_SHIFT;
+          sendObjects(reply, PD_MSGTYPE_EPR_MODE, &mode, 1);
+          mode = 3 << PD_EPR_MODE_ACTION_SHIFT;
+          sendObjects(reply + timing.transition, PD_MSGTYPE_EPR_MODE, &mode, 1);
+          sendEPRCapabilitiesChunk(reply + timing.transition + timing.response, 0);
+          inEPR         = true;
+          lastSinkInEPR = clock + reply + timing.transition;
+          schedule(reply + timing.transition + timing.eprKeepAlive, Event::EPRTimeout);
+        } else if (action == 1) {
+          uint32_t mode = 4 << PD_EPR_MODE_ACTION_SHIFT;
+          sendObjects(reply, PD_MSGTYPE_EPR_MODE, &mode, 1);
+        } else if (action == 5) {
+          inEPR = false;
+          sendCapabilities(reply);
+        }
+        break;
+      }
+      default:
+        sendControl(reply, PD_MSGTYPE_NOT_SUPPORTED);
+        break;
+      }
+    }
+  }
+};
+
+inline bool      SimBus::read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) const { return sim->busRead(registerAdd, size, buf); }
+inline bool      SimBus::write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) const { return sim->busWrite(registerAdd, size, buf); }
+inline void      SimBus::delay(uint32_t milliseconds) const {}
+inline TICK_TYPE SimPlatform::getTimeStamp() const { return sim->timeStamp(); }
+inline void      SimPlatform::delay(TICK_TYPE milliseconds) const { FAIL("The policy engine should never block"); }
@@ -0,0 +1,192 @@
+#include "CppUTest/TestHarness.h"
+#include "command_mailbox.h"
+#include "fusb302_defines.h"
+#include "mock_fusb302.h"
+#include "policy_engine_impl.h"
+#include "user_functions.hpp"
+#include <stdint.h>
+TEST_GROUP(MAILBOX){};
+
+TEST(MAILBOX, PostedOnceUntilFinished) {
+  CommandMailbox mailbox;
+  CHECK_TRUE(pd_command_status::Idle == mailbox.status(pd_command::Renegotiate));
+  CHECK_TRUE(mailbox.post(pd_command::Renegotiate));
+  CHECK_TRUE(pd_command_status::Pending == mailbox.status(pd_command::Renegotiate));
+  CHECK_FALSE(mailbox.post(pd_command::Renegotiate));
+
+  pd_command command;
+  uint16_t   arg0, arg1;
+  CHECK_TRUE(mailbox.take(&command, &arg0, &arg1));
+  CHECK_TRUE(pd_command_status::Busy == mailbox.status(pd_command::Renegotiate));
+  CHECK_FALSE(mailbox.post(pd_command::Renegotiate));
+  CHECK_FALSE(mailbox.take(&command, &arg0, &arg1));
+
+  mailbox.finish(command, pd_command_status::Done);
+  CHECK_TRUE(pd_command_status::Done == mailbox.status(pd_command::Renegotiate));
+  CHECK_TRUE(mailbox.post(pd_command::Renegotiate));
+}
+
+TEST(MAILBOX, TakenInOrderWithArguments) {
+  CommandMailbox mailbox;
+  CHECK_TRUE(mailbox.post(pd_command::GetStatus));
+  CHECK_TRUE(mailbox.post(pd_command::SetPPS, 9000, 2000));
+  pd_command command;
+  uint16_t   arg0, arg1;
+  CHECK_TRUE(mailbox.take(&command, &arg0, &arg1));
+  CHECK_TRUE(pd_command::SetPPS == command);
+  CHECK_EQUAL(9000, arg0);
+  CHECK_EQUAL(2000, arg1);
+  CHECK_TRUE(mailbox.take(&command, &arg0, &arg1));
+  CHECK_TRUE(pd_command::GetStatus == command);
+}
+
+namespace {
+MockFUSB302 cmd_mock;
+TICK_TYPE   cmd_time = 0;
+
+struct CommandBus {
+  static bool read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return cmd_mock.i2cRead(FUSB302B_ADDR, registerAdd, size, buf); }
+  static bool write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return cmd_mock.i2cWrite(FUSB302B_ADDR, registerAdd, size, buf); }
+  static void delay(uint32_t milliseconds) {}
+};
+struct CommandPlatform {
+  static TICK_TYPE getTimeStamp() { return cmd_time; }
+  static void      delay(TICK_TYPE milliseconds) { FAIL("The policy engine should never block"); }
+};
+struct CommandDpm {
+  static bool evaluateCapability(const pd_msg *capabilities, pd_msg *request) { return pdbs_dpm_evaluate_capability(capabilities, request); }
+  static bool evaluateEPRCapability(const epr_pd_msg *capabilities, pd_msg *request) { return false; }
+  static void getSinkCapability(pd_msg *cap, const bool isPD3) { pdbs_dpm_get_sink_capability(cap, isPD3); }
+};
+typedef PolicyEngineT<CommandPlatform, CommandDpm, FUSB302T<CommandBus>> CommandPolicyEngine;
+
+const uint8_t accept[] = {FUSB_FIFO_RX_SOP, 0xA3, 0x03, 0, 0, 0, 0};
+const uint8_t ready[]  = {FUSB_FIFO_RX_SOP, 0xA6, 0x05, 0, 0, 0, 0};
+
+void runUntilIdle(CommandPolicyEngine &pe) {
+  while (pe.thread()) {
+  }
+}
+void receive(CommandPolicyEngine &pe, const uint8_t *message, uint8_t length) {
+  cmd_mock.addToFIFO(length, message);
+  cmd_mock.setRegister(FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  pe.IRQOccured();
+  cmd_mock.setRegister(FUSB_INTERRUPTB, 0);
+  runUntilIdle(pe);
+}
+// The PHY reports our message as sent
+void sent(CommandPolicyEngine &pe) {
+  cmd_mock.resetFiFo();
+  cmd_mock.setRegister(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_TXSENT);
+  pe.IRQOccured();
+  cmd_mock.setRegister(FUSB_INTERRUPTA, 0);
+  runUntilIdle(pe);
+}
+// Negotiate with a PD 3.0 source offering 5V and PPS 3.3-11V @ 5A, or only the 5V
+void negotiate(CommandPolicyEngine &pe, bool pps = true) {
+  const uint8_t caps[]      = {FUSB_FIFO_RX_SOP, 0xA1, 0x21, 0x2c, 0x91, 0x01, 0x08, 0x64, 0x21, 0xDC, 0xC8, 0, 0, 0, 0};
+  const uint8_t fixedCaps[] = {FUSB_FIFO_RX_SOP, 0xA1, 0x11, 0x2c, 0x91, 0x01, 0x08, 0, 0, 0, 0};
+  cmd_mock.reset();
+  cmd_time = 0;
+  runUntilIdle(pe);
+  if (pps) {
+    receive(pe, caps, sizeof(caps));
+  } else {
+    receive(pe, fixedCaps, sizeof(fixedCaps));
+  }
+  sent(pe);
+  receive(pe, accept, sizeof(accept));
+  receive(pe, ready, sizeof(ready));
+  // Let our own AMS start straight away
+  cmd_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ok);
+}
+} // namespace
+
+#ifndef PD_DISABLE_PPS
+TEST(MAILBOX, SetPPS) {
+  CommandPolicyEngine pe(FUSB302T<CommandBus>(), 0);
+  negotiate(pe);
+  CHECK_TRUE(pe.pdHasNegotiated());
+
+  CHECK_TRUE(pe.postCommand(pd_command::SetPPS, 9000, 2000));
+  runUntilIdle(pe);
+  CHECK_TRUE(pd_command_status::Busy == pe.commandStatus(pd_command::SetPPS));
+  uint8_t request[5 + 6];
+  CHECK_TRUE(cmd_mock.readFiFo(sizeof(request), request));
+  CHECK_EQUAL(PD_MSGTYPE_REQUEST, request[5] & PD_HDR_MSGTYPE);
+  uint32_t rdo = request[7] | (request[8] << 8) | (request[9] << 16) | ((uint32_t)request[10] << 24);
+  CHECK_EQUAL(2, (rdo & PD_RDO_OBJPOS) >> PD_RDO_OBJPOS_SHIFT);
+  CHECK_EQUAL(PD_MV2PRV(9000), (rdo & PD_RDO_PROG_VOLTAGE) >> PD_RDO_PROG_VOLTAGE_SHIFT);
+  CHECK_EQUAL(PD_MA2PAI(2000), (rdo & PD_RDO_PROG_CURRENT) >> PD_RDO_PROG_CURRENT_SHIFT);
+
+  sent(pe);
+  receive(pe, accept, sizeof(accept));
+  receive(pe, ready, sizeof(ready));
+  CHECK_TRUE(pd_command_status::Done == pe.commandStatus(pd_command::SetPPS));
+
+  // Out of the APDO's range, so nothing is sent
+  cmd_mock.resetFiFo();
+  CHECK_TRUE(pe.postCommand(pd_command::SetPPS, 15000, 2000));
+  runUntilIdle(pe);
+  CHECK_TRUE(pd_command_status::NotSupported == pe.commandStatus(pd_command::SetPPS));
+  CHECK_TRUE(cmd_mock.fifoEmpty());
+}
+#endif
+
+TEST(MAILBOX, GetStatus) {
+  CommandPolicyEngine pe(FUSB302T<CommandBus>(), 0);
+  // No PPS contract, so no re-request falls due while the source is not answering
+  negotiate(pe, false);
+  CHECK_TRUE(pe.postCommand(pd_command::GetStatus));
+  runUntilIdle(pe);
+  uint8_t request[5 + 2];
+  CHECK_TRUE(cmd_mock.readFiFo(sizeof(request), request));
+  CHECK_EQUAL(PD_MSGTYPE_GET_STATUS, request[5] & PD_HDR_MSGTYPE);
+  sent(pe);
+  CHECK_TRUE(pd_command_status::Busy == pe.commandStatus(pd_command::GetStatus));
+
+  // Extended Status message, 7 bytes of data in one chunk
+  const uint8_t status[] = {FUSB_FIFO_RX_SOP, 0x82, 0xB1, 0x07, 0x80, 1, 2, 3, 4, 5, 6, 7, 0, 0, 0, 0, 0, 0, 0};
+  receive(pe, status, sizeof(status));
+  CHECK_TRUE(pd_command_status::Done == pe.commandStatus(pd_command::GetStatus));
+  CHECK_EQUAL(1, pe.sourceStatus()[0]);
+  CHECK_EQUAL(7, pe.sourceStatus()[6]);
+
+  // A source that never answers fails the command after tSenderResponse
+  CHECK_TRUE(pe.postCommand(pd_command::GetStatus));
+  runUntilIdle(pe);
+  sent(pe);
+  cmd_time += PD_T_SENDER_RESPONSE;
+  CHECK_FALSE(pe.thread());
+  cmd_time++;
+  runUntilIdle(pe);
+  CHECK_TRUE(pd_command_status::Failed == pe.commandStatus(pd_command::GetStatus));
+  CHECK_EQUAL(12, pe.currentStateCode(true));
+}
+
+TEST(MAILBOX, PostedWhileBusy) {
+  CommandPolicyEngine pe(FUSB302T<CommandBus>(), 0);
+  negotiate(pe);
+  // The source does not support EPR
+  CHECK_TRUE(pe.postCommand(pd_command::RequestEPR));
+  runUntilIdle(pe);
+#ifndef PD_DISABLE_EPR
+  CHECK_TRUE(pd_command_status::NotSupported == pe.commandStatus(pd_command::RequestEPR));
+#endif
+  CHECK_TRUE(pe.postCommand(pd_command::Renegotiate));
+  runUntilIdle(pe);
+  // Mid AMS, so the next command waits its turn
+  CHECK_TRUE(pe.postCommand(pd_command::GetSourceCaps));
+  CHECK_FALSE(pe.postCommand(pd_command::GetSourceCaps));
+  runUntilIdle(pe);
+  CHECK_TRUE(pd_command_status::Pending == pe.commandStatus(pd_command::GetSourceCaps));
+  sent(pe);
+  // The capabilities we asked for, then the new contract
+  const uint8_t caps[] = {FUSB_FIFO_RX_SOP, 0xA1, 0x21, 0x2c, 0x91, 0x01, 0x08, 0x64, 0x21, 0xDC, 0xC8, 0, 0, 0, 0};
+  receive(pe, caps, sizeof(caps));
+  sent(pe);
+  receive(pe, accept, sizeof(accept));
+  receive(pe, ready, sizeof(ready));
+  CHECK_TRUE(pd_command_status::Done == pe.commandStatus(pd_command::Renegotiate));
+  CHECK_TRUE(pd_command_status::Busy == pe.commandStatus(pd_command::GetSourceCaps));
+}
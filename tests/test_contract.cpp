@@ -0,0 +1,247 @@
+#include "CppUTest/TestHarness.h"
+#include "fusb302_defines.h"
+#include "mock_fusb302.h"
+#include "policy_engine_impl.h"
+#include "user_functions.hpp"
+#include <stdint.h>
+// Reporting the agreed contract to the application
+TEST_GROUP(CONTRACT){};
+namespace {
+MockFUSB302 contract_mock;
+TICK_TYPE   contract_time = 0;
+
+struct ContractBus {
+  static bool read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return contract_mock.i2cRead(FUSB302B_ADDR, registerAdd, size, buf); }
+  static bool write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return contract_mock.i2cWrite(FUSB302B_ADDR, registerAdd, size, buf); }
+  static void delay(uint32_t milliseconds) {}
+};
+struct ContractPlatform {
+  static TICK_TYPE getTimeStamp() { return contract_time; }
+  static void      delay(TICK_TYPE milliseconds) { FAIL("The policy engine should never block"); }
+};
+struct ContractDpm {
+  static bool evaluateCapability(const pd_msg *capabilities, pd_msg *request) { return pdbs_dpm_evaluate_capability(capabilities, request); }
+  static bool evaluateEPRCapability(const epr_pd_msg *capabilities, pd_msg *request) { return false; }
+  static void getSinkCapability(pd_msg *cap, const bool isPD3) { pdbs_dpm_get_sink_capability(cap, isPD3); }
+};
+typedef PolicyEngineT<ContractPlatform, ContractDpm, FUSB302T<ContractBus>> ContractPolicyEngine;
+
+struct ContractLog {
+  int               count = 0;
+  pd_contract_event events[8];
+  uint32_t          millivolts[8];
+  uint32_t          milliamps[8];
+};
+void logContract(void *context, pd_contract_event event, uint32_t millivolts, uint32_t milliamps) {
+  ContractLog *log = (ContractLog *)context;
+  if (log->count < 8) {
+    log->events[log->count]     = event;
+    log->millivolts[log->count] = millivolts;
+    log->milliamps[log->count]  = milliamps;
+  }
+  log->count++;
+}
+
+// 5V @ 3A and PPS 3.3-11V @ 5A from a PD 3.0 source
+const uint8_t caps[]   = {FUSB_FIFO_RX_SOP, 0xA1, 0x21, 0x2c, 0x91, 0x01, 0x08, 0x64, 0x21, 0xDC, 0xC8, 0, 0, 0, 0};
+const uint8_t accept[] = {FUSB_FIFO_RX_SOP, 0xA3, 0x03, 0, 0, 0, 0};
+const uint8_t ready[]  = {FUSB_FIFO_RX_SOP, 0xA6, 0x05, 0, 0, 0, 0};
+
+void runUntilIdle(ContractPolicyEngine &pe) {
+  while (pe.thread()) {
+  }
+}
+void receive(ContractPolicyEngine &pe, const uint8_t *message, uint8_t length) {
+  contract_mock.addToFIFO(length, message);
+  contract_mock.setRegister(FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  pe.IRQOccured();
+  contract_mock.setRegister(FUSB_INTERRUPTB, 0);
+  runUntilIdle(pe);
+}
+void raiseInterruptA(ContractPolicyEngine &pe, uint8_t flags) {
+  contract_mock.resetFiFo();
+  contract_mock.setRegister(FUSB_INTERRUPTA, flags);
+  pe.IRQOccured();
+  contract_mock.setRegister(FUSB_INTERRUPTA, 0);
+  runUntilIdle(pe);
+}
+// Our request goes out and the source agrees to it
+void agree(ContractPolicyEngine &pe) {
+  raiseInterruptA(pe, FUSB_INTERRUPTA_I_TXSENT);
+  receive(pe, accept, sizeof(accept));
+  receive(pe, ready, sizeof(ready));
+}
+} // namespace
+
+TEST(CONTRACT, ReportsChanges) {
+  contract_mock.reset();
+  contract_time = 0;
+  ContractPolicyEngine pe(FUSB302T<ContractBus>(), 0);
+  ContractLog          log;
+  pe.setContractCallback(logContract, &log);
+  runUntilIdle(pe);
+  receive(pe, caps, sizeof(caps));
+  CHECK_EQUAL(0, log.count);
+  agree(pe);
+  // The DPM picks the PPS supply at its maximum
+  CHECK_EQUAL(1, log.count);
+  CHECK_TRUE(pd_contract_event::Established == log.events[0]);
+  CHECK_EQUAL(11000, log.millivolts[0]);
+  CHECK_EQUAL(5000, log.milliamps[0]);
+
+#ifndef PD_DISABLE_PPS
+  contract_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ok);
+  CHECK_TRUE(pe.postCommand(pd_command::SetPPS, 9000, 2000));
+  runUntilIdle(pe);
+  agree(pe);
+  CHECK_EQUAL(2, log.count);
+  CHECK_TRUE(pd_contract_event::Changed == log.events[1]);
+  CHECK_EQUAL(9000, log.millivolts[1]);
+  CHECK_EQUAL(2000, log.milliamps[1]);
+
+  // Keeping the PPS output alive agrees to the same thing again
+  contract_time += PD_T_PPS_REREQUEST + 1;
+  pe.TimersCallback();
+  runUntilIdle(pe);
+  agree(pe);
+  CHECK_EQUAL(2, log.count);
+#endif
+
+  // A Soft_Reset from the source drops the contract until it is negotiated again
+  const int     before      = log.count;
+  const uint8_t softReset[] = {FUSB_FIFO_RX_SOP, 0x8D, 0x01, 0, 0, 0, 0};
+  receive(pe, softReset, sizeof(softReset));
+  CHECK_EQUAL(before + 1, log.count);
+  CHECK_TRUE(pd_contract_event::Lost == log.events[before]);
+  CHECK_EQUAL(0, log.millivolts[before]);
+  CHECK_FALSE(pe.hasExplicitContract());
+}
+
+TEST(CONTRACT, ReportsUnresponsiveSource) {
+  contract_mock.reset();
+  contract_time = 0;
+  ContractPolicyEngine pe(FUSB302T<ContractBus>(), 0);
+  ContractLog          log;
+  pe.setContractCallback(logContract, &log);
+  runUntilIdle(pe);
+  // Every request and hard reset goes unanswered
+  for (int i = 0; i <= PD_N_HARD_RESET_COUNT + 1; i++) {
+    receive(pe, caps, sizeof(caps));
+    raiseInterruptA(pe, FUSB_INTERRUPTA_I_RETRYFAIL);
+    // If built to signal hard resets, let those waits run out
+    contract_time += PD_T_HARD_RESET_COMPLETE + 1;
+    runUntilIdle(pe);
+    contract_time += PD_T_SAFE_0V + 1;
+    runUntilIdle(pe);
+  }
+  CHECK_EQUAL(25, pe.currentStateCode(true));
+  CHECK_EQUAL(1, log.count);
+  CHECK_TRUE(pd_contract_event::SourceUnresponsive == log.events[0]);
+  // Re-probing the source does not report it again
+  contract_time += PD_T_PD_DEBOUNCE + 1;
+  runUntilIdle(pe);
+  CHECK_EQUAL(1, log.count);
+}
+
+TEST(CONTRACT, QueryAfterPSRDY) {
+  contract_mock.reset();
+  contract_time = 0;
+  ContractPolicyEngine pe(FUSB302T<ContractBus>(), 0);
+  runUntilIdle(pe);
+  CHECK_TRUE(pd_pdo_kind::None == pe.getContract().kind);
+  contract_time = 50;
+  receive(pe, caps, sizeof(caps));
+  raiseInterruptA(pe, FUSB_INTERRUPTA_I_TXSENT);
+  receive(pe, accept, sizeof(accept));
+  // Accepted is not agreed, nothing changes until PS_RDY
+  CHECK_EQUAL(0, pe.getContract().millivolts);
+  contract_time = 80;
+  receive(pe, ready, sizeof(ready));
+  pd_contract contract = pe.getContract();
+  CHECK_TRUE(pd_pdo_kind::PPS == contract.kind);
+  CHECK_EQUAL(2, contract.position);
+  CHECK_FALSE(contract.epr);
+  CHECK_EQUAL(11000, contract.millivolts);
+  CHECK_EQUAL(5000, contract.milliamps);
+  CHECK_EQUAL(80, contract.established);
+  CHECK_EQUAL(80, contract.updated);
+
+#ifndef PD_DISABLE_PPS
+  // The PPS re-request confirms the same contract
+  contract_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ok);
+  contract_time += PD_T_PPS_REREQUEST + 1;
+  pe.TimersCallback();
+  runUntilIdle(pe);
+  agree(pe);
+  contract = pe.getContract();
+  CHECK_EQUAL(11000, contract.millivolts);
+  CHECK_EQUAL(80, contract.established);
+  CHECK_EQUAL(80 + PD_T_PPS_REREQUEST + 1, contract.updated);
+#endif
+
+  const uint8_t softReset[] = {FUSB_FIFO_RX_SOP, 0x8D, 0x01, 0, 0, 0, 0};
+  receive(pe, softReset, sizeof(softReset));
+  contract = pe.getContract();
+  CHECK_TRUE(pd_pdo_kind::None == contract.kind);
+  CHECK_EQUAL(0, contract.position);
+  CHECK_EQUAL(0, contract.millivolts);
+}
+
+TEST(CONTRACT, ExtendedMessageIsNotCapabilities) {
+  // Extended Source_Capabilities_Extended shares its type number with Source_Capabilities
+  const uint8_t capsExtended[] = {FUSB_FIFO_RX_SOP, 0x81, 0x91, 0x02, 0x80, 0, 0, 0, 0, 0, 0};
+  pd_msg        message;
+  message.hdr = capsExtended[1] | (capsExtended[2] << 8);
+  CHECK_EQUAL(PD_MSGKIND_EXTENDED(PD_MSGTYPE_SOURCE_CAPABILITIES_EXTENDED), PD_MSGKIND_GET(&message));
+  CHECK_FALSE(PD_MSGKIND_DATA(PD_MSGTYPE_SOURCE_CAPABILITIES) == PD_MSGKIND_GET(&message));
+
+  contract_mock.reset();
+  contract_time = 0;
+  ContractPolicyEngine pe(FUSB302T<ContractBus>(), 0);
+  ContractLog          log;
+  pe.setContractCallback(logContract, &log);
+  runUntilIdle(pe);
+  receive(pe, caps, sizeof(caps));
+  agree(pe);
+  CHECK_EQUAL(1, log.count);
+  // Not evaluated as new capabilities, it is answered with Not_Supported and the contract stands
+  contract_mock.resetFiFo();
+  receive(pe, capsExtended, sizeof(capsExtended));
+  uint8_t reply[5 + 2];
+  CHECK_TRUE(contract_mock.readFiFo(sizeof(reply), reply));
+  CHECK_EQUAL(PD_MSGTYPE_NOT_SUPPORTED, reply[5] & PD_HDR_MSGTYPE);
+  CHECK_EQUAL(0, reply[6] & (PD_HDR_NUMOBJ >> 8));
+  CHECK_EQUAL(1, log.count);
+  CHECK_TRUE(pe.hasExplicitContract());
+}
+
+#ifndef PD_DISABLE_PPS
+TEST(CONTRACT, PPSRefreshWaitsOutSourceAMS) {
+  contract_mock.reset();
+  contract_time = 0;
+  ContractPolicyEngine pe(FUSB302T<ContractBus>(), 0);
+  runUntilIdle(pe);
+  receive(pe, caps, sizeof(caps));
+  agree(pe);
+  CHECK_TRUE(pd_pdo_kind::PPS == pe.getContract().kind);
+  // The re-request falls due while the source holds Rp at SinkTxNG for an AMS of its own
+  contract_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ng);
+  contract_time += PD_T_PPS_REREQUEST + 1;
+  pe.TimersCallback();
+  runUntilIdle(pe);
+  CHECK_EQUAL(30, pe.currentStateCode(true));
+  // Its message is handled, and ours still waits for SinkTxOk rather than a whole period
+  const uint8_t ping[] = {FUSB_FIFO_RX_SOP, 0xA5, 0x07, 0, 0, 0, 0};
+  receive(pe, ping, sizeof(ping));
+  CHECK_EQUAL(30, pe.currentStateCode(true));
+  CHECK_TRUE(contract_mock.fifoEmpty());
+  contract_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ok);
+  contract_mock.setRegister(FUSB_INTERRUPT, FUSB_INTERRUPT_I_BC_LVL);
+  pe.IRQOccured();
+  contract_mock.setRegister(FUSB_INTERRUPT, 0);
+  runUntilIdle(pe);
+  CHECK_FALSE(contract_mock.fifoEmpty());
+  agree(pe);
+  CHECK_EQUAL(PD_T_PPS_REREQUEST + 1, pe.getContract().updated);
+}
+#endif
@@ -1,6 +1,7 @@
 #include "CppUTest/TestHarness.h"
 #include "fusb302_defines.h"
 #include "fusb302b.h"
+#include "mock_fusb302.h"
 #include <cstring>
 #include <stdint.h>
 TEST_GROUP(FUSB){};
@@ -58,9 +59,10 @@ TEST(FUSB, ReadDeviceIDI2CFailsPath) {
 
 TEST(FUSB, RxMessagesPending) {
   auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
-    static uint8_t pos             = 0;
-    const uint8_t  virtualBuffer[] = {0x00, 0x00, 1 << 5};
-    CHECK_EQUAL(FUSB_STATUS1, address);
+    static uint8_t pos = 0;
+    // STATUS1 is the sixth byte of each status read, RX_EMPTY only in the last
+    const uint8_t virtualBuffer[] = {0, 0, 0, 0, 0, 0x00, 0, 0, 0, 0, 0, 0, 0x00, 0, 0, 0, 0, 0, 0, 1 << 5, 0};
+    CHECK_EQUAL(FUSB_STATUS0A, address);
     memcpy(buf, virtualBuffer + pos, size);
     pos += size;
     CHECK_TRUE(pos <= sizeof(virtualBuffer));
@@ -72,16 +74,21 @@ TEST(FUSB, RxMessagesPending) {
   };
   auto mock_delay = [](uint32_t millis) {};
 
-  FUSB302 f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
-  CHECK_EQUAL(true, f.fusb_rx_pending());
-  CHECK_EQUAL(true, f.fusb_rx_pending());
-  CHECK_EQUAL(false, f.fusb_rx_pending());
+  FUSB302              f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
+  FUSB302::fusb_status status;
+  CHECK_TRUE(f.fusb_get_status(&status));
+  CHECK_FALSE(status.status1 & FUSB_STATUS1_RX_EMPTY);
+  CHECK_TRUE(f.fusb_get_status(&status));
+  CHECK_FALSE(status.status1 & FUSB_STATUS1_RX_EMPTY);
+  CHECK_TRUE(f.fusb_get_status(&status));
+  CHECK_TRUE(status.status1 & FUSB_STATUS1_RX_EMPTY);
 }
 TEST(FUSB, ReadGoodEmptyMessage) {
   auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
-    static uint8_t pos             = 0;
-    const uint8_t  virtualBuffer[] = {0xE0, 0, 0, 1, 2, 3, 4};
-    CHECK_EQUAL(FUSB_FIFOS, address);
+    static uint8_t pos = 0;
+    // Status with a message waiting, then a control message and its CRC in one read of the FIFO
+    const uint8_t virtualBuffer[] = {0, 0, 0, 0, 0, 0, 0, 0xE0, 0, 0, 1, 2, 3, 4};
+    CHECK_EQUAL(pos == 0 ? FUSB_STATUS0A : FUSB_FIFOS, address);
     memcpy(buf, virtualBuffer + pos, size);
     pos += size;
     CHECK_TRUE(pos <= sizeof(virtualBuffer));
@@ -93,16 +100,21 @@ TEST(FUSB, ReadGoodEmptyMessage) {
   };
   auto mock_delay = [](uint32_t millis) {};
 
-  FUSB302 f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
-  pd_msg  msg;
-  CHECK_EQUAL(0, f.fusb_read_message(&msg));
+  FUSB302              f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
+  FUSB302::fusb_status status;
+  pd_msg               msg;
+  enum fusb_rx_result  rx;
+  CHECK_TRUE(f.fusb_read_status_and_message(&status, &msg, &rx));
+  CHECK_EQUAL(fusb_rx_sop, rx);
+  CHECK_EQUAL(0, PD_NUMOBJ_GET(&msg));
 }
 
 TEST(FUSB, ReadGoodMessage) {
   auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
-    static uint8_t pos             = 0;
-    const uint8_t  virtualBuffer[] = {0xE0, 0, 1 << 4, 0xAA, 0xAA, 0xAA, 0xAA, 1, 2, 3, 4};
-    CHECK_EQUAL(FUSB_FIFOS, address);
+    static uint8_t pos = 0;
+    // The one data object comes with the token and header, its CRC takes a second read
+    const uint8_t virtualBuffer[] = {0, 0, 0, 0, 0, 0, 0, 0xE0, 0, 1 << 4, 0xAA, 0xAA, 0xAA, 0xAA, 1, 2, 3, 4};
+    CHECK_EQUAL(pos == 0 ? FUSB_STATUS0A : FUSB_FIFOS, address);
     memcpy(buf, virtualBuffer + pos, size);
     pos += size;
     CHECK_TRUE(pos <= sizeof(virtualBuffer));
@@ -114,16 +126,21 @@ TEST(FUSB, ReadGoodMessage) {
   };
   auto mock_delay = [](uint32_t millis) {};
 
-  FUSB302 f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
-  pd_msg  msg;
-  CHECK_EQUAL(0, f.fusb_read_message(&msg));
+  FUSB302              f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
+  FUSB302::fusb_status status;
+  pd_msg               msg;
+  enum fusb_rx_result  rx;
+  CHECK_TRUE(f.fusb_read_status_and_message(&status, &msg, &rx));
+  CHECK_EQUAL(fusb_rx_sop, rx);
   CHECK_EQUAL(1, PD_NUMOBJ_GET(&msg));
+  CHECK_EQUAL(0xAAAAAAAA, msg.obj[0]);
 }
 TEST(FUSB, ReadIgnoredMessage) {
   auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
-    static uint8_t pos             = 0;
-    const uint8_t  virtualBuffer[] = {0xD0, 0, 1 << 4, 0xAA, 0xAA, 0xAA, 0xAA, 1, 2, 3, 4};
-    CHECK_EQUAL(FUSB_FIFOS, address);
+    static uint8_t pos = 0;
+    // An SOP' message is read out all the same, so the FIFO does not get stuck on it
+    const uint8_t virtualBuffer[] = {0, 0, 0, 0, 0, 0, 0, 0xD0, 0, 1 << 4, 0xAA, 0xAA, 0xAA, 0xAA, 1, 2, 3, 4};
+    CHECK_EQUAL(pos == 0 ? FUSB_STATUS0A : FUSB_FIFOS, address);
     memcpy(buf, virtualBuffer + pos, size);
     pos += size;
     CHECK_TRUE(pos <= sizeof(virtualBuffer));
@@ -135,11 +152,93 @@ TEST(FUSB, ReadIgnoredMessage) {
   };
   auto mock_delay = [](uint32_t millis) {};
 
-  FUSB302 f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
-  pd_msg  msg;
-  CHECK_EQUAL(1, f.fusb_read_message(&msg));
+  FUSB302              f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
+  FUSB302::fusb_status status;
+  pd_msg               msg;
+  enum fusb_rx_result  rx;
+  CHECK_TRUE(f.fusb_read_status_and_message(&status, &msg, &rx));
+  CHECK_EQUAL(fusb_rx_other, rx);
   CHECK_EQUAL(1, PD_NUMOBJ_GET(&msg));
 }
+TEST(FUSB, ReadStatusAndControlMessage) {
+  auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
+    static uint8_t pos = 0;
+    // Status registers, then a whole Accept with its CRC from the FIFO
+    const uint8_t virtualBuffer[] = {0, 0, 0, FUSB_INTERRUPTB_I_GCRCSENT, 0, 0, 0, 0xE0, 0xA3, 0x03, 1, 2, 3, 4};
+    CHECK_EQUAL(pos == 0 ? FUSB_STATUS0A : FUSB_FIFOS, address);
+    CHECK_EQUAL(7, size);
+    memcpy(buf, virtualBuffer + pos, size);
+    pos += size;
+    CHECK_TRUE(pos <= sizeof(virtualBuffer));
+    return true;
+  };
+  auto mock_write = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
+    FAIL("Should not issue writes in read only functions");
+    return false;
+  };
+  auto mock_delay = [](uint32_t millis) {};
+
+  FUSB302              f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
+  FUSB302::fusb_status status;
+  pd_msg               msg;
+  enum fusb_rx_result  rx;
+  CHECK_TRUE(f.fusb_read_status_and_message(&status, &msg, &rx));
+  CHECK_EQUAL(fusb_rx_sop, rx);
+  CHECK_EQUAL(FUSB_INTERRUPTB_I_GCRCSENT, status.interruptb);
+  CHECK_EQUAL(PD_MSGTYPE_ACCEPT, PD_MSGTYPE_GET(&msg));
+  CHECK_EQUAL(0, PD_NUMOBJ_GET(&msg));
+}
+TEST(FUSB, ReadStatusAndDataMessage) {
+  auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
+    static uint8_t pos = 0;
+    // Two data objects, the second and the CRC need a second read of the FIFO
+    const uint8_t virtualBuffer[] = {0, 0, 0, FUSB_INTERRUPTB_I_GCRCSENT, 0, 0, 0, 0xE0, 0xA1, 0x21, 0x2c, 0x91, 0x01, 0x08, 0x64, 0x21, 0xDC, 0xC8, 1, 2, 3, 4};
+    CHECK_EQUAL(pos == 0 ? FUSB_STATUS0A : FUSB_FIFOS, address);
+    CHECK_EQUAL(pos == 0 ? 7 : pos == 7 ? 7 : 8, size);
+    memcpy(buf, virtualBuffer + pos, size);
+    pos += size;
+    CHECK_TRUE(pos <= sizeof(virtualBuffer));
+    return true;
+  };
+  auto mock_write = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
+    FAIL("Should not issue writes in read only functions");
+    return false;
+  };
+  auto mock_delay = [](uint32_t millis) {};
+
+  FUSB302              f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
+  FUSB302::fusb_status status;
+  pd_msg               msg;
+  enum fusb_rx_result  rx;
+  CHECK_TRUE(f.fusb_read_status_and_message(&status, &msg, &rx));
+  CHECK_EQUAL(fusb_rx_sop, rx);
+  CHECK_EQUAL(2, PD_NUMOBJ_GET(&msg));
+  CHECK_EQUAL(0x0801912C, msg.obj[0]);
+  CHECK_EQUAL(0xC8DC2164, msg.obj[1]);
+}
+TEST(FUSB, ReadStatusWithEmptyFIFO) {
+  auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
+    // An empty FIFO is never read, as that would pop it
+    const uint8_t virtualBuffer[] = {0, 0, FUSB_INTERRUPTA_I_TXSENT, 0, 0, FUSB_STATUS1_RX_EMPTY, 0};
+    CHECK_EQUAL(FUSB_STATUS0A, address);
+    CHECK_EQUAL(sizeof(virtualBuffer), size);
+    memcpy(buf, virtualBuffer, size);
+    return true;
+  };
+  auto mock_write = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
+    FAIL("Should not issue writes in read only functions");
+    return false;
+  };
+  auto mock_delay = [](uint32_t millis) {};
+
+  FUSB302              f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
+  FUSB302::fusb_status status;
+  pd_msg               msg;
+  enum fusb_rx_result  rx;
+  CHECK_TRUE(f.fusb_read_status_and_message(&status, &msg, &rx));
+  CHECK_EQUAL(fusb_rx_none, rx);
+  CHECK_EQUAL(fusb_tx_sent, FUSB302::fusb_get_tx_result(&status));
+}
 TEST(FUSB, ResetDevice) {
   auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
     FAIL("No Reads should be required");
@@ -147,18 +246,16 @@ TEST(FUSB, ResetDevice) {
   };
   auto mock_write = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
     static uint8_t writeNumber = 0;
-    CHECK_EQUAL(size, 1);
     switch (writeNumber) {
-    case 0:
+    case 0: // Both buffers flushed in one write
       CHECK_EQUAL(FUSB_CONTROL0, address);
+      CHECK_EQUAL(size, 2);
       CHECK_EQUAL(buf[0], 0x44);
+      CHECK_EQUAL(buf[1], FUSB_CONTROL1_RX_FLUSH);
       break;
     case 1:
-      CHECK_EQUAL(FUSB_CONTROL1, address);
-      CHECK_EQUAL(buf[0], FUSB_CONTROL1_RX_FLUSH);
-      break;
-    case 2:
       CHECK_EQUAL(FUSB_RESET, address);
+      CHECK_EQUAL(size, 1);
       CHECK_EQUAL(buf[0], FUSB_RESET_PD_RESET);
       break;
     default:
@@ -190,6 +287,37 @@ TEST(FUSB, SendHardReset) {
   f.fusb_send_hardrst();
 }
 
+TEST(FUSB, SetInterrupts) {
+  auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
+    FAIL("No Reads should be required");
+    return false;
+  };
+  auto mock_write = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
+    static uint8_t state = 0;
+    switch (state++) {
+    case 0:
+      // Only the collision interrupt is left on from MASK1
+      CHECK_EQUAL(FUSB_MASK1, address);
+      CHECK_EQUAL(1, size);
+      CHECK_EQUAL((uint8_t)~FUSB_MASK1_M_COLLISION, buf[0]);
+      break;
+    case 1:
+      CHECK_EQUAL(FUSB_MASKA, address);
+      CHECK_EQUAL(2, size);
+      CHECK_EQUAL((uint8_t)~(FUSB_MASKA_M_TXSENT | FUSB_MASKA_M_RETRYFAIL | FUSB_MASKA_M_HARDRST), buf[0]);
+      CHECK_EQUAL(0, buf[1]);
+      break;
+    default:
+      FAIL("Too many writes");
+    }
+    return true;
+  };
+  auto mock_delay = [](uint32_t millis) {};
+
+  FUSB302 f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
+  CHECK_TRUE(f.fusb_set_interrupts(fusb_irq_rx | fusb_irq_tx | fusb_irq_hard_rst));
+}
+
 TEST(FUSB, ReadTypeCCurrentLevels) {
   auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
     static uint8_t counter = 0;
@@ -247,6 +375,19 @@ TEST(FUSB, ReadStatus) {
   CHECK_EQUAL(7, statusOut.interrupt);
 }
 
+TEST(FUSB, DecodeTxResult) {
+  // Retries running out fail the send, a collision on the CC line discards it
+  FUSB302::fusb_status status;
+  memset(&status, 0, sizeof(status));
+  CHECK_EQUAL(fusb_tx_pending, FUSB302::fusb_get_tx_result(&status));
+  status.interrupt = FUSB_INTERRUPT_I_COLLISION;
+  CHECK_EQUAL(fusb_tx_discarded, FUSB302::fusb_get_tx_result(&status));
+  status.interrupta = FUSB_INTERRUPTA_I_RETRYFAIL;
+  CHECK_EQUAL(fusb_tx_retry_failed, FUSB302::fusb_get_tx_result(&status));
+  status.interrupta |= FUSB_INTERRUPTA_I_TXSENT;
+  CHECK_EQUAL(fusb_tx_sent, FUSB302::fusb_get_tx_result(&status));
+}
+
 TEST(FUSB, DeviceSetup) {
   auto mock_read = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
     static uint8_t state = 0;
@@ -280,70 +421,57 @@ TEST(FUSB, DeviceSetup) {
   };
   auto mock_write = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool {
     static uint8_t state = 0;
-    CHECK_EQUAL(1, size);
     switch (state) {
     case 0: // issues reset first
       CHECK_EQUAL(FUSB_RESET, address);
+      CHECK_EQUAL(1, size);
       CHECK_EQUAL(FUSB_RESET_SW_RES, buf[0]);
       break;
-    case 1: // Turns on all power sections
-      CHECK_EQUAL(FUSB_POWER, address);
-      CHECK_EQUAL(0x0F, buf[0]);
-      break;
-    case 2: // Turns on all interrupts
+    case 1: // Turns on all interrupts and all power sections, before anything else
       CHECK_EQUAL(FUSB_MASK1, address);
+      CHECK_EQUAL(2, size);
       CHECK_EQUAL(0x00, buf[0]);
+      CHECK_EQUAL(0x0F, buf[1]);
       break;
-    case 3: // Turns on all interrupts
-      CHECK_EQUAL(FUSB_MASKA, address);
-      CHECK_EQUAL(0x00, buf[0]);
-      break;
-    case 4: // Turns on all interrupts
-      CHECK_EQUAL(FUSB_MASKB, address);
-      CHECK_EQUAL(0x00, buf[0]);
-      break;
-    case 5:
+    case 2: // CONTROL0 to CONTROL3 in one go
       CHECK_EQUAL(FUSB_CONTROL0, address);
+      CHECK_EQUAL(4, size);
       CHECK_EQUAL(0x03 << 2, buf[0]);
+      CHECK_EQUAL(FUSB_CONTROL1_RX_FLUSH, buf[1]); // Issue buffer flush
+      CHECK_EQUAL(0x00, buf[2]);                   // Set defaults just-in-case
+      CHECK_EQUAL(0x07, buf[3]);                   // Enable auto re-send on error
       break;
-    case 6: // Enable auto re-send on error
-      CHECK_EQUAL(FUSB_CONTROL3, address);
-      CHECK_EQUAL(0x07, buf[0]);
-      break;
-    case 7: // Set defaults just-in-case
-      CHECK_EQUAL(FUSB_CONTROL2, address);
+    case 3: // Turns on all interrupts
+      CHECK_EQUAL(FUSB_MASKA, address);
+      CHECK_EQUAL(2, size);
       CHECK_EQUAL(0x00, buf[0]);
+      CHECK_EQUAL(0x00, buf[1]);
       break;
-    case 8: // Issue buffer flush
-      CHECK_EQUAL(FUSB_CONTROL1, address);
-      CHECK_EQUAL(FUSB_CONTROL1_RX_FLUSH, buf[0]);
-      break;
-    case 9: // Enables measuring the CC 1
+    case 4: // Enables measuring the CC 1
       CHECK_EQUAL(FUSB_SWITCHES0, address);
+      CHECK_EQUAL(1, size);
       CHECK_EQUAL(0x07, buf[0]);
       break;
-    case 10: // Enables measuring the CC 2 pin
+    case 5: // Enables measuring the CC 2 pin
       CHECK_EQUAL(FUSB_SWITCHES0, address);
+      CHECK_EQUAL(1, size);
       CHECK_EQUAL(0x0B, buf[0]);
       break;
-    case 11: // Selects to signal on cc2
-      CHECK_EQUAL(FUSB_SWITCHES1, address);
-      CHECK_EQUAL(0x26, buf[0]);
-      break;
-    case 12: // Selects to signal on cc2
+    case 6: // Selects to signal on cc2
       CHECK_EQUAL(FUSB_SWITCHES0, address);
+      CHECK_EQUAL(2, size);
       CHECK_EQUAL(0x0B, buf[0]);
+      CHECK_EQUAL(0x26, buf[1]);
       break;
-    case 13:
+    case 7: // Flushes both buffers
       CHECK_EQUAL(FUSB_CONTROL0, address);
+      CHECK_EQUAL(2, size);
       CHECK_EQUAL(buf[0], 0x44);
+      CHECK_EQUAL(buf[1], FUSB_CONTROL1_RX_FLUSH);
       break;
-    case 14:
-      CHECK_EQUAL(FUSB_CONTROL1, address);
-      CHECK_EQUAL(buf[0], FUSB_CONTROL1_RX_FLUSH);
-      break;
-    case 15:
+    case 8:
       CHECK_EQUAL(FUSB_RESET, address);
+      CHECK_EQUAL(1, size);
       CHECK_EQUAL(buf[0], FUSB_RESET_PD_RESET);
       break;
     default:
@@ -357,7 +485,74 @@ TEST(FUSB, DeviceSetup) {
 
   FUSB302 f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
 
-  f.fusb_setup();
+  CHECK_TRUE(f.fusb_setup());
+}
+
+namespace {
+MockFUSB302 setup_mock;
+}
+TEST(FUSB, SetupWritesInBursts) {
+  auto mock_read  = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool { return setup_mock.i2cRead(deviceAddress, address, size, buf); };
+  auto mock_write = [](const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) -> bool { return setup_mock.i2cWrite(deviceAddress, address, size, buf); };
+  auto mock_delay = [](uint32_t millis) {};
+  setup_mock.reset();
+
+  FUSB302 f = FUSB302(FUSB302B_ADDR, mock_read, mock_write, mock_delay);
+  CHECK_TRUE(f.fusb_setup());
+  // 16 single register writes before they were combined
+  CHECK_EQUAL(9, setup_mock.writes);
+  CHECK_EQUAL(3, setup_mock.reads);
+  CHECK_EQUAL(0x0F, setup_mock.getRegister(FUSB_POWER));
+  CHECK_EQUAL(0x07, setup_mock.getRegister(FUSB_CONTROL3));
+  CHECK_EQUAL(0x00, setup_mock.getRegister(FUSB_MASKB));
+  CHECK_EQUAL(0x26, setup_mock.getRegister(FUSB_SWITCHES1));
+}
+
+TEST(FUSB, BusTimeModel) {
+  MockFUSB302 mock;
+  mock.reset();
+  uint8_t status[7];
+  // START, address, register, repeated START, address, 7 bytes and STOP is 93 clocks
+  CHECK_TRUE(mock.i2cRead(FUSB302B_ADDR, FUSB_STATUS0A, sizeof(status), status));
+  CHECK_EQUAL(93 * 2500, mock.busNanoseconds);
+  mock.reset();
+  mock.setBusClock(1000000);
+  CHECK_TRUE(mock.i2cWrite(FUSB302B_ADDR, FUSB_CONTROL0, 2, status));
+  CHECK_EQUAL((1 + 9 + 9 + 18 + 1) * 1000, mock.busNanoseconds);
+  // Clock stretching adds up to the given time after each of the 4 bytes
+  mock.reset();
+  mock.setBusClock(1000000, 500);
+  CHECK_TRUE(mock.i2cWrite(FUSB302B_ADDR, FUSB_CONTROL0, 2, status));
+  CHECK_TRUE(mock.busNanoseconds > 38 * 1000);
+  CHECK_TRUE(mock.busNanoseconds <= 38 * 1000 + 4 * 500);
+}
+
+TEST(FUSB, RegisterBatchRuns) {
+  struct CountingBus {
+    mutable int calls = 0;
+    bool write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) const {
+      static const uint8_t expected[3][2] = {{FUSB_SWITCHES0, 1}, {FUSB_CONTROL1, 3}, {FUSB_MASKB, 2}};
+      CHECK_TRUE(calls < 3);
+      CHECK_EQUAL(expected[calls][0], registerAdd);
+      CHECK_EQUAL(expected[calls][1], size);
+      calls++;
+      return true;
+    }
+  } bus;
+  FUSB302RegisterBatch batch;
+  // Added out of order, sent in address order with the last value kept
+  batch.set(FUSB_CONTROL4, 1);
+  batch.set(FUSB_CONTROL2, 2);
+  batch.set(FUSB_SWITCHES0, 3);
+  batch.set(FUSB_CONTROL1, 4);
+  batch.set(FUSB_MASKB, 5);
+  batch.set(FUSB_CONTROL3, 6);
+  batch.set(FUSB_CONTROL3, 7);
+  CHECK_TRUE(batch.write(bus));
+  CHECK_EQUAL(3, bus.calls);
+  // Nothing left to send
+  CHECK_TRUE(batch.write(bus));
+  CHECK_EQUAL(3, bus.calls);
 }
 
 TEST(FUSB, SendMessage) {
@@ -373,15 +568,12 @@ TEST(FUSB, SendMessage) {
     CHECK_EQUAL(FUSB_FIFOS, address);
     switch (step) {
     case 0:
+      // The whole frame in one write, tokens around the two header bytes
+      CHECK_EQUAL(5 + 2 + 4, size);
       CHECK_EQUAL(0, memcmp(sop_seq, buf, 5));
-      CHECK_EQUAL(5, size);
-      break;
-    case 1:
-      CHECK_EQUAL(2, size);
-      break;
-    case 2:
-      CHECK_EQUAL(0, memcmp(eop_seq, buf, 4));
-      CHECK_EQUAL(4, size);
+      CHECK_EQUAL(0x21, buf[5]);
+      CHECK_EQUAL(0x03, buf[6]);
+      CHECK_EQUAL(0, memcmp(eop_seq, &buf[7], 4));
       break;
     default:
       FAIL("Unhandled write");
@@ -394,5 +586,6 @@ TEST(FUSB, SendMessage) {
   FUSB302 f = FUSB302(0x23 << 1, mock_read, mock_write, mock_delay);
   pd_msg  msg;
   memset(&msg, 0, sizeof(msg));
-  f.fusb_send_message(&msg);
+  msg.hdr = 0x0321; // No data objects
+  CHECK_TRUE(f.fusb_send_message(&msg));
 }
\ No newline at end of file
@@ -0,0 +1,125 @@
+// Hard reset signalling is a build option, so it gets its own engine built with it on
+#ifndef PD_SEND_HARD_RESET
+#define PD_SEND_HARD_RESET
+#endif
+#include "CppUTest/TestHarness.h"
+#include "fusb302_defines.h"
+#include "mock_fusb302.h"
+#include "policy_engine_impl.h"
+#include "user_functions.hpp"
+#include <stdint.h>
+TEST_GROUP(HARDRESET){};
+namespace {
+MockFUSB302 hr_mock;
+TICK_TYPE   hr_time = 0;
+
+struct HardResetBus {
+  static bool read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return hr_mock.i2cRead(FUSB302B_ADDR, registerAdd, size, buf); }
+  static bool write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return hr_mock.i2cWrite(FUSB302B_ADDR, registerAdd, size, buf); }
+  static void delay(uint32_t milliseconds) {}
+};
+struct HardResetPlatform {
+  static TICK_TYPE getTimeStamp() { return hr_time; }
+  static void      delay(TICK_TYPE milliseconds) { FAIL("The policy engine should never block"); }
+};
+struct HardResetDpm {
+  static bool evaluateCapability(const pd_msg *capabilities, pd_msg *request) { return pdbs_dpm_evaluate_capability(capabilities, request); }
+  static bool evaluateEPRCapability(const epr_pd_msg *capabilities, pd_msg *request) { return false; }
+  static void getSinkCapability(pd_msg *cap, const bool isPD3) { pdbs_dpm_get_sink_capability(cap, isPD3); }
+};
+typedef PolicyEngineT<HardResetPlatform, HardResetDpm, FUSB302T<HardResetBus>> HardResetPolicyEngine;
+
+void runUntilIdle(HardResetPolicyEngine &pe) {
+  while (pe.thread()) {
+  }
+}
+void raiseInterrupt(HardResetPolicyEngine &pe, uint8_t reg, uint8_t flags) {
+  hr_mock.setRegister(reg, flags);
+  pe.IRQOccured();
+  hr_mock.setRegister(reg, 0);
+  runUntilIdle(pe);
+}
+// Source offers 5V, our request goes out but is never acknowledged so we hard reset
+void failRequest(HardResetPolicyEngine &pe) {
+  const uint8_t caps[] = {FUSB_FIFO_RX_SOP, 0xA1, 0x11, 0x2c, 0x91, 0x01, 0x08, 0, 0, 0, 0};
+  hr_mock.addToFIFO(sizeof(caps), caps);
+  raiseInterrupt(pe, FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  hr_mock.resetFiFo();
+  raiseInterrupt(pe, FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_RETRYFAIL);
+}
+} // namespace
+
+TEST(HARDRESET, FollowsVBusCycle) {
+  hr_mock.reset();
+  hr_time = 0;
+  HardResetPolicyEngine pe(FUSB302T<HardResetBus>(), 0);
+  runUntilIdle(pe);
+  failRequest(pe);
+  // Hard reset signalled, waiting on the PHY
+  CHECK_EQUAL(FUSB_CONTROL3_SEND_HARD_RESET, hr_mock.getRegister(FUSB_CONTROL3) & FUSB_CONTROL3_SEND_HARD_RESET);
+  CHECK_EQUAL(16, pe.currentStateCode(true));
+  raiseInterrupt(pe, FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_HARDSENT);
+  // Now waiting for VBUS to go away, with only VBUS changes (and RX and send results) unmasked
+  CHECK_EQUAL(31, pe.currentStateCode(true));
+  CHECK_EQUAL((uint8_t)~(FUSB_MASK1_M_VBUSOK | FUSB_MASK1_M_COLLISION), hr_mock.getRegister(FUSB_MASK1));
+  hr_mock.setRegister(FUSB_STATUS0, 0);
+  raiseInterrupt(pe, FUSB_INTERRUPT, FUSB_INTERRUPT_I_VBUSOK);
+  CHECK_EQUAL(3, pe.currentStateCode(true));
+  CHECK_FALSE(pe.thread());
+  // VBUS back, so negotiation starts again without waiting out a timeout
+  hr_mock.setRegister(FUSB_STATUS0, FUSB_STATUS0_VBUSOK);
+  raiseInterrupt(pe, FUSB_INTERRUPT, FUSB_INTERRUPT_I_VBUSOK);
+  CHECK_EQUAL(6, pe.currentStateCode(true));
+}
+
+TEST(HARDRESET, CarriesOnWithoutVBusDrop) {
+  hr_mock.reset();
+  hr_time = 0;
+  HardResetPolicyEngine pe(FUSB302T<HardResetBus>(), 0);
+  runUntilIdle(pe);
+  failRequest(pe);
+  // The PHY never confirms, and VBUS never drops
+  hr_time += PD_T_HARD_RESET_COMPLETE + 1;
+  runUntilIdle(pe);
+  CHECK_EQUAL(31, pe.currentStateCode(true));
+  hr_time += PD_T_SAFE_0V + 1;
+  runUntilIdle(pe);
+  CHECK_EQUAL(6, pe.currentStateCode(true));
+}
+
+TEST(HARDRESET, CollisionIsNotAFailure) {
+  hr_mock.reset();
+  hr_time = 0;
+  HardResetPolicyEngine pe(FUSB302T<HardResetBus>(), 0);
+  runUntilIdle(pe);
+  // Our request is discarded as the source is already sending again
+  const uint8_t caps[] = {FUSB_FIFO_RX_SOP, 0xA1, 0x11, 0x2c, 0x91, 0x01, 0x08, 0, 0, 0, 0};
+  hr_mock.addToFIFO(sizeof(caps), caps);
+  raiseInterrupt(pe, FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  hr_mock.resetFiFo();
+  raiseInterrupt(pe, FUSB_INTERRUPT, FUSB_INTERRUPT_I_COLLISION);
+  CHECK_EQUAL(0, hr_mock.getRegister(FUSB_CONTROL3) & FUSB_CONTROL3_SEND_HARD_RESET);
+  CHECK_EQUAL(6, pe.currentStateCode(true));
+  // What it sent is answered as usual
+  const uint8_t capsAgain[] = {FUSB_FIFO_RX_SOP, 0xA1, 0x13, 0x2c, 0x91, 0x01, 0x08, 0, 0, 0, 0};
+  const uint8_t accept[]    = {FUSB_FIFO_RX_SOP, 0xA3, 0x05, 0, 0, 0, 0};
+  const uint8_t ready[]     = {FUSB_FIFO_RX_SOP, 0xA6, 0x07, 0, 0, 0, 0};
+  hr_mock.addToFIFO(sizeof(capsAgain), capsAgain);
+  raiseInterrupt(pe, FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  hr_mock.resetFiFo();
+  raiseInterrupt(pe, FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_TXSENT);
+  hr_mock.addToFIFO(sizeof(accept), accept);
+  raiseInterrupt(pe, FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  hr_mock.addToFIFO(sizeof(ready), ready);
+  raiseInterrupt(pe, FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  CHECK_TRUE(pe.hasExplicitContract());
+  // With a contract the ready state takes over, and the contract stands
+  const uint8_t newCaps[] = {FUSB_FIFO_RX_SOP, 0xA1, 0x19, 0x2c, 0x91, 0x01, 0x08, 0, 0, 0, 0};
+  hr_mock.addToFIFO(sizeof(newCaps), newCaps);
+  raiseInterrupt(pe, FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  hr_mock.resetFiFo();
+  raiseInterrupt(pe, FUSB_INTERRUPT, FUSB_INTERRUPT_I_COLLISION);
+  CHECK_EQUAL(0, hr_mock.getRegister(FUSB_CONTROL3) & FUSB_CONTROL3_SEND_HARD_RESET);
+  CHECK_EQUAL(12, pe.currentStateCode(true));
+  CHECK_TRUE(pe.hasExplicitContract());
+}
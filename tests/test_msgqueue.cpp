@@ -0,0 +1,80 @@
+#include "CppUTest/TestHarness.h"
+#include "msgqueue.h"
+#include "pd.h"
+#include <cstring>
+#include <stdint.h>
+TEST_GROUP(MSGQUEUE){};
+
+static pd_msg makeMessage(uint8_t type, uint8_t numobj, uint32_t seed) {
+  pd_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.hdr = type | PD_NUMOBJ(numobj);
+  for (uint8_t i = 0; i < numobj; i++) {
+    msg.obj[i] = seed + i;
+  }
+  return msg;
+}
+
+TEST(MSGQUEUE, ControlMessagesArePacked) {
+  // Room for a single full size message
+  msgqueue<30> queue;
+  for (int i = 0; i < 15; i++) {
+    pd_msg msg = makeMessage(PD_MSGTYPE_ACCEPT, 0, 0);
+    msg.hdr |= (i & 7) << PD_HDR_MESSAGEID_SHIFT;
+    queue.push(&msg);
+    CHECK_EQUAL(i + 1, queue.getOccupied());
+  }
+  CHECK_EQUAL(0, queue.getFree());
+  for (int i = 0; i < 15; i++) {
+    pd_msg msg;
+    queue.pop(&msg);
+    CHECK_EQUAL(PD_MSGTYPE_ACCEPT, PD_MSGTYPE_GET(&msg));
+    CHECK_EQUAL(i & 7, PD_MESSAGEID_GET(&msg));
+  }
+  CHECK_EQUAL(0, queue.getOccupied());
+}
+
+TEST(MSGQUEUE, DataObjectsWrap) {
+  msgqueue<32> queue;
+  for (uint32_t i = 0; i < 20; i++) {
+    // Sizes that do not divide the buffer, so copies split at the end
+    pd_msg msg = makeMessage(PD_MSGTYPE_SOURCE_CAPABILITIES, 1 + (i % 3), i * 100);
+    queue.push(&msg);
+    pd_msg out;
+    memset(&out, 0, sizeof(out));
+    queue.pop(&out);
+    CHECK_EQUAL(msg.hdr, out.hdr);
+    CHECK_EQUAL(0, memcmp(msg.obj, out.obj, PD_NUMOBJ_GET(&msg) * 4));
+  }
+  CHECK_EQUAL(0, queue.getOccupied());
+  CHECK_EQUAL(32, queue.getFree());
+}
+
+TEST(MSGQUEUE, FullDropsOldest) {
+  msgqueue<64> queue;
+  for (uint32_t i = 0; i < 4; i++) {
+    pd_msg msg = makeMessage(PD_MSGTYPE_SOURCE_CAPABILITIES, 7, i);
+    queue.push(&msg);
+  }
+  // 30 bytes each, so only the last two fit
+  CHECK_EQUAL(2, queue.getOccupied());
+  pd_msg out;
+  queue.pop(&out);
+  CHECK_EQUAL(2, out.obj[0]);
+  queue.pop(nullptr);
+  CHECK_EQUAL(0, queue.getOccupied());
+
+  out.hdr = 0xFFFF;
+  queue.pop(&out);
+  CHECK_EQUAL(0xFFFF, out.hdr);
+}
+
+TEST(MSGQUEUE, Flush) {
+  msgqueue<64> queue;
+  pd_msg       msg = makeMessage(PD_MSGTYPE_PS_RDY, 0, 0);
+  queue.push(&msg);
+  queue.push(&msg);
+  queue.flush();
+  CHECK_EQUAL(0, queue.getOccupied());
+  CHECK_EQUAL(64, queue.getFree());
+}
@@ -16,12 +16,14 @@ auto    mock_delay     = [](uint32_t millis) {};
 auto    mock_timestamp = []() -> uint32_t { return 0; };
 FUSB302 fusb           = FUSB302(FUSB302B_ADDR, i2c_read, i2c_write, mock_delay);
 
-PolicyEngine pe = PolicyEngine(fusb, mock_timestamp, mock_delay, pdbs_dpm_get_sink_capability, pdbs_dpm_evaluate_capability, EPREvaluateCapabilityFunc, 140);
+PolicyEngine pe(fusb, mock_timestamp, mock_delay, pdbs_dpm_get_sink_capability, pdbs_dpm_evaluate_capability, EPREvaluateCapabilityFunc, 140);
 // Testing constants
 const uint8_t message_SOP1[]                 = {FUSB_FIFO_RX_SOP1, 0, 0, 1, 2, 3, 4};
 const uint8_t message_SOP2[]                 = {FUSB_FIFO_RX_SOP2, 0, 0, 1, 2, 3, 4};
 const uint8_t message_good_crc[]             = {FUSB_FIFO_RX_SOP, PD_MSGTYPE_GOODCRC, 0, 0, 0, 0, 0}; // good crc with transaction counter of 0
+const uint8_t message_good_crc_1[]           = {FUSB_FIFO_RX_SOP, PD_MSGTYPE_GOODCRC, 0x02, 0, 0, 0, 0}; // good crc with transaction counter of 1
 const uint8_t message_request_capabilities[] = {FUSB_FIFO_RX_SOP, PD_MSGTYPE_GET_SINK_CAP, 0, 0, 0, 0, 0};
+const uint8_t message_request_caps_1[]       = {FUSB_FIFO_RX_SOP, PD_MSGTYPE_GET_SINK_CAP, 0x02, 0, 0, 0, 0}; // the same with transaction counter of 1
 const uint8_t message_accept[]               = {FUSB_FIFO_RX_SOP, 0x63, 0x03, 0, 0, 0, 0}; // PS_ACCEPT
 const uint8_t mock_capabilities[]            = {FUSB_FIFO_RX_SOP,
                                                 0xA1, // Header
@@ -65,9 +67,9 @@ void injectTestmessage(const uint8_t len, const uint8_t *data) {
 
   fusb_mock.addToFIFO(len, data);
   fusb_mock.setRegister(FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
-  CHECK_TRUE(fusb.fusb_rx_pending());
+  CHECK_FALSE(fusb_mock.getRegister(FUSB_STATUS1) & FUSB_STATUS1_RX_EMPTY);
   pe.IRQOccured();
-  CHECK_FALSE(fusb.fusb_rx_pending());
+  CHECK_TRUE(fusb_mock.getRegister(FUSB_STATUS1) & FUSB_STATUS1_RX_EMPTY);
 }
 
 void iterateThoughExpectedStates(std::vector<int> expectedStates) {
@@ -107,14 +109,15 @@ void test_NormalNegotiation() {
 
   fusb_mock.setRegister(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_TXSENT);
   pe.IRQOccured();
-  iterateThoughExpectedStates({1, 0, 0});
+  // The PHY only raises I_TXSENT once the GoodCRC is back, so the send is complete
+  iterateThoughExpectedStates({1, 9, 0, 0});
   fusb_mock.setRegister(FUSB_INTERRUPTA, 0);
-  // Now that tx has "sent" the charger will send a good crc back
+  // The GoodCRC itself also lands in the FIFO, and is dropped
   std::cout << "Faking Good CRC" << std::endl;
 
   injectTestmessage(sizeof(message_good_crc), message_good_crc);
 
-  iterateThoughExpectedStates({2, 9, 0, 0});
+  iterateThoughExpectedStates({0});
   // Now the unit should be waiting for the acceptance message from the power adapter
   CHECK_EQUAL(0, pe.currentStateCode());
 
@@ -145,6 +148,17 @@ TEST(PD, PDNegotiationTest) {
   iterateThoughExpectedStates({0});
   // Now wind up to normal state (negotiated)
   test_NormalNegotiation();
+  // Once negotiated only incoming messages, the results of our own sends (and over temperature) should wake us
+  fusb_mock.setRegister(FUSB_INTERRUPTB, 0);
+  fusb_mock.setRegister(FUSB_INTERRUPT, FUSB_INTERRUPT_I_BC_LVL | FUSB_INTERRUPT_I_ACTIVITY | FUSB_INTERRUPT_I_COMP_CHNG);
+  CHECK_FALSE(fusb_mock.interruptAsserted());
+  fusb_mock.setRegister(FUSB_INTERRUPT, 0);
+  fusb_mock.setRegister(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_TXSENT);
+  CHECK_TRUE(fusb_mock.interruptAsserted());
+  fusb_mock.setRegister(FUSB_INTERRUPTA, 0);
+  fusb_mock.setRegister(FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  CHECK_TRUE(fusb_mock.interruptAsserted());
+  fusb_mock.setRegister(FUSB_INTERRUPTB, 0);
   // Test that the unit can be asked for its capabilities
   injectTestmessage(sizeof(message_request_capabilities), message_request_capabilities);
   // The unit will then transition to send its capabilities
@@ -159,8 +173,140 @@ TEST(PD, PDNegotiationTest) {
     CHECK_EQUAL(sendMessage[i], expectedDeviceCaps[i]);
   }
 
+  // The source missed our GoodCRC and sends its request again, which is dropped
+  injectTestmessage(sizeof(message_request_capabilities), message_request_capabilities);
+  iterateThoughExpectedStates({0});
+  CHECK_TRUE(fusb_mock.fifoEmpty());
+
+  // A message arriving with the GoodCRC is kept for the ready state
+  injectTestmessage(sizeof(message_good_crc_1), message_good_crc_1);
+  injectTestmessage(sizeof(message_request_caps_1), message_request_caps_1);
+  iterateThoughExpectedStates({0});
+  fusb_mock.setRegister(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_TXSENT);
+  pe.IRQOccured();
+  iterateThoughExpectedStates({1, 12, 14, 0, 0});
+  fusb_mock.setRegister(FUSB_INTERRUPTA, 0);
+  // Drop the sent capabilities and complete the send
+  fusb_mock.resetFiFo();
+  fusb_mock.setRegister(FUSB_INTERRUPTB, 0);
   fusb_mock.setRegister(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_TXSENT);
   pe.IRQOccured();
-  iterateThoughExpectedStates({1, 0, 0});
+  iterateThoughExpectedStates({1, 12, 0, 0});
   fusb_mock.setRegister(FUSB_INTERRUPTA, 0);
+
+  // The source holds Rp at SinkTxNG, so asking for new capabilities has to wait
+  fusb_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ng);
+  pe.renegotiate();
+  iterateThoughExpectedStates({12, 13, 0, 0});
+  CHECK_TRUE(fusb_mock.fifoEmpty());
+  // Only the Rp change is unmasked while waiting, besides the send results which always are
+  CHECK_EQUAL((uint8_t)~(FUSB_MASK1_M_BC_LVL | FUSB_MASK1_M_COLLISION), fusb_mock.getRegister(FUSB_MASK1));
+  // Once it moves to SinkTxOk the Get_Source_Cap goes out
+  fusb_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ok);
+  fusb_mock.setRegister(FUSB_INTERRUPT, FUSB_INTERRUPT_I_BC_LVL);
+  pe.IRQOccured();
+  fusb_mock.setRegister(FUSB_INTERRUPT, 0);
+  iterateThoughExpectedStates({30, 0, 0});
+  uint8_t getSourceCap[5 + 2 + 4];
+  CHECK_TRUE(fusb_mock.readFiFo(sizeof(getSourceCap), getSourceCap));
+  CHECK_TRUE(fusb_mock.fifoEmpty());
+  CHECK_EQUAL(PD_MSGTYPE_GET_SOURCE_CAP, getSourceCap[5] & PD_HDR_MSGTYPE);
+}
+
+// An engine on a mock of its own, with a clock the tests move on
+MockFUSB302 unresponsive_mock;
+TICK_TYPE   unresponsive_time = 0;
+bool        unresponsive_read(const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) { return unresponsive_mock.i2cRead(deviceAddress, address, size, buf); }
+bool        unresponsive_write(const uint8_t deviceAddress, const uint8_t address, const uint8_t size, uint8_t *buf) { return unresponsive_mock.i2cWrite(deviceAddress, address, size, buf); }
+TICK_TYPE   unresponsive_timestamp() { return unresponsive_time; }
+void        unresponsive_delay(TICK_TYPE milliseconds) { FAIL("The policy engine should never block"); }
+FUSB302     unresponsive_fusb = FUSB302(FUSB302B_ADDR, unresponsive_read, unresponsive_write, mock_delay);
+
+const uint8_t message_5v_capabilities[] = {FUSB_FIFO_RX_SOP, 0xA1, 0x11, 0x2c, 0x91, 0x01, 0x08, 0, 0, 0, 0}; // Fixed 5V @ 3A
+
+void injectCapabilities(PolicyEngine &engine) {
+  unresponsive_mock.addToFIFO(sizeof(message_5v_capabilities), message_5v_capabilities);
+  unresponsive_mock.setRegister(FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  engine.IRQOccured();
+  unresponsive_mock.setRegister(FUSB_INTERRUPTB, 0);
+  while (engine.thread()) {
+  }
+}
+
+void failRequest(PolicyEngine &engine) {
+  // Source offers 5V, the request goes out but is never acknowledged
+  injectCapabilities(engine);
+  unresponsive_mock.resetFiFo();
+  unresponsive_mock.setRegister(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_RETRYFAIL);
+  engine.IRQOccured();
+  unresponsive_mock.setRegister(FUSB_INTERRUPTA, 0);
+  while (engine.thread()) {
+  }
+  // If built to signal hard resets, let those waits run out
+  unresponsive_time += PD_T_HARD_RESET_COMPLETE + 1;
+  while (engine.thread()) {
+  }
+  unresponsive_time += PD_T_SAFE_0V + 1;
+  while (engine.thread()) {
+  }
+}
+
+TEST(PD, UnresponsiveSourceDoesNotBlock) {
+  unresponsive_mock.reset();
+  unresponsive_time = 0;
+  PolicyEngine engine(unresponsive_fusb, unresponsive_timestamp, unresponsive_delay, pdbs_dpm_get_sink_capability, pdbs_dpm_evaluate_capability, EPREvaluateCapabilityFunc, 0);
+  while (engine.thread()) {
+  }
+  // Every hard reset fails too, until we give up on the source
+  for (int i = 0; i <= PD_N_HARD_RESET_COUNT + 1; i++) {
+    failRequest(engine);
+  }
+  CHECK_EQUAL(PolicyEngine::PESinkSourceUnresponsive, engine.currentStateCode(true));
+  CHECK_FALSE(engine.pdHasNegotiated());
+  CHECK_TRUE(engine.setupCompleteOrTimedOut(0));
+  // Nothing to do until the re-probe is due
+  CHECK_FALSE(engine.thread());
+  unresponsive_time += PD_T_PD_DEBOUNCE + 1;
+  while (engine.thread()) {
+  }
+  CHECK_EQUAL(PolicyEngine::PESinkSourceUnresponsive, engine.currentStateCode(true));
+
+  // A change in Rp means a new source, so start over
+  unresponsive_mock.setRegister(FUSB_STATUS0, fusb_tcc_3_0);
+  unresponsive_time += PD_T_PD_DEBOUNCE + 1;
+  CHECK_TRUE(engine.thread());
+  CHECK_TRUE(engine.thread());
+  CHECK_EQUAL(PolicyEngine::PESinkStartup, engine.currentStateCode());
+  while (engine.thread()) {
+  }
+  CHECK_EQUAL(PolicyEngine::PESinkWaitCap, engine.currentStateCode(true));
+}
+
+TEST(PD, UnresponsiveSourceStartsTalking) {
+  unresponsive_mock.reset();
+  unresponsive_time = 0;
+  PolicyEngine engine(unresponsive_fusb, unresponsive_timestamp, unresponsive_delay, pdbs_dpm_get_sink_capability, pdbs_dpm_evaluate_capability, EPREvaluateCapabilityFunc, 0);
+  while (engine.thread()) {
+  }
+  for (int i = 0; i <= PD_N_HARD_RESET_COUNT + 1; i++) {
+    failRequest(engine);
+  }
+  CHECK_EQUAL(PolicyEngine::PESinkSourceUnresponsive, engine.currentStateCode(true));
+  // Capabilities arriving are evaluated straight away, and our request is on its way
+  injectCapabilities(engine);
+  CHECK_EQUAL(PolicyEngine::PEWaitingMessageTx, engine.currentStateCode(true));
+  // It talking again is a fresh start, so it gets the full count of hard resets before being given up on
+  unresponsive_mock.resetFiFo();
+  unresponsive_mock.setRegister(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_RETRYFAIL);
+  engine.IRQOccured();
+  unresponsive_mock.setRegister(FUSB_INTERRUPTA, 0);
+  while (engine.thread()) {
+  }
+  unresponsive_time += PD_T_HARD_RESET_COMPLETE + 1;
+  while (engine.thread()) {
+  }
+  unresponsive_time += PD_T_SAFE_0V + 1;
+  while (engine.thread()) {
+  }
+  CHECK_EQUAL(PolicyEngine::PESinkWaitCap, engine.currentStateCode(true));
 }
@@ -0,0 +1,175 @@
+#include "CppUTest/TestHarness.h"
+#include "fusb302b.h"
+#include "pd.h"
+#include "power_arbiter.h"
+#include "user_functions.hpp"
+#include <cstring>
+#include <stdint.h>
+TEST_GROUP(ARBITER){};
+
+static uint32_t fixedPDO(uint32_t mv, uint32_t ma) { return PD_PDO_TYPE_FIXED | ((PD_MV2PDV(mv) << PD_PDO_SRC_FIXED_VOLTAGE_SHIFT) & PD_PDO_SRC_FIXED_VOLTAGE) | PD_MA2PDI(ma); }
+static uint32_t ppsAPDO(uint32_t min_mv, uint32_t max_mv, uint32_t ma) {
+  return PD_PDO_TYPE_AUGMENTED | PD_APDO_TYPE_PPS | PD_APDO_PPS_MAX_VOLTAGE_SET(PD_MV2PAV(max_mv)) | PD_APDO_PPS_MIN_VOLTAGE_SET(PD_MV2PAV(min_mv)) | PD_APDO_PPS_CURRENT_SET(PD_MA2PAI(ma));
+}
+static void makeCaps(pd_msg *caps, const uint32_t *pdos, uint8_t count) {
+  memset(caps, 0, sizeof(pd_msg));
+  caps->hdr = PD_MSGTYPE_SOURCE_CAPABILITIES | PD_NUMOBJ(count);
+  memcpy(caps->obj, pdos, count * 4);
+}
+
+static const PowerArbiter::port_limits defaultLimits = {5000, 20000, 5000, 100000};
+
+TEST(ARBITER, SinglePortTakesBestOption) {
+  PowerArbiter arbiter(140000);
+  uint8_t      port = arbiter.addPort(nullptr, defaultLimits);
+  CHECK_EQUAL(0, port);
+
+  const uint32_t pdos[] = {fixedPDO(5000, 3000), fixedPDO(9000, 3000), fixedPDO(20000, 3000)};
+  pd_msg         caps, request;
+  makeCaps(&caps, pdos, 3);
+  CHECK_TRUE(arbiter.evaluateCapability(port, &caps, &request));
+  CHECK_EQUAL(PD_MSGTYPE_REQUEST, PD_MSGTYPE_GET(&request));
+  CHECK_EQUAL(3, PD_RDO_OBJPOS_GET(&request));
+  CHECK_EQUAL(PD_MA2PDI(3000), (request.obj[0] & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT);
+  CHECK_EQUAL(60000, arbiter.allocatedPower(port));
+}
+
+TEST(ARBITER, SplitsBudgetAcrossPorts) {
+  PowerArbiter arbiter(140000);
+  uint8_t      port0 = arbiter.addPort(nullptr, defaultLimits);
+  uint8_t      port1 = arbiter.addPort(nullptr, defaultLimits);
+
+  const uint32_t pdos[] = {fixedPDO(5000, 3000), fixedPDO(20000, 5000)};
+  pd_msg         caps, request;
+  makeCaps(&caps, pdos, 2);
+  CHECK_TRUE(arbiter.evaluateCapability(port0, &caps, &request));
+  // Alone, the first port can take its full 100W
+  CHECK_EQUAL(100000, arbiter.allocatedPower(port0));
+
+  CHECK_TRUE(arbiter.evaluateCapability(port1, &caps, &request));
+  CHECK_EQUAL(70000, arbiter.allocatedPower(port0));
+  CHECK_EQUAL(70000, arbiter.allocatedPower(port1));
+  CHECK_EQUAL(140000, arbiter.totalAllocatedPower());
+  // Until the first port has come down to its share the second only gets what is left, 40W at 20V
+  CHECK_EQUAL(2, PD_RDO_OBJPOS_GET(&request));
+  CHECK_EQUAL(PD_MA2PDI(2000), (request.obj[0] & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT);
+  CHECK_TRUE(arbiter.evaluateCapability(port0, &caps, &request));
+  CHECK_EQUAL(PD_MA2PDI(3500), (request.obj[0] & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT);
+  // Then 70W at 20V
+  CHECK_TRUE(arbiter.evaluateCapability(port1, &caps, &request));
+  CHECK_EQUAL(2, PD_RDO_OBJPOS_GET(&request));
+  CHECK_EQUAL(PD_MA2PDI(3500), (request.obj[0] & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT);
+  CHECK_EQUAL(PD_MA2PDI(3500), (request.obj[0] & PD_RDO_FV_MAX_CURRENT) >> PD_RDO_FV_MAX_CURRENT_SHIFT);
+}
+
+TEST(ARBITER, SmallSourceLeavesRestToOthers) {
+  PowerArbiter arbiter(140000);
+  uint8_t      port0 = arbiter.addPort(nullptr, defaultLimits);
+  uint8_t      port1 = arbiter.addPort(nullptr, defaultLimits);
+
+  const uint32_t bigPdos[]   = {fixedPDO(5000, 3000), fixedPDO(20000, 5000)};
+  const uint32_t smallPdos[] = {fixedPDO(5000, 3000)};
+  pd_msg         caps, request;
+  makeCaps(&caps, bigPdos, 2);
+  arbiter.evaluateCapability(port0, &caps, &request);
+  makeCaps(&caps, smallPdos, 1);
+  arbiter.evaluateCapability(port1, &caps, &request);
+  CHECK_EQUAL(15000, arbiter.allocatedPower(port1));
+  // The big port is only limited by its own maximum
+  CHECK_EQUAL(100000, arbiter.allocatedPower(port0));
+}
+
+TEST(ARBITER, PortChangesAreIncremental) {
+  PowerArbiter arbiter(140000);
+  uint8_t      port0 = arbiter.addPort(nullptr, defaultLimits);
+  uint8_t      port1 = arbiter.addPort(nullptr, defaultLimits);
+
+  const uint32_t pdos[] = {fixedPDO(5000, 3000), fixedPDO(20000, 5000)};
+  pd_msg         caps, request;
+  makeCaps(&caps, pdos, 2);
+  arbiter.evaluateCapability(port0, &caps, &request);
+  arbiter.evaluateCapability(port1, &caps, &request);
+  // Unchanged capabilities keep the current split
+  arbiter.evaluateCapability(port0, &caps, &request);
+  CHECK_EQUAL(70000, arbiter.allocatedPower(port0));
+  CHECK_EQUAL(70000, arbiter.allocatedPower(port1));
+
+  // Removing a port hands its share back
+  arbiter.portDetached(port1);
+  CHECK_EQUAL(0, arbiter.allocatedPower(port1));
+  CHECK_EQUAL(100000, arbiter.allocatedPower(port0));
+
+  arbiter.setSystemLimit(60000);
+  CHECK_EQUAL(60000, arbiter.allocatedPower(port0));
+}
+
+TEST(ARBITER, PPSUsesHighestAllowedVoltage) {
+  PowerArbiter                    arbiter(140000);
+  const PowerArbiter::port_limits limits = {5000, 15000, 3000, 100000};
+  uint8_t                         port   = arbiter.addPort(nullptr, limits);
+
+  const uint32_t pdos[] = {fixedPDO(5000, 3000), fixedPDO(20000, 3000), ppsAPDO(3300, 21000, 3000)};
+  pd_msg         caps, request;
+  makeCaps(&caps, pdos, 3);
+  arbiter.evaluateCapability(port, &caps, &request);
+  // 20V is out of range for the load, so PPS at 15V wins over 5V
+  CHECK_EQUAL(3, PD_RDO_OBJPOS_GET(&request));
+  CHECK_EQUAL(PD_MV2PRV(15000), (request.obj[0] & PD_RDO_PROG_VOLTAGE) >> PD_RDO_PROG_VOLTAGE_SHIFT);
+  CHECK_EQUAL(3000 / 50, (request.obj[0] & PD_RDO_PROG_CURRENT) >> PD_RDO_PROG_CURRENT_SHIFT);
+  CHECK_EQUAL(45000, arbiter.allocatedPower(port));
+}
+
+TEST(ARBITER, NothingUsableRequestsMinimum) {
+  PowerArbiter                    arbiter(140000);
+  const PowerArbiter::port_limits limits = {12000, 20000, 3000, 100000};
+  uint8_t                         port   = arbiter.addPort(nullptr, limits);
+
+  const uint32_t pdos[] = {fixedPDO(5000, 3000)};
+  pd_msg         caps, request;
+  makeCaps(&caps, pdos, 1);
+  CHECK_TRUE(arbiter.evaluateCapability(port, &caps, &request));
+  CHECK_EQUAL(1, PD_RDO_OBJPOS_GET(&request));
+  CHECK_TRUE(request.obj[0] & PD_RDO_CAP_MISMATCH);
+  CHECK_EQUAL(0, arbiter.allocatedPower(port));
+}
+
+// Only the command mailbox of these engines is used, they never touch the bus
+static bool     arbiterRead(const uint8_t, const uint8_t, const uint8_t, uint8_t *) { return false; }
+static bool     arbiterWrite(const uint8_t, const uint8_t, const uint8_t, uint8_t *) { return false; }
+static void     arbiterDelay(uint32_t) {}
+static uint32_t arbiterTime() { return 0; }
+
+TEST(ARBITER, RaisesOnlyOnceOthersHaveLowered) {
+  FUSB302      fusb(FUSB302B_ADDR, arbiterRead, arbiterWrite, arbiterDelay);
+  PolicyEngine pe0(fusb, arbiterTime, arbiterDelay, pdbs_dpm_get_sink_capability, pdbs_dpm_evaluate_capability, EPREvaluateCapabilityFunc, 0);
+  PolicyEngine pe1(fusb, arbiterTime, arbiterDelay, pdbs_dpm_get_sink_capability, pdbs_dpm_evaluate_capability, EPREvaluateCapabilityFunc, 0);
+  PowerArbiter arbiter(140000);
+  uint8_t      port0 = arbiter.addPort(&pe0, defaultLimits);
+  uint8_t      port1 = arbiter.addPort(&pe1, defaultLimits);
+
+  const uint32_t pdos[] = {fixedPDO(5000, 3000), fixedPDO(20000, 5000)};
+  pd_msg         caps, request;
+  makeCaps(&caps, pdos, 2);
+  arbiter.evaluateCapability(port0, &caps, &request);
+  arbiter.contractChanged(port0, 20000, 5000);
+
+  // The second port is only given what the first leaves free, and the first is asked through its mailbox to come down
+  arbiter.evaluateCapability(port1, &caps, &request);
+  CHECK_EQUAL(PD_MA2PDI(2000), (request.obj[0] & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT);
+  arbiter.contractChanged(port1, 20000, 2000);
+  CHECK_TRUE(arbiter.isRenegotiating(port0));
+  CHECK_TRUE(pd_command_status::Pending == pe0.commandStatus(pd_command::Renegotiate));
+  CHECK_TRUE(pd_command_status::Idle == pe1.commandStatus(pd_command::Renegotiate));
+
+  // Its lower request is not enough, the old contract holds until the source has agreed the new one
+  arbiter.evaluateCapability(port0, &caps, &request);
+  CHECK_EQUAL(PD_MA2PDI(3500), (request.obj[0] & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT);
+  CHECK_FALSE(arbiter.isRenegotiating(port1));
+  arbiter.contractChanged(port0, 20000, 3500);
+  CHECK_TRUE(arbiter.isRenegotiating(port1));
+  CHECK_TRUE(pd_command_status::Pending == pe1.commandStatus(pd_command::Renegotiate));
+
+  arbiter.evaluateCapability(port1, &caps, &request);
+  CHECK_EQUAL(PD_MA2PDI(3500), (request.obj[0] & PD_RDO_FV_CURRENT) >> PD_RDO_FV_CURRENT_SHIFT);
+  CHECK_FALSE(arbiter.isRenegotiating(port1));
+}
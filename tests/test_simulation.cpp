@@ -0,0 +1,324 @@
+#include "CppUTest/TestHarness.h"
+#include "pd_simulator.h"
+#include <stdint.h>
+// Long runs against an emulated source in virtual time
+TEST_GROUP(SIMULATION){};
+
+TEST(SIMULATION, NegotiatesOnAttach) {
+  PDSimulator sim;
+  sim.attach();
+  sim.runFor(1000);
+  CHECK_TRUE(sim.pe.pdHasNegotiated());
+  // The DPM picks the PPS supply at its maximum
+  pd_contract contract = sim.pe.getContract();
+  CHECK_TRUE(pd_pdo_kind::PPS == contract.kind);
+  CHECK_EQUAL(11000, contract.millivolts);
+  // Capabilities at 150ms are answered straight away, the Accept follows the GoodCRC and PS_RDY 35ms after that
+  CHECK_EQUAL(150 + 1 + 2 + 35, contract.established);
+  CHECK_EQUAL(1, sim.getStats().requests);
+  CHECK_TRUE(sim.getStats().maxCapsLatency <= 1);
+  // One interrupt for each message either way: Source_Capabilities, our Request going out, Accept and PS_RDY
+  CHECK_EQUAL(4, sim.getStats().wakeups);
+}
+
+TEST(SIMULATION, BusTimePerNegotiation) {
+  PDSimulator fast;
+  fast.attach();
+  fast.runFor(1000);
+  // A little over 4ms of bus time at 400kHz, from attach to PS_RDY
+  const uint64_t at400k = fast.getStats().busNanoseconds;
+  CHECK_TRUE(at400k < 5000 * 1000);
+  PDSimulator slow;
+  slow.setBusClock(100000);
+  slow.attach();
+  slow.runFor(1000);
+  // The same transfers, each clock four times longer
+  CHECK_TRUE(slow.pe.pdHasNegotiated());
+  CHECK_EQUAL(4 * at400k, slow.getStats().busNanoseconds);
+}
+
+TEST(SIMULATION, GatedInterruptsSaveWakeups) {
+  PDSimulator gated;
+  PDSimulator ungated;
+  ungated.leaveInterruptsUnmasked();
+  PDSimulator *sims[] = {&gated, &ungated};
+  for (PDSimulator *sim : sims) {
+    sim->attach();
+    sim->runFor(2000);
+    CHECK_TRUE(sim->pe.postCommand(pd_command::Renegotiate));
+    sim->runFor(2000);
+    CHECK_TRUE(pd_command_status::Done == sim->pe.commandStatus(pd_command::Renegotiate));
+  }
+  // One for each message either way: four to negotiate, then the Get_Source_Cap going out and the same four again
+  CHECK_EQUAL(4 + 5, gated.getStats().wakeups);
+  // With everything unmasked the CC activity flagged ahead of each of them wakes the application as well
+  CHECK_EQUAL(2 * (4 + 5), ungated.getStats().wakeups);
+}
+
+TEST(SIMULATION, HourOnPPS) {
+  PDSimulator sim;
+  sim.attach();
+  sim.runFor(60UL * 60 * 1000);
+  const PDSimulator::Stats &stats = sim.getStats();
+  CHECK_TRUE(sim.pe.pdHasNegotiated());
+  CHECK_EQUAL(0, stats.hardResets);
+  CHECK_EQUAL(0, stats.busyLimitHits);
+#ifndef PD_DISABLE_PPS
+  // Re-requested every 8s, inside the source's 10s tPPSRequest even when a step runs late
+  CHECK_TRUE(stats.requests >= 60 * 60 * 1000 / (PD_T_PPS_REREQUEST + 100));
+  CHECK_TRUE(stats.maxRequestGap <= PD_T_PPS_REREQUEST + 100);
+  // A status read, then the FIFO only when a message waits, and each send one write, so a re-request AMS is about 15 bus transfers
+  CHECK_TRUE(stats.busTransactions < 17 * stats.requests);
+#else
+  CHECK_EQUAL(1, stats.requests);
+#endif
+  // The cost of an hour, mostly one thread() run for each 100ms TimersCallback() and about 25 for each re-request
+  CHECK_TRUE(stats.engineRuns < 50000);
+}
+
+TEST(SIMULATION, SourceSoftReset) {
+  PDSimulator sim;
+  sim.attach();
+  sim.runFor(1000);
+  const TICK_TYPE resetAt = sim.now();
+  sim.sourceSoftReset();
+  sim.runFor(2000);
+  // Back to a fresh contract from the capabilities that follow
+  CHECK_TRUE(sim.pe.pdHasNegotiated());
+  CHECK_TRUE(sim.pe.getContract().established > resetAt);
+}
+
+TEST(SIMULATION, SourceHardReset) {
+  PDSimulator sim;
+  sim.attach();
+  sim.runFor(1000);
+  // Each renegotiation is three messages from the source, so the last PS_RDY is MessageID 0
+  for (int i = 0; i < 2; i++) {
+    const uint32_t wakeups = sim.getStats().wakeups;
+    CHECK_TRUE(sim.pe.postCommand(pd_command::Renegotiate));
+    sim.runFor(1000);
+    // Get_Source_Cap going out, then the same four as on attach
+    CHECK_EQUAL(5, sim.getStats().wakeups - wakeups);
+  }
+  const TICK_TYPE resetAt = sim.now();
+  const uint32_t  wakeups = sim.getStats().wakeups;
+  sim.sourceHardReset();
+  sim.runFor(2000);
+  // The sink goes back to its default state and takes the capabilities sent once VBUS is back, MessageID 0 as well
+  CHECK_TRUE(sim.timeOfState(16, resetAt) != 0);
+  CHECK_TRUE(sim.pe.hasExplicitContract());
+  CHECK_TRUE(sim.pe.getContract().established > resetAt);
+  CHECK_EQUAL(0, sim.getStats().softResets);
+  CHECK_EQUAL(0, sim.getStats().hardResets);
+  // The Hard Reset and the negotiation after it, with the PHY reset on the way the masks are set again rather than left as they were
+#ifdef PD_SEND_HARD_RESET
+  // Waiting out the VBUS cycle wants both edges
+  CHECK_EQUAL(1 + 2 + 4, sim.getStats().wakeups - wakeups);
+#else
+  CHECK_EQUAL(1 + 4, sim.getStats().wakeups - wakeups);
+#endif
+}
+
+TEST(SIMULATION, MissingPSRDYTimesOut) {
+  PDSimulator sim;
+  sim.dropNextPSRDY();
+  sim.attach();
+  sim.runFor(1000);
+  const TICK_TYPE accepted = sim.timeOfState(11);
+  CHECK_TRUE(accepted != 0);
+  CHECK_FALSE(sim.pe.hasExplicitContract());
+  // The sink gives up on PS_RDY after tPSTransition, and not before
+  sim.runFor(PD_T_PS_TRANSITION);
+  const TICK_TYPE softReset = sim.timeOfState(18, accepted);
+  CHECK_EQUAL(accepted + PD_T_PS_TRANSITION + 1, softReset);
+  // The source accepts the Soft_Reset and the contract is negotiated again, without starting over
+  sim.runFor(PD_T_SENDER_RESPONSE + 1);
+  CHECK_EQUAL(1, sim.getStats().softResets);
+  CHECK_TRUE(sim.pe.hasExplicitContract());
+  CHECK_TRUE(sim.pe.getContract().established > softReset);
+  CHECK_EQUAL(0, sim.timeOfState(3, softReset));
+}
+
+TEST(SIMULATION, RecoversFromFaults) {
+  const PDSimulator::Fault faults[] = {PDSimulator::Fault::BusNack,       PDSimulator::Fault::ShortRead,      PDSimulator::Fault::StuckFIFO,
+                                      PDSimulator::Fault::LostInterrupt, PDSimulator::Fault::DelayedGoodCRC, PDSimulator::Fault::DroppedMessage,
+                                      PDSimulator::Fault::LostGoodCRC};
+  for (const PDSimulator::Fault fault : faults) {
+    PDSimulator sim;
+    sim.attach();
+    sim.runFor(2000);
+    // The fault hits somewhere in the renegotiation
+    sim.inject(fault);
+    CHECK_TRUE(sim.pe.postCommand(pd_command::Renegotiate));
+    sim.runFor(2000);
+    CHECK_EQUAL(1, sim.recoveries().size());
+    const PDSimulator::Recovery &recovery = sim.recoveries()[0];
+    CHECK_TRUE(recovery.recoveredAt != 0);
+    // At worst a Soft_Reset and a fresh negotiation, never a hard reset or starting over
+    CHECK_TRUE(recovery.recoveredAt - recovery.firedAt < 100);
+    CHECK_TRUE(recovery.softResets <= 1);
+    CHECK_EQUAL(0, recovery.hardResets);
+    CHECK_EQUAL(0, recovery.sourceResets);
+    CHECK_EQUAL(0, recovery.restarts);
+    CHECK_EQUAL(0, sim.getStats().busyLimitHits);
+  }
+}
+
+TEST(SIMULATION, RetransmissionIgnored) {
+  PDSimulator sim;
+  sim.attach();
+  sim.runFor(2000);
+  const PDSimulator::Stats before = sim.getStats();
+  CHECK_TRUE(sim.pe.postCommand(pd_command::Renegotiate));
+  // Once the source has accepted our request, its PS_RDY arrives twice
+  sim.runFor(10);
+  sim.inject(PDSimulator::Fault::LostGoodCRC);
+  sim.runFor(2000);
+  CHECK_TRUE(pd_command_status::Done == sim.pe.commandStatus(pd_command::Renegotiate));
+  // Only the Get_Source_Cap and the Request went to the source, nothing answers the copy
+  CHECK_EQUAL(before.sinkMessages + 2, sim.getStats().sinkMessages);
+  CHECK_EQUAL(before.requests + 1, sim.getStats().requests);
+  CHECK_EQUAL(0, sim.getStats().softResets);
+}
+
+TEST(SIMULATION, RenegotiateDuringAMS) {
+  const TICK_TYPE delays[] = {10, 20, 30};
+  for (const TICK_TYPE delay : delays) {
+    PDSimulator sim;
+    sim.attach();
+    sim.runFor(2000);
+    const PDSimulator::Stats before = sim.getStats();
+    CHECK_TRUE(sim.pe.postCommand(pd_command::Renegotiate));
+    // Asked again while the sink waits for the PS_RDY of the first one
+    sim.runFor(delay);
+    CHECK_EQUAL(SimPolicyEngine::PESinkTransitionSink, sim.pe.currentStateCode(true));
+    sim.pe.renegotiate();
+    sim.runFor(2000);
+    CHECK_TRUE(sim.pe.hasExplicitContract());
+    CHECK_EQUAL(before.requests + 2, sim.getStats().requests);
+    CHECK_EQUAL(0, sim.getStats().softResets);
+  }
+}
+
+TEST(SIMULATION, RetransmittedCapabilitiesIgnored) {
+  PDSimulator sim;
+  // The source misses our GoodCRC for its first Source_Capabilities and sends it again
+  sim.inject(PDSimulator::Fault::LostGoodCRC);
+  sim.attach();
+  sim.runFor(1000);
+  CHECK_TRUE(sim.pe.pdHasNegotiated());
+  CHECK_EQUAL(150 + 1 + 2 + 35, sim.pe.getContract().established);
+  // The copy has the same MessageID, so it is dropped without waking the engine
+  CHECK_EQUAL(1, sim.getStats().requests);
+  PDSimulator clean;
+  clean.attach();
+  clean.runFor(1000);
+  CHECK_EQUAL(clean.getStats().engineWakes, sim.getStats().engineWakes);
+  CHECK_EQUAL(0, sim.getStats().softResets);
+  CHECK_EQUAL(0, sim.getStats().hardResets);
+}
+
+TEST(SIMULATION, LateEngineKeepsTxResult) {
+  PDSimulator sim;
+  // thread() only gets to run well after PD_T_TX_RESULT of being woken, the GoodCRC for each send is already in
+  sim.timing.engineDelay = PD_T_TX_RESULT + 10;
+  sim.attach();
+  sim.runFor(2000);
+  CHECK_TRUE(sim.pe.pdHasNegotiated());
+  CHECK_TRUE(sim.pe.postCommand(pd_command::Renegotiate));
+  sim.runFor(2000);
+  CHECK_TRUE(pd_command_status::Done == sim.pe.commandStatus(pd_command::Renegotiate));
+  CHECK_EQUAL(2, sim.getStats().requests);
+  CHECK_EQUAL(0, sim.getStats().softResets);
+  CHECK_EQUAL(0, sim.getStats().hardResets);
+}
+
+#ifndef PD_DISABLE_EPR
+TEST(SIMULATION, EPRKeepAlive) {
+  PDSimulator sim(true, 140);
+  sim.attach();
+  sim.runFor(2000);
+  CHECK_TRUE(sim.sourceInEPR());
+  CHECK_TRUE(sim.pe.pdIsEpr());
+  sim.runFor(10UL * 60 * 1000);
+  const PDSimulator::Stats &stats = sim.getStats();
+  // The source drops out of EPR if it hears nothing for tSourceEPRKeepAlive (750ms at the least)
+  CHECK_TRUE(stats.eprKeepAlives > 1000);
+  CHECK_TRUE(stats.maxEPRGap < 750);
+  CHECK_TRUE(sim.pe.pdIsEpr());
+  // Waiting for each ACK sleeps rather than spinning
+  CHECK_EQUAL(0, stats.busyLimitHits);
+  CHECK_TRUE(stats.engineRuns < 20 * stats.eprKeepAlives);
+}
+
+#ifndef PD_DISABLE_PPS
+TEST(SIMULATION, EPRWithPPS) {
+  PDSimulator sim(true, 140);
+  sim.requestPPSInEPR();
+  sim.attach();
+  sim.runFor(2000);
+  CHECK_TRUE(sim.pe.pdIsEpr());
+  CHECK_TRUE(pd_pdo_kind::PPS == sim.pe.getContract().kind);
+  const PDSimulator::Stats before = sim.getStats();
+  sim.runFor(10UL * 60 * 1000);
+  const PDSimulator::Stats &stats = sim.getStats();
+  CHECK_TRUE(sim.pe.pdIsEpr());
+  CHECK_EQUAL(0, stats.hardResets);
+  CHECK_TRUE(stats.maxEPRGap < 750);
+  CHECK_TRUE(stats.maxRequestGap <= PD_T_PPS_REREQUEST + 100);
+  // Each PPS request keeps EPR mode alive too, so no keepalive follows within a period of one
+  const uint32_t requests   = stats.requests - before.requests;
+  const uint32_t keepAlives = stats.eprKeepAlives - before.eprKeepAlives;
+  CHECK_TRUE(requests >= 10 * 60 * 1000 / (PD_T_PPS_REREQUEST + 100));
+  CHECK_TRUE(requests + keepAlives <= 10 * 60 * 1000 / PD_T_EPR_KEEPALIVE + 1);
+  CHECK_EQUAL(0, stats.busyLimitHits);
+}
+#endif
+
+TEST(SIMULATION, EPRKeepAliveUnanswered) {
+  PDSimulator sim(true, 140);
+  sim.attach();
+  sim.runFor(2000);
+  CHECK_TRUE(sim.pe.pdIsEpr());
+  // One lost ACK is put right by sending the keepalive again, well before the source gives up on EPR mode
+  sim.dropNextKeepAliveAck();
+  const uint32_t runs = sim.getStats().engineRuns;
+  sim.runFor(2 * PD_T_EPR_KEEPALIVE + 500);
+  CHECK_TRUE(sim.pe.pdIsEpr());
+  CHECK_TRUE(sim.sourceInEPR());
+  CHECK_EQUAL(0, sim.getStats().hardResets + sim.timeOfState(15));
+  CHECK_EQUAL(0, sim.getStats().sourceResets);
+  CHECK_TRUE(sim.getStats().maxEPRGap < 750);
+  CHECK_TRUE(sim.getStats().engineRuns - runs < 200);
+  // With none answered either the sink gives up with a hard reset, inside the source's tSourceEPRKeepAlive
+  const TICK_TYPE lost = sim.now();
+  sim.dropNextKeepAliveAck();
+  sim.dropNextKeepAliveAck();
+  sim.runFor(2 * PD_T_EPR_KEEPALIVE + 500);
+  const TICK_TYPE hardReset = sim.timeOfState(15, lost);
+  CHECK_TRUE(hardReset != 0);
+  CHECK_TRUE(hardReset - lost <= PD_T_EPR_KEEPALIVE + 2 * PD_T_EPR_KEEPALIVE_ACK + 10);
+  CHECK_TRUE(PD_T_EPR_KEEPALIVE + 2 * PD_T_EPR_KEEPALIVE_ACK < 750);
+  CHECK_TRUE(sim.getStats().maxEPRGap < 750);
+  CHECK_EQUAL(0, sim.getStats().busyLimitHits);
+}
+
+TEST(SIMULATION, EPRKeepAliveLateEngine) {
+  PDSimulator sim(true, 140);
+  sim.attach();
+  sim.runFor(2000);
+  CHECK_TRUE(sim.pe.pdIsEpr());
+  // Running late, past PD_T_TX_RESULT, with a source that is slower still to ACK. The wait for
+  // each ACK counts from its keepalive and not from any earlier timer
+  sim.timing.engineDelay          = PD_T_TX_RESULT + 10;
+  sim.timing.response             = PD_T_TX_RESULT + 20;
+  const PDSimulator::Stats before = sim.getStats();
+  sim.runFor(60UL * 1000);
+  const PDSimulator::Stats &stats = sim.getStats();
+  CHECK_TRUE(sim.pe.pdIsEpr());
+  CHECK_EQUAL(0, stats.hardResets + stats.sourceResets);
+  CHECK_TRUE(stats.maxEPRGap < 750);
+  // No keepalive was sent again for want of an ACK
+  CHECK_TRUE(stats.eprKeepAlives - before.eprKeepAlives <= 60UL * 1000 / PD_T_EPR_KEEPALIVE + 1);
+}
+#endif
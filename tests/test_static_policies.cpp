@@ -0,0 +1,61 @@
+#include "CppUTest/TestHarness.h"
+#include "fusb302_defines.h"
+#include "mock_fusb302.h"
+#include "policy_engine_impl.h"
+#include "user_functions.hpp"
+#include <stdint.h>
+// Exercise the template form of the driver and policy engine with static policies
+TEST_GROUP(STATIC){};
+static MockFUSB302 static_mock;
+static TICK_TYPE   static_time = 0;
+
+struct StaticBus {
+  static bool read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return static_mock.i2cRead(FUSB302B_ADDR, registerAdd, size, buf); }
+  static bool write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return static_mock.i2cWrite(FUSB302B_ADDR, registerAdd, size, buf); }
+  static void delay(uint32_t milliseconds) {}
+};
+struct StaticPlatform {
+  static TICK_TYPE getTimeStamp() { return static_time; }
+  static void      delay(TICK_TYPE milliseconds) { FAIL("The policy engine should never block"); }
+};
+struct StaticDpm {
+  static bool evaluateCapability(const pd_msg *capabilities, pd_msg *request) { return pdbs_dpm_evaluate_capability(capabilities, request); }
+  static bool evaluateEPRCapability(const epr_pd_msg *capabilities, pd_msg *request) { return false; }
+  static void getSinkCapability(pd_msg *cap, const bool isPD3) { pdbs_dpm_get_sink_capability(cap, isPD3); }
+};
+typedef FUSB302T<StaticBus>                                  StaticFUSB302;
+typedef PolicyEngineT<StaticPlatform, StaticDpm, StaticFUSB302> StaticPolicyEngine;
+
+TEST(STATIC, PoliciesTakeNoStorage) {
+  // Only the runtime wrappers carry function pointers around
+  CHECK_TRUE(sizeof(StaticFUSB302) < sizeof(FUSB302));
+  CHECK_TRUE(sizeof(StaticPolicyEngine) < sizeof(PolicyEngine));
+}
+
+TEST(STATIC, DriverSetup) {
+  static_mock.reset();
+  StaticFUSB302 f;
+  CHECK_TRUE(f.fusb_read_id());
+  CHECK_TRUE(f.fusb_setup());
+  CHECK_EQUAL(0x0F, static_mock.getRegister(FUSB_POWER));
+}
+
+TEST(STATIC, EngineSendsRequest) {
+  static_mock.reset();
+  StaticPolicyEngine pe(StaticFUSB302(), 0);
+  while (pe.thread()) {
+  }
+  // Fixed 5V @ 3A
+  const uint8_t caps[] = {FUSB_FIFO_RX_SOP, 0xA1, 0x11, 0x2c, 0x91, 0x01, 0x08, 0, 0, 0, 0};
+  static_mock.addToFIFO(sizeof(caps), caps);
+  static_mock.setRegister(FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  CHECK_TRUE(pe.IRQOccured());
+  while (pe.thread()) {
+  }
+  // SOP tokens, a one object request, then the CRC/EOP tokens
+  uint8_t sent[5 + 6 + 4];
+  CHECK_TRUE(static_mock.readFiFo(sizeof(sent), sent));
+  CHECK_TRUE(static_mock.fifoEmpty());
+  CHECK_EQUAL(FUSB_FIFO_TX_PACKSYM | 6, sent[4]);
+  CHECK_EQUAL(PD_MSGTYPE_REQUEST, sent[5] & PD_HDR_MSGTYPE);
+}
@@ -0,0 +1,52 @@
+#include "CppUTest/TestHarness.h"
+#include "pd_timers.h"
+#include <stdint.h>
+TEST_GROUP(TIMERS){};
+
+TEST(TIMERS, ExpiresAfterItsDuration) {
+  TimerService<uint32_t, 2> timers;
+  CHECK_FALSE(timers.running(0));
+  CHECK_FALSE(timers.expired(0, 1000));
+  timers.start(0, 100, 50);
+  CHECK_TRUE(timers.running(0));
+  CHECK_EQUAL(50, timers.remaining(0, 100));
+  CHECK_EQUAL(51, timers.untilNext(100));
+  // Expired once more than the duration has passed
+  CHECK_FALSE(timers.expired(0, 150));
+  CHECK_EQUAL(0, timers.remaining(0, 150));
+  CHECK_EQUAL(1, timers.untilNext(150));
+  CHECK_TRUE(timers.expired(0, 151));
+  CHECK_EQUAL(0, timers.untilNext(151));
+  timers.stop(0);
+  CHECK_FALSE(timers.expired(0, 151));
+  CHECK_EQUAL(0xFFFFFFFF, timers.untilNext(151));
+}
+
+TEST(TIMERS, WrapsAround) {
+  // 8 bit ticks wrap every 256, the same as 32 bit ones do after 49 days of milliseconds
+  TimerService<uint8_t, 1> timers;
+  timers.start(0, 250, 20);
+  CHECK_EQUAL(11, timers.elapsed(0, 5));
+  CHECK_EQUAL(9, timers.remaining(0, 5));
+  CHECK_FALSE(timers.expired(0, 14));
+  CHECK_TRUE(timers.expired(0, 15));
+
+  TimerService<uint32_t, 1> ms;
+  ms.start(0, 0xFFFFFFF0, 1000);
+  CHECK_FALSE(ms.expired(0, 0x10));
+  CHECK_EQUAL(1000 - 0x20 + 1, ms.untilNext(0x10));
+  CHECK_TRUE(ms.expired(0, 1000 - 0x10 + 1));
+}
+
+TEST(TIMERS, EarliestOfTheMasked) {
+  TimerService<uint32_t, 3> timers;
+  timers.start(0, 0, 300);
+  timers.start(1, 0, 100);
+  // Only measures elapsed time, so never the next one due
+  timers.start(2, 0, TimerService<uint32_t, 3>::forever);
+  CHECK_EQUAL(101, timers.untilNext(0));
+  CHECK_EQUAL(301, timers.untilNext(0, 1 << 0));
+  CHECK_EQUAL(0xFFFFFFFF, timers.untilNext(0, 1 << 2));
+  CHECK_FALSE(timers.expired(2, 0xFFFFFFFF));
+  CHECK_EQUAL(0xFFFFFFFF, timers.elapsed(2, 0xFFFFFFFF));
+}
@@ -0,0 +1,178 @@
+#include "CppUTest/TestHarness.h"
+#include "fusb302_defines.h"
+#include "mock_fusb302.h"
+#include "policy_engine_impl.h"
+#include "user_functions.hpp"
+#include <pthread.h>
+#include <stdint.h>
+// Driving the engine from its own task, woken only when it has something to do
+TEST_GROUP(WAKEUP){};
+namespace {
+MockFUSB302 wake_mock;
+TICK_TYPE   wake_time = 0;
+
+struct WakeBus {
+  static bool read(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return wake_mock.i2cRead(FUSB302B_ADDR, registerAdd, size, buf); }
+  static bool write(const uint8_t registerAdd, const uint8_t size, uint8_t *buf) { return wake_mock.i2cWrite(FUSB302B_ADDR, registerAdd, size, buf); }
+  static void delay(uint32_t milliseconds) {}
+};
+struct WakePlatform {
+  static TICK_TYPE getTimeStamp() { return wake_time; }
+  static void      delay(TICK_TYPE milliseconds) { FAIL("The policy engine should never block"); }
+};
+struct WakeDpm {
+  static bool evaluateCapability(const pd_msg *capabilities, pd_msg *request) { return pdbs_dpm_evaluate_capability(capabilities, request); }
+  static bool evaluateEPRCapability(const epr_pd_msg *capabilities, pd_msg *request) { return false; }
+  static void getSinkCapability(pd_msg *cap, const bool isPD3) { pdbs_dpm_get_sink_capability(cap, isPD3); }
+};
+typedef PolicyEngineT<WakePlatform, WakeDpm, FUSB302T<WakeBus>> WakePolicyEngine;
+
+// A counting semaphore, as the PD task would block on in an RTOS
+struct Semaphore {
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t  cond  = PTHREAD_COND_INITIALIZER;
+  int             count = 0;
+  bool            stop  = false;
+};
+struct PDTask {
+  WakePolicyEngine *pe;
+  Semaphore         sem;
+  int               wakeups = 0;
+};
+
+void wake(void *context) {
+  Semaphore *sem = (Semaphore *)context;
+  pthread_mutex_lock(&sem->mutex);
+  sem->count++;
+  pthread_cond_signal(&sem->cond);
+  pthread_mutex_unlock(&sem->mutex);
+}
+void countWake(void *context) { (*(int *)context)++; }
+
+// Runs the engine each time it is woken, until asked to stop with nothing left pending
+void *pdTask(void *arg) {
+  PDTask *task = (PDTask *)arg;
+  for (;;) {
+    pthread_mutex_lock(&task->sem.mutex);
+    while (task->sem.count == 0 && !task->sem.stop) {
+      pthread_cond_wait(&task->sem.cond, &task->sem.mutex);
+    }
+    if (task->sem.count == 0) {
+      pthread_mutex_unlock(&task->sem.mutex);
+      return nullptr;
+    }
+    task->sem.count--;
+    pthread_mutex_unlock(&task->sem.mutex);
+    task->wakeups++;
+    while (task->pe->thread()) {
+    }
+  }
+}
+
+void runUntilIdle(WakePolicyEngine &pe) {
+  while (pe.thread()) {
+  }
+}
+void receive(WakePolicyEngine &pe, const uint8_t *message, uint8_t length) {
+  wake_mock.addToFIFO(length, message);
+  wake_mock.setRegister(FUSB_INTERRUPTB, FUSB_INTERRUPTB_I_GCRCSENT);
+  pe.IRQOccured();
+  wake_mock.setRegister(FUSB_INTERRUPTB, 0);
+  runUntilIdle(pe);
+}
+// Negotiate 5V from a PD 3.0 source
+void negotiate(WakePolicyEngine &pe) {
+  const uint8_t caps[]   = {FUSB_FIFO_RX_SOP, 0xA1, 0x11, 0x2c, 0x91, 0x01, 0x08, 0, 0, 0, 0};
+  const uint8_t accept[] = {FUSB_FIFO_RX_SOP, 0xA3, 0x03, 0, 0, 0, 0};
+  const uint8_t ready[]  = {FUSB_FIFO_RX_SOP, 0xA6, 0x05, 0, 0, 0, 0};
+  runUntilIdle(pe);
+  receive(pe, caps, sizeof(caps));
+  wake_mock.resetFiFo();
+  wake_mock.setRegister(FUSB_INTERRUPTA, FUSB_INTERRUPTA_I_TXSENT);
+  pe.IRQOccured();
+  wake_mock.setRegister(FUSB_INTERRUPTA, 0);
+  runUntilIdle(pe);
+  receive(pe, accept, sizeof(accept));
+  receive(pe, ready, sizeof(ready));
+}
+} // namespace
+
+TEST(WAKEUP, RenegotiateFromAnotherTask) {
+  wake_mock.reset();
+  wake_time = 0;
+  WakePolicyEngine pe(FUSB302T<WakeBus>(), 0);
+  negotiate(pe);
+  CHECK_TRUE(pe.pdHasNegotiated());
+  CHECK_EQUAL(TICK_MAX_DELAY, pe.ticksUntilTimeout());
+
+  PDTask task;
+  task.pe = &pe;
+  pe.setWakeCallback(wake, &task.sem);
+  wake_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ok);
+  pthread_t thread;
+  CHECK_EQUAL(0, pthread_create(&thread, nullptr, pdTask, &task));
+  pe.renegotiate();
+  wake(&task.sem); // Wakes with nothing new must be harmless
+  pthread_mutex_lock(&task.sem.mutex);
+  task.sem.stop = true;
+  pthread_cond_signal(&task.sem.cond);
+  pthread_mutex_unlock(&task.sem.mutex);
+  pthread_join(thread, nullptr);
+
+  CHECK_EQUAL(2, task.wakeups);
+  // The PD task asked the source for its capabilities again
+  uint8_t sent[5 + 2];
+  CHECK_TRUE(wake_mock.readFiFo(sizeof(sent), sent));
+  CHECK_EQUAL(PD_MSGTYPE_GET_SOURCE_CAP, sent[5] & PD_HDR_MSGTYPE);
+  CHECK_EQUAL(1, pe.currentStateCode(true));
+}
+
+TEST(WAKEUP, PendingNotificationWakesOnce) {
+  wake_mock.reset();
+  wake_time = 0;
+  WakePolicyEngine pe(FUSB302T<WakeBus>(), 0);
+  negotiate(pe);
+  int wakes = 0;
+  pe.setWakeCallback(countWake, &wakes);
+  pe.renegotiate();
+  pe.renegotiate();
+  CHECK_EQUAL(1, wakes);
+  // Once thread() has taken it, the next one wakes again
+  wake_mock.setRegister(FUSB_STATUS0, fusb_sink_tx_ok);
+  runUntilIdle(pe);
+  pe.renegotiate();
+  CHECK_EQUAL(2, wakes);
+}
+
+TEST(WAKEUP, TimeUntilTimeout) {
+  wake_mock.reset();
+  wake_time = 100;
+  WakePolicyEngine pe(FUSB302T<WakeBus>(), 0);
+  // Work to do straight away
+  CHECK_EQUAL(0, pe.ticksUntilTimeout());
+  runUntilIdle(pe);
+  // Waiting for source capabilities
+  CHECK_EQUAL(PD_T_TYPEC_SINK_WAIT_CAP + 1, pe.ticksUntilTimeout());
+  wake_time += PD_T_TYPEC_SINK_WAIT_CAP;
+  CHECK_EQUAL(1, pe.ticksUntilTimeout());
+  CHECK_FALSE(pe.thread());
+  wake_time++;
+  CHECK_EQUAL(0, pe.ticksUntilTimeout());
+  CHECK_TRUE(pe.thread());
+}
+
+TEST(WAKEUP, TimeoutAcrossTickWrap) {
+  wake_mock.reset();
+  // Just before the tick counter wraps, as an always on unit sees every 49 days with 32 bit ticks
+  wake_time = TICK_MAX_DELAY - 99;
+  WakePolicyEngine pe(FUSB302T<WakeBus>(), 0);
+  runUntilIdle(pe);
+  CHECK_EQUAL(PD_T_TYPEC_SINK_WAIT_CAP + 1, pe.ticksUntilTimeout());
+  // The wait runs out on the other side of the wrap, no sooner and no later
+  wake_time += PD_T_TYPEC_SINK_WAIT_CAP;
+  CHECK_EQUAL(1, pe.ticksUntilTimeout());
+  CHECK_FALSE(pe.thread());
+  wake_time++;
+  CHECK_EQUAL(0, pe.ticksUntilTimeout());
+  CHECK_TRUE(pe.thread());
+}